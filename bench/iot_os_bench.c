@@ -0,0 +1,460 @@
+/* ***************************************************************************
+ *
+ * Copyright 2019-2020 Samsung Electronics All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ ****************************************************************************/
+
+/*
+ * Micro-benchmarks for the POSIX OS port primitives in iot_os_util_posix.c.
+ * Every result is printed as one JSON object per line so runs of different
+ * backends on the same Pi can be diffed or loaded into a spreadsheet:
+ *
+ *   ./iot_os_bench [-n iterations] [-p producers] [-c consumers]
+ *                  [-s item_size] [-t threads] [bench ...]
+ *
+ * Benches: queue_latency queue_throughput eventgroup_wake mutex_contention
+ *          timer_accuracy delay_accuracy periodic_jitter (default: all)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+#include "iot_os_util.h"
+#include "iot_os_util_posix.h"
+
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_QUEUE_MQUEUE)
+#define QUEUE_BACKEND "mqueue"
+#else
+#define QUEUE_BACKEND "ring"
+#endif
+
+static int iterations = 20000;
+static int producers = 1;
+static int consumers = 1;
+static int item_size = 16;
+static int threads = 2;
+
+static unsigned long long _now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int _cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Print summary statistics of a sample set, sorting it in place */
+static void _report_samples(const char *bench, const char *extra,
+		unsigned long long *samples, int count)
+{
+	unsigned long long sum = 0;
+
+	if (count <= 0)
+		return;
+
+	qsort(samples, count, sizeof(samples[0]), _cmp_ull);
+	for (int i = 0; i < count; i++)
+		sum += samples[i];
+
+	printf("{\"bench\":\"%s\",\"queue_backend\":\"%s\"%s,\"samples\":%d,"
+			"\"mean_ns\":%llu,\"min_ns\":%llu,\"p50_ns\":%llu,\"p90_ns\":%llu,"
+			"\"p99_ns\":%llu,\"max_ns\":%llu}\n",
+			bench, QUEUE_BACKEND, extra ? extra : "", count, sum / count,
+			samples[0], samples[count / 2], samples[(count * 9) / 10],
+			samples[(count * 99) / 100], samples[count - 1]);
+	fflush(stdout);
+}
+
+static void _report_rate(const char *bench, const char *extra,
+		unsigned long long ops, unsigned long long elapsed_ns)
+{
+	printf("{\"bench\":\"%s\",\"queue_backend\":\"%s\"%s,\"ops\":%llu,"
+			"\"elapsed_ns\":%llu,\"ops_per_sec\":%.1f}\n",
+			bench, QUEUE_BACKEND, extra ? extra : "", ops, elapsed_ns,
+			elapsed_ns ? ops * 1e9 / elapsed_ns : 0.0);
+	fflush(stdout);
+}
+
+/* Queue latency: ping-pong between two threads, half round trip per sample */
+
+typedef struct {
+	iot_os_queue *ping;
+	iot_os_queue *pong;
+	int count;
+} pingpong_t;
+
+static void *_pong_thread(void *arg)
+{
+	pingpong_t *pp = arg;
+	unsigned char buf[256];
+
+	for (int i = 0; i < pp->count; i++) {
+		iot_os_queue_receive(pp->ping, buf, iot_os_max_delay);
+		iot_os_queue_send(pp->pong, buf, iot_os_max_delay);
+	}
+	return NULL;
+}
+
+static void bench_queue_latency(void)
+{
+	pingpong_t pp;
+	pthread_t thread;
+	unsigned char buf[256] = {0,};
+	unsigned long long *samples = malloc(sizeof(unsigned long long) * iterations);
+	char extra[64];
+	int size = (item_size > (int)sizeof(buf)) ? (int)sizeof(buf) : item_size;
+
+	pp.ping = iot_os_queue_create(1, size);
+	pp.pong = iot_os_queue_create(1, size);
+	pp.count = iterations;
+	if (!samples || !pp.ping || !pp.pong) {
+		fprintf(stderr, "queue_latency: setup failed\n");
+		return;
+	}
+
+	pthread_create(&thread, NULL, _pong_thread, &pp);
+	for (int i = 0; i < iterations; i++) {
+		unsigned long long start = _now_ns();
+		iot_os_queue_send(pp.ping, buf, iot_os_max_delay);
+		iot_os_queue_receive(pp.pong, buf, iot_os_max_delay);
+		samples[i] = (_now_ns() - start) / 2;
+	}
+	pthread_join(thread, NULL);
+
+	snprintf(extra, sizeof(extra), ",\"item_size\":%d", size);
+	_report_samples("queue_latency", extra, samples, iterations);
+
+	iot_os_queue_delete(pp.ping);
+	iot_os_queue_delete(pp.pong);
+	free(samples);
+}
+
+/* Queue throughput: N producers, M consumers, one shared queue */
+
+typedef struct {
+	iot_os_queue *queue;
+	int count;
+} qworker_t;
+
+static void *_producer_thread(void *arg)
+{
+	qworker_t *w = arg;
+	unsigned char buf[256] = {0,};
+
+	for (int i = 0; i < w->count; i++)
+		iot_os_queue_send(w->queue, buf, iot_os_max_delay);
+	return NULL;
+}
+
+static void *_consumer_thread(void *arg)
+{
+	qworker_t *w = arg;
+	unsigned char buf[256];
+
+	for (int i = 0; i < w->count; i++)
+		iot_os_queue_receive(w->queue, buf, iot_os_max_delay);
+	return NULL;
+}
+
+static void bench_queue_throughput(void)
+{
+	int size = (item_size > 256) ? 256 : item_size;
+	int total = (iterations / (producers * consumers)) * producers * consumers;
+	qworker_t prod = { iot_os_queue_create(64, size), total / producers };
+	qworker_t cons = { prod.queue, total / consumers };
+	pthread_t *tids = malloc(sizeof(pthread_t) * (producers + consumers));
+	unsigned long long start;
+	char extra[96];
+
+	if (!prod.queue || !tids || total == 0) {
+		fprintf(stderr, "queue_throughput: setup failed\n");
+		return;
+	}
+
+	start = _now_ns();
+	for (int i = 0; i < consumers; i++)
+		pthread_create(&tids[i], NULL, _consumer_thread, &cons);
+	for (int i = 0; i < producers; i++)
+		pthread_create(&tids[consumers + i], NULL, _producer_thread, &prod);
+	for (int i = 0; i < producers + consumers; i++)
+		pthread_join(tids[i], NULL);
+
+	snprintf(extra, sizeof(extra), ",\"producers\":%d,\"consumers\":%d,\"item_size\":%d,\"queue_length\":64",
+			producers, consumers, size);
+	_report_rate("queue_throughput", extra, total, _now_ns() - start);
+
+	iot_os_queue_delete(prod.queue);
+	free(tids);
+}
+
+/* Event group: time from set_bits to the waiter returning */
+
+typedef struct {
+	iot_os_eventgroup *group;
+	iot_os_eventgroup *ack;
+	unsigned long long set_ns;
+	unsigned long long *samples;
+	int count;
+} egbench_t;
+
+static void *_eg_waiter_thread(void *arg)
+{
+	egbench_t *eb = arg;
+
+	for (int i = 0; i < eb->count; i++) {
+		iot_os_eventgroup_wait_bits_ex(eb->group, 1, true, false, iot_os_max_delay);
+		eb->samples[i] = _now_ns() - __atomic_load_n(&eb->set_ns, __ATOMIC_ACQUIRE);
+		iot_os_eventgroup_set_bits_ex(eb->ack, 1);
+	}
+	return NULL;
+}
+
+static void bench_eventgroup_wake(void)
+{
+	egbench_t eb;
+	pthread_t thread;
+
+	eb.group = iot_os_eventgroup_create();
+	eb.ack = iot_os_eventgroup_create();
+	eb.count = iterations;
+	eb.samples = malloc(sizeof(unsigned long long) * iterations);
+	if (!eb.group || !eb.ack || !eb.samples) {
+		fprintf(stderr, "eventgroup_wake: setup failed\n");
+		return;
+	}
+
+	pthread_create(&thread, NULL, _eg_waiter_thread, &eb);
+	for (int i = 0; i < iterations; i++) {
+		/* Give the waiter time to go to sleep so we measure a real wake */
+		if ((i & 63) == 0)
+			usleep(100);
+		__atomic_store_n(&eb.set_ns, _now_ns(), __ATOMIC_RELEASE);
+		iot_os_eventgroup_set_bits_ex(eb.group, 1);
+		iot_os_eventgroup_wait_bits_ex(eb.ack, 1, true, false, iot_os_max_delay);
+	}
+	pthread_join(thread, NULL);
+
+	_report_samples("eventgroup_wake", NULL, eb.samples, iterations);
+
+	iot_os_eventgroup_delete(eb.group);
+	iot_os_eventgroup_delete(eb.ack);
+	free(eb.samples);
+}
+
+/* Mutex: lock/unlock throughput with T threads hammering one mutex */
+
+typedef struct {
+	iot_os_mutex mutex;
+	volatile unsigned long counter;
+	int count;
+} mxbench_t;
+
+static void *_mutex_thread(void *arg)
+{
+	mxbench_t *mb = arg;
+
+	for (int i = 0; i < mb->count; i++) {
+		iot_os_mutex_lock(&mb->mutex);
+		mb->counter++;
+		iot_os_mutex_unlock(&mb->mutex);
+	}
+	return NULL;
+}
+
+static void bench_mutex_contention(void)
+{
+	mxbench_t mb;
+	pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+	unsigned long long start;
+	char extra[32];
+
+	memset(&mb, 0, sizeof(mb));
+	mb.count = iterations * 10;
+	if (!tids || !iot_os_mutex_init(&mb.mutex)) {
+		fprintf(stderr, "mutex_contention: setup failed\n");
+		free(tids);
+		return;
+	}
+
+	start = _now_ns();
+	for (int i = 0; i < threads; i++)
+		pthread_create(&tids[i], NULL, _mutex_thread, &mb);
+	for (int i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+
+	snprintf(extra, sizeof(extra), ",\"threads\":%d", threads);
+	_report_rate("mutex_contention", extra, (unsigned long long)mb.count * threads,
+			_now_ns() - start);
+
+	iot_os_mutex_destroy(&mb.mutex);
+	free(tids);
+}
+
+/* Timers: how late isexpired flips, and the cost of polling it */
+
+static void bench_timer_accuracy(void)
+{
+	const unsigned int timeout_ms = 5;
+	int count = (iterations / 100 > 0) ? iterations / 100 : 1;
+	unsigned long long *samples = malloc(sizeof(unsigned long long) * count);
+	unsigned long long polls = 0;
+	unsigned long long poll_ns = 0;
+	iot_os_timer timer;
+	char extra[48];
+
+	if (!samples || iot_os_timer_init(&timer) != 0) {
+		fprintf(stderr, "timer_accuracy: setup failed\n");
+		free(samples);
+		return;
+	}
+
+	for (int i = 0; i < count; i++) {
+		unsigned long long start = _now_ns();
+		unsigned long long deadline = start + timeout_ms * 1000000ULL;
+		unsigned long long now;
+
+		iot_os_timer_count_ms(timer, timeout_ms);
+		while (!iot_os_timer_isexpired(timer))
+			polls++;
+		now = _now_ns();
+		poll_ns += now - start;
+		samples[i] = (now > deadline) ? now - deadline : 0;
+	}
+
+	snprintf(extra, sizeof(extra), ",\"timeout_ms\":%u,\"poll_ns\":%llu", timeout_ms,
+			polls ? poll_ns / polls : 0);
+	_report_samples("timer_accuracy", extra, samples, count);
+
+	iot_os_timer_destroy(&timer);
+	free(samples);
+}
+
+static void bench_delay_accuracy(void)
+{
+	const unsigned int delay_ms = 2;
+	int count = (iterations / 100 > 0) ? iterations / 100 : 1;
+	unsigned long long *samples = malloc(sizeof(unsigned long long) * count);
+	char extra[32];
+
+	if (!samples)
+		return;
+
+	for (int i = 0; i < count; i++) {
+		unsigned long long start = _now_ns();
+		iot_os_delay(delay_ms);
+		unsigned long long elapsed = _now_ns() - start;
+		samples[i] = (elapsed > delay_ms * 1000000ULL) ? elapsed - delay_ms * 1000000ULL : 0;
+	}
+
+	snprintf(extra, sizeof(extra), ",\"delay_ms\":%u", delay_ms);
+	_report_samples("delay_accuracy", extra, samples, count);
+	free(samples);
+}
+
+static void bench_periodic_jitter(void)
+{
+	const unsigned int period_ms = 2;
+	int count = (iterations / 100 > 0) ? iterations / 100 : 1;
+	unsigned long long *samples = malloc(sizeof(unsigned long long) * count);
+	iot_os_periodic periodic;
+	char extra[64];
+
+	if (!samples)
+		return;
+
+	iot_os_periodic_init(&periodic, period_ms);
+	for (int i = 0; i < count; i++) {
+		iot_os_periodic_wait(&periodic);
+		samples[i] = periodic.last_slip_us * 1000ULL;
+	}
+
+	snprintf(extra, sizeof(extra), ",\"period_ms\":%u,\"overruns\":%lu", period_ms,
+			periodic.overruns);
+	_report_samples("periodic_jitter", extra, samples, count);
+	free(samples);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} benches[] = {
+	{ "queue_latency", bench_queue_latency },
+	{ "queue_throughput", bench_queue_throughput },
+	{ "eventgroup_wake", bench_eventgroup_wake },
+	{ "mutex_contention", bench_mutex_contention },
+	{ "timer_accuracy", bench_timer_accuracy },
+	{ "delay_accuracy", bench_delay_accuracy },
+	{ "periodic_jitter", bench_periodic_jitter },
+};
+#define BENCH_COUNT (sizeof(benches) / sizeof(benches[0]))
+
+static void _usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [-p producers] [-c consumers] "
+			"[-s item_size] [-t threads] [bench ...]\n", prog);
+	for (unsigned int i = 0; i < BENCH_COUNT; i++)
+		fprintf(stderr, "  %s\n", benches[i].name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct utsname uts;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:p:c:s:t:h")) != -1) {
+		switch (opt) {
+		case 'n': iterations = atoi(optarg); break;
+		case 'p': producers = atoi(optarg); break;
+		case 'c': consumers = atoi(optarg); break;
+		case 's': item_size = atoi(optarg); break;
+		case 't': threads = atoi(optarg); break;
+		default:
+			_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (iterations <= 0 || producers <= 0 || consumers <= 0 || item_size <= 0 || threads <= 0) {
+		_usage(argv[0]);
+		return 1;
+	}
+
+	uname(&uts);
+	printf("{\"bench\":\"host\",\"machine\":\"%s\",\"release\":\"%s\",\"cpus\":%ld,"
+			"\"queue_backend\":\"%s\",\"iterations\":%d}\n",
+			uts.machine, uts.release, sysconf(_SC_NPROCESSORS_ONLN), QUEUE_BACKEND, iterations);
+
+	for (unsigned int i = 0; i < BENCH_COUNT; i++) {
+		bool selected = (optind >= argc);
+
+		for (int j = optind; j < argc && !selected; j++)
+			selected = (strcmp(argv[j], benches[i].name) == 0);
+		if (selected)
+			benches[i].run();
+	}
+
+	return 0;
+}
@@ -0,0 +1,86 @@
+/* ***************************************************************************
+ *
+ * Copyright 2019-2020 Samsung Electronics All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ ****************************************************************************/
+
+/*
+ * Reactor regression checks; exits non-zero on the first failure.
+ * Best run under AddressSanitizer (make check CFLAGS="-O1 -g -fsanitize=address"
+ * LDLIBS+=-fsanitize=address) so use-after-free shows up as a crash.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "iot_os_util.h"
+#include "iot_os_util_posix.h"
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while (0)
+
+static iot_os_reactor *reactor;
+static iot_os_eventgroup *groups[2];
+static int calls;
+
+/* Whichever group is dispatched first deletes the other, which is ready in the same batch */
+static void _remove_sibling(void *source, void *user_data)
+{
+	int sibling = (source == groups[0]) ? 1 : 0;
+
+	calls++;
+	iot_os_eventgroup_wait_bits_ex(source, 1, true, false, 0);
+	if (groups[sibling] == NULL)
+		return;
+	CHECK(iot_os_reactor_remove(reactor, groups[sibling]));
+	iot_os_eventgroup_delete(groups[sibling]);
+	groups[sibling] = NULL;
+}
+
+static void test_callback_removes_sibling(void)
+{
+	reactor = iot_os_reactor_create();
+	CHECK(reactor != NULL);
+
+	for (int i = 0; i < 2; i++) {
+		groups[i] = iot_os_eventgroup_create();
+		CHECK(groups[i] != NULL);
+		CHECK(iot_os_reactor_add_eventgroup(reactor, groups[i], 1, _remove_sibling, NULL));
+		iot_os_eventgroup_set_bits(groups[i], 1);
+	}
+
+	CHECK(iot_os_reactor_run_once(reactor, 100) == 1);
+	CHECK(calls == 1);
+	CHECK((groups[0] == NULL) != (groups[1] == NULL));
+
+	/* The survivor still works and the removed one stays quiet */
+	iot_os_eventgroup_set_bits(groups[0] ? groups[0] : groups[1], 1);
+	CHECK(iot_os_reactor_run_once(reactor, 100) == 1);
+	CHECK(calls == 2);
+
+	iot_os_reactor_delete(reactor);
+	iot_os_eventgroup_delete(groups[0] ? groups[0] : groups[1]);
+}
+
+int main(void)
+{
+	test_callback_removes_sibling();
+	printf("reactor: ok\n");
+	return 0;
+}
@@ -18,12 +18,131 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/timex.h>
 #include "iot_bsp_system.h"
 #include "iot_debug.h"
+#include "iot_os_util_posix.h"
 #include <errno.h>
 
+/*
+ * Pis have no RTC, so the clock starts wherever fake-hwclock (or 1970) left
+ * it. The last time we trusted is kept in LASTTIMEFILE together with the
+ * boot id and CLOCK_BOOTTIME at which it was taken, so it can be carried
+ * forward across process restarts and used as a floor after a reboot.
+ */
+#define LASTTIMEFILE "/var/tmp/stdk_lasttime"
+#define BOOTIDFILE "/proc/sys/kernel/random/boot_id"
+#define TIME_SLEW_MAX_SEC 2	/* smaller offsets are slewed, larger ones stepped */
+#define BOOTID_LEN 37
+
+/*
+ * Reboot re-execs the process in place instead of exiting, so reconnect
+ * does not wait on a supervisor restart. STDK_IOT_CORE_BSP_RPI_COLD_REBOOT
+ * restores the plain exit(0). Provisioning data is already on disk via the
+ * nv_data port; the TLS session and resolved server address live inside
+ * the SDK and are re-established by the new process.
+ */
+#define WARMRESTARTENV "STDK_WARM_RESTART"
+#define WARMRESTART_MAX 3		/* re-execs allowed within WARMRESTART_WINDOW */
+#define WARMRESTART_WINDOW 60		/* seconds */
+#define CMDLINE_MAX 65536
+
+static void _read_boot_id(char *boot_id)
+{
+	FILE *fp = fopen(BOOTIDFILE, "r");
+
+	boot_id[0] = '\0';
+	if (fp) {
+		if (fgets(boot_id, BOOTID_LEN, fp) == NULL)
+			boot_id[0] = '\0';
+		boot_id[strcspn(boot_id, "\n")] = '\0';
+		fclose(fp);
+	}
+}
+
+static void _persist_time(time_t trusted)
+{
+	struct timespec boot;
+	char boot_id[BOOTID_LEN];
+	FILE *fp;
+
+	clock_gettime(CLOCK_BOOTTIME, &boot);
+	_read_boot_id(boot_id);
+
+	fp = fopen(LASTTIMEFILE ".tmp", "w");
+	if (fp == NULL) {
+		IOT_WARN("cannot save time to %s (%d)", LASTTIMEFILE, errno);
+		return;
+	}
+	fprintf(fp, "%ld %ld %s\n", (long)trusted, (long)boot.tv_sec, boot_id);
+	if (fclose(fp) != 0 || rename(LASTTIMEFILE ".tmp", LASTTIMEFILE) != 0) {
+		IOT_WARN("cannot save time to %s (%d)", LASTTIMEFILE, errno);
+		unlink(LASTTIMEFILE ".tmp");
+	}
+}
+
+static int _step_clock(time_t sec)
+{
+	struct timespec ts = { .tv_sec = sec, .tv_nsec = 0 };
+
+	if (clock_settime(CLOCK_REALTIME, &ts) != 0) {
+		if (errno == EPERM)
+			IOT_WARN("no permission to set the clock (needs CAP_SYS_TIME)");
+		else
+			IOT_WARN("clock_settime failed (%d)", errno);
+		return -1;
+	}
+	return 0;
+}
+
+/* Best lower bound on the current time from LASTTIMEFILE; 0 if none saved */
+static time_t _saved_time_estimate(void)
+{
+	long saved_real, saved_boot;
+	char saved_id[BOOTID_LEN] = "";
+	char boot_id[BOOTID_LEN];
+	struct timespec boot;
+	time_t estimate;
+	FILE *fp;
+	int n;
+
+	fp = fopen(LASTTIMEFILE, "r");
+	if (fp == NULL)
+		return 0;
+	n = fscanf(fp, "%ld %ld %36s", &saved_real, &saved_boot, saved_id);
+	fclose(fp);
+	if (n < 2)
+		return 0;
+
+	clock_gettime(CLOCK_BOOTTIME, &boot);
+	_read_boot_id(boot_id);
+
+	// Same boot: the time elapsed since the save is known exactly
+	estimate = saved_real;
+	if (n == 3 && boot_id[0] && strcmp(saved_id, boot_id) == 0 && boot.tv_sec >= saved_boot)
+		estimate += boot.tv_sec - saved_boot;
+
+	return estimate;
+}
+
+/* Move the clock up to the last saved time if it is behind it */
+__attribute__((constructor))
+static void _restore_time(void)
+{
+	struct timespec now;
+	time_t estimate = _saved_time_estimate();
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (now.tv_sec < estimate && _step_clock(estimate) == 0)
+		IOT_INFO("clock restored from %s (was %lds behind)", LASTTIMEFILE,
+				(long)(estimate - now.tv_sec));
+}
+
 const char* iot_bsp_get_bsp_name()
 {
        return "posix";
@@ -34,13 +153,137 @@ const char* iot_bsp_get_bsp_version_string()
        return "";
 }
 
+/* Save the current clock on shutdown unless it is behind what we already know */
+static void _save_time_on_exit(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (now.tv_sec >= _saved_time_estimate())
+		_persist_time(now.tv_sec);
+}
+
+#if !defined(CONFIG_STDK_IOT_CORE_BSP_RPI_COLD_REBOOT)
+static void _cloexec_fds(void)
+{
+	DIR *dir = opendir("/proc/self/fd");
+	struct dirent *entry;
+	int fd;
+
+	if (dir == NULL)
+		return;
+
+	while ((entry = readdir(dir)) != NULL) {
+		fd = atoi(entry->d_name);
+		if (fd > 2 && fd != dirfd(dir))
+			fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+	}
+	closedir(dir);
+}
+
+/* argv of this process, rebuilt from /proc/self/cmdline; NULL on failure */
+static char **_read_cmdline(char **buf)
+{
+	char **argv;
+	size_t len = 0;
+	ssize_t n;
+	int argc = 0;
+	int fd;
+
+	*buf = malloc(CMDLINE_MAX);
+	fd = open("/proc/self/cmdline", O_RDONLY);
+	if (*buf == NULL || fd < 0)
+		goto fail;
+
+	while (len < CMDLINE_MAX - 1 && (n = read(fd, *buf + len, CMDLINE_MAX - 1 - len)) > 0)
+		len += n;
+	close(fd);
+	fd = -1;
+	if (len == 0 || len >= CMDLINE_MAX - 1)
+		goto fail;
+	(*buf)[len] = '\0';
+
+	for (size_t i = 0; i < len; i++)
+		if ((*buf)[i] == '\0')
+			argc++;
+
+	argv = calloc(argc + 1, sizeof(char *));
+	if (argv == NULL)
+		goto fail;
+
+	for (size_t i = 0, arg = 0; i < len; arg++) {
+		argv[arg] = *buf + i;
+		i += strlen(*buf + i) + 1;
+	}
+
+	return argv;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	free(*buf);
+	*buf = NULL;
+	return NULL;
+}
+
+/* Re-exec this process; only returns if that is not possible or advisable */
+static void _warm_restart(void)
+{
+	struct timespec boot;
+	const char *prev = getenv(WARMRESTARTENV);
+	long prev_boot = 0;
+	int count = 0;
+	char env[32];
+	char **argv;
+	char *buf;
+
+	clock_gettime(CLOCK_BOOTTIME, &boot);
+
+	// Don't turn a crash loop into a tight exec loop
+	if (prev && sscanf(prev, "%d %ld", &count, &prev_boot) == 2 &&
+			boot.tv_sec - prev_boot < WARMRESTART_WINDOW && count >= WARMRESTART_MAX) {
+		IOT_WARN("%d warm restarts within %ds, exiting instead", count, WARMRESTART_WINDOW);
+		return;
+	}
+	if (!prev || boot.tv_sec - prev_boot >= WARMRESTART_WINDOW) {
+		count = 0;
+		prev_boot = boot.tv_sec;
+	}
+
+	argv = _read_cmdline(&buf);
+	if (argv == NULL) {
+		IOT_ERROR("cannot read own command line, exiting instead");
+		return;
+	}
+
+	snprintf(env, sizeof(env), "%d %ld", count + 1, prev_boot);
+	setenv(WARMRESTARTENV, env, 1);
+
+	IOT_INFO("warm restart: re-executing %s", argv[0]);
+	IOT_OS_TRACE_DUMP();
+	fflush(NULL);
+	_cloexec_fds();
+
+	execv("/proc/self/exe", argv);
+
+	IOT_ERROR("warm restart exec failed (%d), exiting instead", errno);
+	free(argv);
+	free(buf);
+}
+#endif
+
 void iot_bsp_system_reboot()
 {
+	_save_time_on_exit();
+#if !defined(CONFIG_STDK_IOT_CORE_BSP_RPI_COLD_REBOOT)
+	_warm_restart();
+#endif
 	exit(0);
 }
 
 void iot_bsp_system_poweroff()
 {
+	_save_time_on_exit();
 	exit(0);
 }
 
@@ -60,6 +303,42 @@ iot_error_t iot_bsp_system_set_time_in_sec(const char* time_in_sec)
 {
 	IOT_WARN_CHECK(time_in_sec == NULL, IOT_ERROR_INVALID_ARGS, "time data is NULL");
 
+	struct timespec now = {0,};
+	struct timex tx;
+	char *end;
+	long long sec;
+	long long offset;
+
+	errno = 0;
+	sec = strtoll(time_in_sec, &end, 10);
+	if (errno != 0 || end == time_in_sec || sec <= 0) {
+		IOT_ERROR("invalid time '%s'", time_in_sec);
+		return IOT_ERROR_INVALID_ARGS;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	offset = sec - now.tv_sec;
+
+	// Leave an NTP-disciplined clock alone; server time only has 1s resolution
+	memset(&tx, 0, sizeof(tx));
+	if (adjtimex(&tx) != -1 && !(tx.status & STA_UNSYNC) && llabs(offset) <= TIME_SLEW_MAX_SEC) {
+		_persist_time(now.tv_sec);
+		return IOT_ERROR_NONE;
+	}
+
+	if (llabs(offset) <= TIME_SLEW_MAX_SEC) {
+		memset(&tx, 0, sizeof(tx));
+		tx.modes = ADJ_OFFSET_SINGLESHOT;
+		tx.offset = (long)(offset * 1000000);
+		if (adjtimex(&tx) == -1)
+			IOT_WARN("cannot slew clock by %llds (%d)", offset, errno);
+	} else if (_step_clock((time_t)sec) == 0) {
+		IOT_INFO("clock stepped by %llds", offset);
+	}
+
+	// Save the server's time even if we could not apply it
+	_persist_time((time_t)sec);
+
 	return IOT_ERROR_NONE;
 }
 
@@ -36,11 +36,25 @@ With thanks to Kwang-Hui of Samsung who patiently answered my many questions dur
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/nl80211.h>
+#include <linux/rtnetlink.h>
+#include <net/if_arp.h>
+#include <arpa/inet.h>
+#include <sys/utsname.h>
 
 #include "iot_bsp_wifi.h"
+#include "iot_bsp_wifi_rpi.h"
 #include "iot_error.h"
 #include "iot_debug.h"
 #include "iot_os_util.h"
+#include "iot_os_util_posix.h"
 #include "iot_util.h"
 
 /*****************************
@@ -58,27 +72,106 @@ With thanks to Kwang-Hui of Samsung who patiently answered my many questions dur
 #define DHCPCDCONF "/etc/dhcpcd.conf"
 #define DHCPCDSAVE "/etc/dhcpcd_saved.conf"
 #define DHCPCD_AP "/etc/dhcpcd_ap.conf"
+#define DNSMASQCONF "/etc/dnsmasq.conf"
+#define CONFTMPFILE "./__tempconfline"
+#define CONCURRENTAPDEV "uap0"      // virtual AP interface created on the station's radio
 
 #define configtag_ETH "USE_ETHERNET"
 #define configtag_AP "AP_SHUTDOWN"
 #define configtag_devSTA "STATION_DEV"
 #define configtag_devAP "AP_DEV"
 #define configtag_devETH "ETH_DEV"
+#define configtag_SCANTTL "SCAN_CACHE_TTL"
+#define configtag_CONCURRENT "CONCURRENT_AP"
 
-#define MAXDEVNAMESIZE 10
+#define MAXDEVNAMESIZE 15          // IFNAMSIZ - 1; fits predictable names like enxb827eb123456
+#define MAXLINKS 32
 
-#define SSIDWAITRETRIES 6
-#define SSIDWAITTIME 999999
-#define SCANMODEWAITTIME 800000
-#define SOFTAPWAITTIME 999999
+#define SOFTAPWAITTIME 999999       // fixed settle time, used only if the link event monitor isn't running
 #define SEQSYSCMDWAIT 500000
 #define SCANRETRIES 4
+#define SCANBACKOFFMIN 250          // ms before the first scan retry; doubles each retry
+#define MODEPOLLMIN 50              // ms; first re-check of a set_mode condition with no event behind it
+#define MODEPOLLMAX 800             // ms; backoff ceiling for those re-checks
+#define SCANTIMEOUT 10000           // ms to wait for nl80211 scan completion
+#define SCANCACHETTL 60             // default seconds a scan result is served from cache (0 = always scan)
+#define SCANEVT_REFRESH 0x01
+#define LINKEVT_CHANGE 0x01         // some tracked link's state changed
+#define MAXTRACKEDLINKS 4
+#define MAXLINKADDRS 4
+#define EVENTPOLLTIME 1000          // ms between checks for monitor shutdown
+
+#define WPACTRLDIR "/var/run/wpa_supplicant"
+#define CTRLREPLYSIZE 4096          // control interface reply buffer
+#define CTRLREPLYTIMEOUT 2000       // ms to wait for a control interface reply
+#define CTRLHELDEVENTS 4            // events kept aside during a request for the next wait
+#define CTRLEVENTSIZE 128
+#define WPACONNTIMEOUT 8000         // ms to wait for association after SELECT_NETWORK
+#define HOSTAPDCTRLDIR "/var/run/hostapd"
+#define HOSTAPDCTRLIFACE "ctrl_interface=" HOSTAPDCTRLDIR "\nctrl_interface_group=netdev\n"
+#define SOFTAPSTARTTIMEOUT 5000     // ms for hostapd to bring the AP up after start
+#define CTRLOPENRETRYTIME 100000    // us between attempts to reach a control socket not yet created
+
+#define PHASEHIST_SUB 8              // linear sub-buckets per power of two (12.5% precision)
+#define PHASEHIST_BUCKETS 128       // covers up to 2^18 ms; longer samples land in the last bucket
+#define PHASE_SCOPE(phase) \
+    struct phasetimer _phasetimer __attribute__((cleanup(_phase_end))) = { (phase), _monotonic_ms() }
+
+#define NLREQSIZE 1024              // netlink request buffer
+#define NLBUFSIZE 32768             // netlink receive buffer (scan dumps are large)
+#define NLREPLYTIMEOUT 2000         // ms to wait for a netlink reply
+
+#define NLA_OK(nla,len)     ((len) >= (int)sizeof(struct nlattr) && (nla)->nla_len >= sizeof(struct nlattr) && (nla)->nla_len <= (len))
+#define NLA_NEXT(nla,len)   ((len) -= NLA_ALIGN((nla)->nla_len), (struct nlattr *)((char *)(nla) + NLA_ALIGN((nla)->nla_len)))
+#define NLA_DATA(nla)       ((void *)((char *)(nla) + NLA_HDRLEN))
+#define NLA_PAYLOAD(nla)    ((int)(nla)->nla_len - NLA_HDRLEN)
 
 extern int errno;
 
 /** DECLARE FUNCTIONS CONTAINED IN THIS FILE **/
 
-int _perform_scan();
+typedef int (*nlmsg_cb_t)(struct nlmsghdr *nlh, void *arg);
+
+struct scandata;
+struct ctrlsock;
+struct modectx;
+struct modestep;
+struct phasehist;
+
+struct phasetimer {
+    iot_bsp_wifi_phase_t phase;
+    unsigned long long start;
+};
+
+int _perform_scan(struct scandata *store);
+int _perform_scan_iw(struct scandata *store);
+int _refresh_scan();
+bool _scancache_fresh(unsigned int *generation, int *apcount);
+void _scan_refresher(void *arg);
+unsigned long long _monotonic_ms();
+int _start_eventmonitor();
+void _eventmonitor(void *arg);
+void _tracklink(const char *devname);
+bool _seedlinks();
+struct linkstate *_findlink(struct linkstate *table, int ifindex);
+int _rtevent_cb(struct nlmsghdr *nlh, void *arg);
+int _wifievent_cb(struct nlmsghdr *nlh, void *arg);
+void _notify_event(iot_wifi_event_t event, iot_error_t error);
+int _scan_event_cb(struct nlmsghdr *nlh, void *arg);
+int _scan_dump_cb(struct nlmsghdr *nlh, void *arg);
+void _parse_ies(const uint8_t *ie, int len, uint16_t capability, iot_wifi_scan_result_t *ap);
+int _nlsocket(int protocol);
+struct nlmsghdr *_nlmsg_init(void *buf, uint16_t type, uint16_t flags, size_t hdrlen);
+struct nlmsghdr *_genlmsg_init(void *buf, uint16_t family, uint8_t cmd, uint16_t flags);
+struct nlattr *_nla_put(struct nlmsghdr *nlh, uint16_t type, const void *data, uint16_t len);
+void _nla_nest_end(struct nlmsghdr *nlh, struct nlattr *nest);
+void _nla_parse(struct nlattr **tb, int max, struct nlattr *nla, int len);
+struct nlattr *_genl_attrs(struct nlmsghdr *nlh, int *len);
+int _nlpoll(int fd, int timeout_ms);
+int _nltalk(int fd, struct nlmsghdr *req, nlmsg_cb_t cb, void *arg);
+int _nlwait(int fd, nlmsg_cb_t cb, void *arg, int timeout_ms);
+int _genl_family_cb(struct nlmsghdr *nlh, void *arg);
+int _genl_resolve(int fd, const char *name, const char *group, uint16_t *familyid, uint32_t *groupid);
 void _parsemac(char *textptr, uint8_t *hexbuf);
 unsigned int _htoi (const char *ptr);
 int _getnumeric(int maxdigits, char *text);
@@ -91,30 +184,134 @@ int _softblock(char *dev, char set);
 int _waitWifiConn(char *dev, char *ssid);
 int _SoftAPControl(char *cmd);
 int _initDevNames();
+int _getlink_cb(struct nlmsghdr *nlh, void *arg);
+int _getwiphyif_cb(struct nlmsghdr *nlh, void *arg);
+bool _sysfsexists(const char *devname, const char *entry);
+bool _concurrentsupported(const char *dev);
+int _wifiinfo(const char *dev, uint32_t *wiphy, uint32_t *freq, uint8_t *mac);
+int _wifiinfo_cb(struct nlmsghdr *nlh, void *arg);
+int _wiphy_dump(uint32_t wiphy, nlmsg_cb_t cb, void *arg);
+int _ifcomb_cb(struct nlmsghdr *nlh, void *arg);
+int _freq2channel(uint32_t freq);
+int _bands_cb(struct nlmsghdr *nlh, void *arg);
+bool _apiface(bool create);
+bool _getconfline(char *fname, char *key, char *value, size_t len);
+bool _setconfline(char *fname, char *key, char *value);
+bool _addconfline(char *fname, char *line, bool *added);
+iot_error_t _step_apiface(struct modectx *ctx);
 int _setupHostapd(char*ssid, char *password, char *iface);
 int _updateHfile(char *fname, char *ssid,char *password, char*iface);
 int _switchSSID(char *dev, char *ssid);
+int _wpa_findnetwork(struct ctrlsock *ctrl, const char *ssid);
+int _wpa_status(struct ctrlsock *ctrl, char *state, char *ssid);
+int _ctrl_open(struct ctrlsock *ctrl, const char *dir, const char *dev);
+void _ctrl_close(struct ctrlsock *ctrl);
+int _ctrl_request(struct ctrlsock *ctrl, const char *cmd, char *reply, size_t replylen);
+int _ctrl_waitevent(struct ctrlsock *ctrl, const char **events, int timeout_ms);
 bool _checkfortestdevfile();
 bool _checksoftapcontrol(char *dir);
 bool _switchmode(char *mode);
+bool _switchmode_dhcpcd(char *mode);
+int _nladdr(uint16_t cmd, const char *dev, uint32_t addr, int prefix);
+bool _setapaddress(const char *dev, bool add);
+bool _wpacommand(const char *dev, const char *cmd);
 bool _checkstartSoftAP(char *service);
+bool _waitSoftAP(char *dev, int timeout_ms);
 bool _restorehfile(char *backupfile);
 bool _restoreAP();
 int _pipecommand(char *command);
+FILE *_popencmd(const char *command, const char *mode);
+int _pclosecmd(FILE *pf);
+iot_error_t _setmode(iot_wifi_conf *conf);
+iot_error_t _runsteps(struct modectx *ctx, const struct modestep *steps);
+bool _waitfor(bool (*cond)(const char *dev), const char *dev, unsigned long long deadline, const char *what);
+bool _cond_linkup(const char *dev);
+bool _cond_carrieroff(const char *dev);
+bool _cond_ipv4(const char *dev);
+bool _cond_apaddress(const char *dev);
+bool _cond_wpaready(const char *dev);
+bool _readapaddress(char *fname, const char *dev);
+iot_error_t _step_stopsoftap(struct modectx *ctx);
+iot_error_t _step_restoreap(struct modectx *ctx);
+iot_error_t _step_scan(struct modectx *ctx);
+iot_error_t _step_stationready(struct modectx *ctx);
+iot_error_t _step_associate(struct modectx *ctx);
+iot_error_t _step_stationaddress(struct modectx *ctx);
+iot_error_t _step_hostapdconf(struct modectx *ctx);
+iot_error_t _step_apaddress(struct modectx *ctx);
+iot_error_t _step_stopfullap(struct modectx *ctx);
+iot_error_t _step_startsoftap(struct modectx *ctx);
+void _modewait(useconds_t usec);
 int _checkexistfile(char *filename);
+void _phase_end(struct phasetimer *timer);
+void _phase_record(iot_bsp_wifi_phase_t phase, unsigned long ms);
+int _phase_bucket(unsigned long ms);
+unsigned long _phase_bucketvalue(int bucket);
+unsigned long _phase_percentile(const struct phasehist *hist, unsigned int pct);
+void _platformid(char *buf, size_t len);
+void _loadphasehist();
+void _savephasehist();
 
 /** DEFINE GLOBAL STATIC VARIABLES **/
 
 struct scandata {
     int apcount;
+    unsigned int generation;                // bumped each time a new scan is published
+    unsigned long long updated_ms;          // CLOCK_MONOTONIC time of that scan
     iot_wifi_scan_result_t apdata[IOT_WIFI_MAX_SCAN_RESULT];
 };
 
-static struct scandata scanstore;
+struct ctrlsock {
+    int fd;
+    struct sockaddr_un local;
+    int pending;                            // events that arrived while awaiting a reply
+    char held[CTRLHELDEVENTS][CTRLEVENTSIZE];
+};
+
+struct linkinfo {
+    int ifindex;
+    char name[MAXDEVNAMESIZE+1];
+    uint8_t mac[IOT_WIFI_MAX_BSSID_LEN];
+    bool carrier;
+};
+
+struct linklist {
+    int count;
+    struct linkinfo link[MAXLINKS];
+};
+
+struct linkstate {
+    char name[MAXDEVNAMESIZE+1];
+    int ifindex;
+    bool up;
+    bool carrier;                           // for wifi: associated (station) / beaconing (AP)
+    int addrcount;
+    uint32_t addrs[MAXLINKADDRS];           // IPv4, network order
+    int stations;                           // clients associated while in AP mode
+    uint16_t reason;                        // last disconnect reason or failed connect status
+};
+
+static struct scandata scanstore;           // published results; guarded by scanlock
+static iot_os_mutex scanlock;
+static iot_os_mutex scanrunlock;            // one scan at a time
+static iot_os_eventgroup *scanevents = NULL;
+static iot_os_thread scanthread = NULL;
+static int ScanCacheTTL = SCANCACHETTL;
+static bool STA_ON = false;                 // station interface in use; background refresh allowed
+static struct linkstate linkstates[MAXTRACKEDLINKS];   // guarded by linklock
+static int linkcount = 0;
+static iot_os_mutex linklock;
+static iot_os_eventgroup *linkevents = NULL;
+static iot_os_thread evthread = NULL;
+static uint16_t nl80211family = 0;
+static iot_bsp_wifi_event_cb_t wifi_event_cb = NULL;
 
 static bool Ethernet = true;
 static bool ManageAP = true;
 static bool ConcurrentWifi = false;
+static bool ConcurrentRequested = false;        // CONCURRENT_AP = Y in RPISetup.conf
+static int apchannel = 0;                       // channel forced into hostapd.conf (0 = as configured)
+static int wifibands = -1;                      // bit per usable nl80211_band; -1 until iot_bsp_wifi_get_freq() asks
 static bool DualWifidev = false;
 static bool APWifionly = false;
 static bool APWifionlyRestore = false;
@@ -126,6 +323,10 @@ static char wifi_ap_dev[MAXDEVNAMESIZE+1] = "";
 static char eth_dev[MAXDEVNAMESIZE+1] = "";
 static char SOFTAPSTART[60] = "";
 static char SOFTAPSTOP[60] = "";
+static struct phasehist *phasehists = NULL;  // IOT_BSP_WIFI_PHASE_MAX entries; guarded by histlock
+static iot_os_mutex histlock;
+static uint32_t apaddress = 0;             // static SoftAP IPv4 address from dhcpcd_ap.conf (network order)
+static int apprefix = 24;
 static uint8_t wifimacaddr[IOT_WIFI_MAX_BSSID_LEN];
 static uint8_t ethmacaddr[IOT_WIFI_MAX_BSSID_LEN];
 
@@ -151,6 +352,8 @@ iot_error_t iot_bsp_wifi_init()
 
     if (!WIFI_INITIALIZED)  {
 
+        _loadphasehist();
+
         if (!_getrpiconf(DEFAULTDIR)) {                           // read config file
 
             if (!_initDevNames()) {                     // initialize device names & info
@@ -213,6 +416,37 @@ iot_error_t iot_bsp_wifi_init()
 			return IOT_ERROR_CONN_OPERATE_FAIL;
         }
 
+        // Concurrent station + SoftAP on one radio: the AP gets its own virtual interface
+        if (STWifionly && ConcurrentRequested) {
+
+            bool denyadded = false;
+
+            // dhcpcd must leave uap0 alone: its address is set directly, and dhcpcd's
+            // wpa_supplicant hook would otherwise start a station on the AP interface
+            if (_concurrentsupported(wifi_sta_dev) && _readapaddress(DHCPCD_AP,wifi_sta_dev) &&
+                    _setconfline(DNSMASQCONF,"interface",CONCURRENTAPDEV) &&
+                    _addconfline(DHCPCDCONF,"denyinterfaces " CONCURRENTAPDEV,&denyadded)) {
+
+                if (denyadded && _pipecommand("sudo dhcpcd --rebind") != 0)
+                    IOT_WARN("[rpi] dhcpcd did not reload %s; restart it before provisioning",DHCPCDCONF);
+
+                ConcurrentWifi=true;
+                DualWifidev=true;                       // from here on it behaves like a second wifi device
+                STWifionly=false;
+                strcpy(wifi_ap_dev,CONCURRENTAPDEV);
+                IOT_INFO("[rpi] Concurrent mode: SoftAP on %s alongside station %s",wifi_ap_dev,wifi_sta_dev);
+            } else
+                IOT_WARN("[rpi] Concurrent AP not available on %s; SoftAP will replace the station link",wifi_sta_dev);
+
+        } else if (STWifionly) {
+
+            char dnsiface[MAXDEVNAMESIZE+1];
+
+            // Undo the dnsmasq binding of an earlier concurrent setup
+            if (_getconfline(DNSMASQCONF,"interface",dnsiface,sizeof(dnsiface)) && strcmp(dnsiface,CONCURRENTAPDEV) == 0)
+                _setconfline(DNSMASQCONF,"interface",wifi_sta_dev);
+        }
+
         // Make sure dhcpcd AP config file exists
         if (STWifionly) {
             errnum = _checkexistfile(DHCPCD_AP);
@@ -223,7 +457,25 @@ iot_error_t iot_bsp_wifi_init()
                     IOT_ERROR("[rpi] Cannot verify dhcpcd AP config file");
                 return IOT_ERROR_CONN_OPERATE_FAIL;
             }
+            if (!_readapaddress(DHCPCD_AP,wifi_sta_dev))
+                IOT_WARN("[rpi] No static ip_address for %s in %s; mode switches will swap dhcpcd configs",wifi_sta_dev,DHCPCD_AP);
         }
+
+        // Scan cache; the refresher warms it now so provisioning finds results waiting
+        iot_os_mutex_init(&scanlock);
+        iot_os_mutex_init(&scanrunlock);
+        STA_ON = (strcmp(wifi_sta_dev,"") != 0) && !AP_ON;
+
+        if (ScanCacheTTL > 0) {
+            scanevents = iot_os_eventgroup_create();
+            if (scanevents && iot_os_thread_create(_scan_refresher, "scancache", 8192, NULL, 1, &scanthread) == IOT_OS_TRUE)
+                iot_os_eventgroup_set_bits(scanevents, SCANEVT_REFRESH);
+            else
+                IOT_WARN("[rpi] Could not start scan cache refresher; scans will run on demand");
+        }
+
+        if (!_start_eventmonitor())
+            IOT_WARN("[rpi] Could not start link event monitor");
     }
 
 	WIFI_INITIALIZED = true;
@@ -314,6 +566,22 @@ bool _getrpiconf(char *currdir) {
                                         strcpy(eth_dev,parmstr);
 
                                 }
+                                else {
+                                    if ((textptr = strstr(readline,configtag_SCANTTL))) {
+
+                                        if(_parseconfparm(parmstr,textptr))
+
+                                            ScanCacheTTL = atoi(parmstr);
+                                    }
+                                    else {
+                                        if ((textptr = strstr(readline,configtag_CONCURRENT))) {
+
+                                            if(_parseconfparm(parmstr,textptr))
+
+                                                ConcurrentRequested = ((*parmstr == 'Y') || (*parmstr == 'y'));
+                                        }
+                                    }
+                                }
 
                             }
                         }
@@ -414,17 +682,15 @@ Initialize global variables for station, AP, and Ethernet devices
 
 int _initDevNames() {
 
-    FILE *pf;
-    const int maxdatasize = 100;
-    char data[maxdatasize];
-    char devname[MAXDEVNAMESIZE+1];
-    char devtype[10];
-    char command[40];
-    uint8_t tmpmac[IOT_WIFI_MAX_BSSID_LEN];
-    bool found = false;
-    bool done = false;
+    struct linklist *links;
+    struct linkinfo *eth = NULL;
+    uint32_t req[NLREQSIZE/4];
+    struct nlmsghdr *nlh;
+    uint16_t family;
+    int fd;
+    int ret;
     int i;
-    char *textptr;
+    IOT_OS_TRACE_SCOPE("initDevNames", NULL);
 
 
     if(_checkfortestdevfile())      // If test device file exists, we'll pick up device names from there
@@ -434,164 +700,149 @@ int _initDevNames() {
 
     strcpy(eth_dev,"");
 
-    pf = popen("ls /sys/class/net","r");
-
-    if (pf)  {
-        while (! done) {
-            if(fgets(data,maxdatasize,pf)) {
-
-                i = 0;
-                while ((*(data+i) != ' ') && (*(data+i) != '\n'))  {        // Ethernet device will be first text in ls command output
-                    devname[i] = *(data+i);
-                    ++i;
-                }
-
-                devname[i] = '\0';
-                if (strcmp(devname,"eth0") == 0) {
-                    done = true;
-                    found = true;
-                }
-            } else
-                done = true;
-        } // end while loop
-
-        pclose(pf);
-
-        if (! found) {
-            IOT_WARN("[rpi] eth0 not found",devname);
-            Ethernet = false;
-        } else {
-
-            strcpy(eth_dev,devname);            // Found device name; save it in global static variable
-
-            sprintf(command,"cat /sys/class/net/%s/carrier",devname);
-            pf = popen(command,"r");
-            if (pf)  {
-
-                if(fgets(data,maxdatasize,pf)) {
-
-                    pclose(pf);
-                    if (*data == '1') {
-
-                        Ethernet = true;
-
-                    } else {
-
-                        IOT_INFO("Ethernet device %s not connected",devname);
-                        Ethernet = false;
-
-                    }
-                } else {
-                    IOT_ERROR("[rpi] Could not read Ethernet status %s",devname);
-                    pclose(pf);
-                    Ethernet = false;
-                }
-            } else {
-                IOT_ERROR("[rpi] Carrier file not found for %s",devname);
-                Ethernet = false;
-            }
-
-            // Now get the Ethernet mac address
+    links = calloc(1, sizeof(struct linklist));
+    fd = _nlsocket(NETLINK_ROUTE);
+    if (!links || fd < 0) {
+        IOT_ERROR("[rpi] Could not read network device list");
+        free(links);
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
 
-            if (Ethernet) {
-                sprintf(command,"cat /sys/class/net/%s/address",devname);
-                pf = popen(command,"r");
-                if (pf)  {
+    nlh = _nlmsg_init(req, RTM_GETLINK, NLM_F_DUMP, sizeof(struct ifinfomsg));
+    ret = _nltalk(fd, nlh, _getlink_cb, links);
+    close(fd);
 
-                    if(fgets(data,maxdatasize,pf)) {
-                        pclose(pf);
-                        _parsemac(data,ethmacaddr);
+    if (ret < 0) {
+        IOT_ERROR("[rpi] Could not read network device list; error #%d", -ret);
+        free(links);
+        return 0;
+    }
 
-                    } else {
-                        IOT_ERROR("[rpi] Could not read Ethernet mac address %s",devname);
-                        pclose(pf);
-                    }
-                } else {
-                    IOT_ERROR("[rpi] Could not check Ethernet mac address %s",devname);
-                }
-            }
-        }
+    // Wired = Ethernet-type, backed by a device, not wireless; prefer one with carrier
+    for (i = 0; i < links->count; i++) {
+        if (_sysfsexists(links->link[i].name, "wireless") || _sysfsexists(links->link[i].name, "phy80211") ||
+                !_sysfsexists(links->link[i].name, "device"))
+            continue;
+        if (!eth || (links->link[i].carrier && !eth->carrier))
+            eth = &links->link[i];
+    }
 
+    if (!eth) {
+        IOT_WARN("[rpi] No Ethernet device found");
+        Ethernet = false;
     } else {
 
-        IOT_ERROR("[rpi] Could not read network device directory");
-        Ethernet = false;
+        strcpy(eth_dev,eth->name);          // Found device name; save it in global static variable
 
+        if (eth->carrier) {
+            Ethernet = true;
+            memcpy(ethmacaddr,eth->mac,IOT_WIFI_MAX_BSSID_LEN);
+        } else {
+            IOT_INFO("Ethernet device %s not connected",eth_dev);
+            Ethernet = false;
+        }
     }
 
+    free(links);
+
     // NOW GET WIRELESS DEVICE NAMES
 
     strcpy(wifi_ap_dev,"");
     strcpy(wifi_sta_dev, "");
 
-    pf = popen("iw dev","r");
-
-    if (pf) {
-        while(fgets(data,maxdatasize,pf)) {             // search for Interface line
-
-            if ((textptr = strstr(data,"Interface"))) {
+    fd = _nlsocket(NETLINK_GENERIC);
+    if (fd < 0)
+        return 0;
 
-                i = 0;
-                textptr += 10;
+    if (_genl_resolve(fd, NL80211_GENL_NAME, NULL, &family, NULL) < 0) {
+        IOT_INFO("[rpi] No wireless driver (nl80211) present");
+        close(fd);
+        return 1;
+    }
 
-                while ((*(textptr+i) != ' ') && (*(textptr+i) != '\n'))  {             // get the device name
+    nlh = _genlmsg_init(req, family, NL80211_CMD_GET_INTERFACE, NLM_F_DUMP);
+    ret = _nltalk(fd, nlh, _getwiphyif_cb, NULL);
+    close(fd);
 
-                    *(devname+i) = *(textptr+i);
-                    ++i;
-                }
-                devname[i] ='\0';
-                found = false;
+    if (ret < 0) {
+        IOT_ERROR("[rpi] Could not list wireless interfaces; error #%d", -ret);
+        return 0;
+    }
 
-                while(fgets(data,maxdatasize,pf) && !found) {     // search for type line
-                    if ((textptr = strstr(data,"type"))) {
+    return 1;
 
-                        i = 0;
-                        textptr += 5;
+}
 
-                        while ((*(textptr+i) != ' ') && (*(textptr+i) != '\n')) {       // get the type descriptor
+// RTM_GETLINK dump: collect Ethernet-type links
+int _getlink_cb(struct nlmsghdr *nlh, void *arg) {
 
-                            *(devtype+i) = *(textptr+i);
-                            ++i;
-                        }
-                        devtype[i] = '\0';
+    struct linklist *links = arg;
+    struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+    struct nlattr *tb[IFLA_MAX+1];
+    struct linkinfo *link;
 
-                        if (strcmp(devtype,"managed") == 0) {
-                            strcpy(wifi_sta_dev, devname);
-                            memcpy(wifimacaddr,tmpmac,IOT_WIFI_MAX_BSSID_LEN);
-                        }
-                        else {
-                            if (strcmp(devtype,"AP") == 0) {
-                                strcpy(wifi_ap_dev,devname);
-                                if (wifimacaddr[0] == 0)
-                                    memcpy(wifimacaddr,tmpmac,IOT_WIFI_MAX_BSSID_LEN);
+    if (nlh->nlmsg_type != RTM_NEWLINK || ifi->ifi_type != ARPHRD_ETHER || links->count >= MAXLINKS)
+        return 0;
 
-                            }
-                        }
-                        found = true;
+    _nla_parse(tb, IFLA_MAX, (struct nlattr *)IFLA_RTA(ifi), IFLA_PAYLOAD(nlh));
+    if (!tb[IFLA_IFNAME] || NLA_PAYLOAD(tb[IFLA_IFNAME]) > MAXDEVNAMESIZE + 1)
+        return 0;
 
-                    } else {
+    link = &links->link[links->count++];
+    link->ifindex = ifi->ifi_index;
+    strncpy(link->name, NLA_DATA(tb[IFLA_IFNAME]), MAXDEVNAMESIZE);
+    link->name[MAXDEVNAMESIZE] = '\0';
+    if (tb[IFLA_ADDRESS] && NLA_PAYLOAD(tb[IFLA_ADDRESS]) == IOT_WIFI_MAX_BSSID_LEN)
+        memcpy(link->mac, NLA_DATA(tb[IFLA_ADDRESS]), IOT_WIFI_MAX_BSSID_LEN);
+    if (tb[IFLA_CARRIER])
+        link->carrier = *(uint8_t *)NLA_DATA(tb[IFLA_CARRIER]) != 0;
 
-                        if ((textptr = strstr(data,"addr")))
-                            _parsemac(textptr+5,tmpmac);        // grab the mac address
+    return 0;
+}
 
-                    }
+// nl80211 GET_INTERFACE dump: pick up the station and AP interfaces
+int _getwiphyif_cb(struct nlmsghdr *nlh, void *arg) {
 
-                }   // end search-for-type loop
-            }
+    struct nlattr *tb[NL80211_ATTR_MAX+1];
+    struct nlattr *nla;
+    const char *devname;
+    uint8_t *mac = NULL;
+    uint32_t iftype;
+    int len;
 
-        }    // end Interface search loop
+    nla = _genl_attrs(nlh, &len);
+    _nla_parse(tb, NL80211_ATTR_MAX, nla, len);
+    if (!tb[NL80211_ATTR_IFNAME] || !tb[NL80211_ATTR_IFTYPE] || NLA_PAYLOAD(tb[NL80211_ATTR_IFNAME]) > MAXDEVNAMESIZE + 1)
+        return 0;
 
-        pclose(pf);
+    devname = NLA_DATA(tb[NL80211_ATTR_IFNAME]);
+    iftype = *(uint32_t *)NLA_DATA(tb[NL80211_ATTR_IFTYPE]);
+    if (tb[NL80211_ATTR_MAC] && NLA_PAYLOAD(tb[NL80211_ATTR_MAC]) == IOT_WIFI_MAX_BSSID_LEN)
+        mac = NLA_DATA(tb[NL80211_ATTR_MAC]);
 
+    if (iftype == NL80211_IFTYPE_STATION) {
+        strcpy(wifi_sta_dev, devname);
+        if (mac)
+            memcpy(wifimacaddr,mac,IOT_WIFI_MAX_BSSID_LEN);
+    }
+    else if (iftype == NL80211_IFTYPE_AP) {
+        strcpy(wifi_ap_dev,devname);
+        if (mac && wifimacaddr[0] == 0)
+            memcpy(wifimacaddr,mac,IOT_WIFI_MAX_BSSID_LEN);
+    }
 
-    } else {
+    return 0;
+}
 
-        IOT_ERROR("[rpi] Could not perform iw dev command");
-        return 0;
-    }
+// Check for an entry under /sys/class/net/<dev>/
+bool _sysfsexists(const char *devname, const char *entry) {
 
-    return 1;
+    char path[80];
 
+    snprintf(path, sizeof(path), "/sys/class/net/%s/%s", devname, entry);
+    return access(path, F_OK) == 0;
 }
 // Make sure start and stop script files are found
 bool _checksoftapcontrol(char *dir) {
@@ -705,7 +956,7 @@ int _isupIface(char *devname) {
     const int maxdatasize = 1200;
     char data[maxdatasize];
     char command[300];
-    char devsearch[10];
+    char devsearch[MAXDEVNAMESIZE+2];
     char *lineptr;
     char *delim1;
     char *delim2;
@@ -714,13 +965,13 @@ int _isupIface(char *devname) {
     sprintf(command,"ip link show ");
     strcat(command,devname);
 
-    pf = popen(command,"r");
+    pf = _popencmd(command,"r");
 
     if (pf)  {
 
         if(fgets(data,maxdatasize,pf)) {
 
-            pclose(pf);
+            _pclosecmd(pf);
             strcpy(devsearch,devname);
             strcat(devsearch,":");
             lineptr = strstr(data,devsearch);
@@ -741,7 +992,7 @@ int _isupIface(char *devname) {
                 }
             }
         } else
-            pclose(pf);
+            _pclosecmd(pf);
 
     }
 
@@ -769,7 +1020,9 @@ int _isconfWifi(char *devname, char *ssid) {
     strcpy(searchstr,"Interface ");
     strcat(searchstr,devname);
 
-    pf = popen(command,"r");
+    pf = _popencmd(command,"r");
+    if (!pf)
+        return(0);
 
     if(fgets(data,maxdatasize,pf)) {
 
@@ -793,15 +1046,16 @@ int _isconfWifi(char *devname, char *ssid) {
             }
 
         } else {
-            pclose(pf);
+            _pclosecmd(pf);
             return(0);
         }
 
-        pclose(pf);
+        _pclosecmd(pf);
         return(1);
 
     }
 
+    _pclosecmd(pf);
     return(0);
 
 }
@@ -834,247 +1088,593 @@ int _checkexistfile(char *filename) {
 
 iot_error_t iot_bsp_wifi_set_mode(iot_wifi_conf *conf)
 {
-	//iot_wifi_scan_result_t scanresult[IOT_WIFI_MAX_SCAN_RESULT];
-
-	char connected_ssid[IOT_WIFI_MAX_SSID_LEN+1];
-	int scancount;
-	int sretry;
-	char SoftAPdev[16];
+    char modestr[16];
+    iot_error_t err;
+
+    static const iot_bsp_wifi_phase_t modephase[] = {
+        [IOT_WIFI_MODE_OFF] = IOT_BSP_WIFI_PHASE_MODE_OFF,
+        [IOT_WIFI_MODE_SCAN] = IOT_BSP_WIFI_PHASE_MODE_SCAN,
+        [IOT_WIFI_MODE_STATION] = IOT_BSP_WIFI_PHASE_MODE_STATION,
+        [IOT_WIFI_MODE_SOFTAP] = IOT_BSP_WIFI_PHASE_MODE_SOFTAP,
+    };
+    unsigned long long start = _monotonic_ms();
+
+    snprintf(modestr, sizeof(modestr), "mode=%d", conf->mode);
+    IOT_OS_TRACE_BEGIN("wifi_set_mode", modestr);
+    err = _setmode(conf);
+    IOT_OS_TRACE_END("wifi_set_mode");
+    IOT_OS_TRACE_DUMP();                // refresh the timeline file after every mode change
+
+    if ((unsigned int)conf->mode < sizeof(modephase)/sizeof(modephase[0])) {
+        _phase_record(modephase[conf->mode], _monotonic_ms() - start);
+        _savephasehist();
+    }
 
+    return err;
+}
 
-//	IOT_INFO("[rpi] iot_bsp_wifi_set_mode = %d", conf->mode);
-	IOT_DUMP(IOT_DEBUG_LEVEL_DEBUG, IOT_DUMP_BSP_WIFI_SETMODE, conf->mode, 0);
+/*******************************************************************************************
+    set_mode state machine
 
-	switch(conf->mode) {
-	case IOT_WIFI_MODE_OFF:
+    Each mode is a list of steps run in order. A step that has to wait for the system waits
+    on an observable condition (link up, IPv4 address, wpa_supplicant / hostapd ready,
+    association) with its own deadline, not a fixed sleep. Link conditions are woken by the
+    event monitor; the rest are re-checked with a backoff that doubles from MODEPOLLMIN up to
+    MODEPOLLMAX. A step can end the sequence early by setting ctx->finished (e.g. when
+    falling back to Ethernet).
 
-        IOT_INFO("[rpi] Requested mode OFF");
+*******************************************************************************************/
 
-        if (AP_ON && ManageAP) {
+struct modectx {
+    iot_wifi_conf *conf;
+    char dev[MAXDEVNAMESIZE+1];             // interface the mode runs on
+    unsigned long long deadline;            // CLOCK_MONOTONIC ms by which the current step must finish
+    bool finished;
+};
 
-            _SoftAPControl("stop");                     // make sure hostapd/dnsmasq are stopped
+struct modestep {
+    const char *name;
+    iot_error_t (*run)(struct modectx *ctx);
+    unsigned int timeout;                   // ms allowed for the step
+};
 
-            if (STWifionly) {                           // if wlan0 only then switch mode back to station
-                if (! _switchmode("STA")) {
-                    IOT_ERROR("[rpi] Failed to switch wireless modes");
-                    return IOT_ERROR_CONN_OPERATE_FAIL;
-                }
-            }
-        }
+static const struct modestep offsteps[] = {
+    { "stop_softap",        _step_stopsoftap,       5000 },
+    { "restore_ap",         _step_restoreap,        5000 },
+    { NULL, NULL, 0 }
+};
 
-        _restoreAP();                                    // restore prior AP config if AP-only wifi
+static const struct modestep scansteps[] = {
+    { "scan",               _step_scan,             45000 },
+    { NULL, NULL, 0 }
+};
 
-		break;
+static const struct modestep stationsteps[] = {
+    { "stop_softap",        _step_stopsoftap,       5000 },
+    { "restore_ap",         _step_restoreap,        5000 },
+    { "station_ready",      _step_stationready,     5000 },
+    { "associate",          _step_associate,        WPACONNTIMEOUT + CTRLREPLYTIMEOUT },
+    { "station_address",    _step_stationaddress,   10000 },
+    { NULL, NULL, 0 }
+};
 
-	case IOT_WIFI_MODE_SCAN:
+static const struct modestep softapsteps[] = {
+    { "ap_iface",           _step_apiface,          2000 },
+    { "hostapd_conf",       _step_hostapdconf,      2000 },
+    { "ap_address",         _step_apaddress,        5000 },
+    { "stop_full_ap",       _step_stopfullap,       3000 },
+    { "start_softap",       _step_startsoftap,      SOFTAPSTARTTIMEOUT },
+    { NULL, NULL, 0 }
+};
 
-        IOT_INFO("[rpi] Requested mode SCAN");
+iot_error_t _setmode(iot_wifi_conf *conf)
+{
+    struct modectx ctx;
+    const struct modestep *steps;
 
-        if (!AP_ON || DualWifidev || APWifionly) {
+	IOT_DUMP(IOT_DEBUG_LEVEL_DEBUG, IOT_DUMP_BSP_WIFI_SETMODE, conf->mode, 0);
 
-            scancount = 0;
-            sretry = SCANRETRIES;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.conf = conf;
 
-            while ((scancount == 0) && (sretry > 0)) {
-                scancount = _perform_scan();                        // do scan and check resulting AP count
+	switch(conf->mode) {
+	case IOT_WIFI_MODE_OFF:
 
-                if (scancount == 0) {                               // if no results...
-                    usleep(SCANMODEWAITTIME);
-                    usleep(SCANMODEWAITTIME);                       //     pause and try again
-                    --sretry;
-                }
-            }
+        IOT_INFO("[rpi] Requested mode OFF");
+        STA_ON = false;
+        steps = offsteps;
+		break;
 
-            if (scancount > 0)
-                IOT_INFO("[rpi] WiFi scan completed. %d APs found",scancount);
-            else {
-                IOT_ERROR("[rpi] WiFi scan unable to find available APs");
-                return IOT_ERROR_CONN_OPERATE_FAIL;
-            }
-        } else
-            IOT_INFO("[rpi] Scan not performed while in AP mode");
+	case IOT_WIFI_MODE_SCAN:
 
+        IOT_INFO("[rpi] Requested mode SCAN");
+        steps = scansteps;
 		break;
 
 	case IOT_WIFI_MODE_STATION:     // For PI this could be either Wifi client or use ETH0
 
-
         IOT_INFO("[rpi] Requested mode STATION");
 
         if (!WIFI_INITIALIZED)
             return IOT_ERROR_CONN_CONNECT_FAIL;
 
-        if (AP_ON && ManageAP) {                                          // Turn off SoftAP
+        strcpy(ctx.dev,wifi_sta_dev);
+        steps = stationsteps;
+		break;
 
-            if (!_SoftAPControl("stop"))
-                IOT_INFO("[rpi] Problem stopping SoftAP");
+	case IOT_WIFI_MODE_SOFTAP:
 
-            if (STWifionly) {
-                if (! _switchmode("STA")) {
-                    IOT_ERROR("[rpi] Failed to switch wifi mode");
-                    return IOT_ERROR_CONN_OPERATE_FAIL;
-                }
-            }
+        IOT_INFO("[rpi] Requested mode SoftAP");
+        STA_ON = DualWifidev;                                   // a separate station device keeps scanning
 
-        }
+        if (!WIFI_INITIALIZED)
+            return IOT_ERROR_CONN_CONNECT_FAIL;
 
-        _restoreAP();                                    // restore prior AP config if AP only wifi
+        if (STWifionly)
+            strcpy(ctx.dev,wifi_sta_dev);
+        else
+            strcpy(ctx.dev,wifi_ap_dev);
 
-        if (STWifionly) {
-            usleep(SOFTAPWAITTIME);                         // Switching wlan0; give it some time to transition
-            usleep(SOFTAPWAITTIME);
-        }
+        steps = softapsteps;
+		break;
 
-        if(DualWifidev || STWifionly)  {
+	default:
+		IOT_ERROR("RPI cannot support this mode = %d", conf->mode);
+		IOT_DUMP(IOT_DEBUG_LEVEL_ERROR, IOT_DUMP_BSP_WIFI_ERROR, conf->mode, __LINE__);
+		return IOT_ERROR_CONN_OPERATE_FAIL;
+	}
 
-            //NOW CHANGE CONNECTION PER conf->ssid
+	return _runsteps(&ctx, steps);
+}
 
-            if (!_switchSSID(wifi_sta_dev,conf->ssid)) {    // Switch to ssid; if failed...
+iot_error_t _runsteps(struct modectx *ctx, const struct modestep *steps)
+{
+    const struct modestep *step;
+    unsigned long long start;
+    iot_error_t err;
 
-                if (Ethernet)
-                    IOT_INFO("[rpi] Could not connect to ssid %s. Will use Ethernet",conf->ssid);
-                else {
-                    IOT_ERROR("[rpi] Failed to connect to ssid %s",conf->ssid);
-                    return IOT_ERROR_CONNECT_FAIL;
-                }
+    for (step = steps; step->name && !ctx->finished; step++) {
 
-            } else {                                       // Switch SSID went OK
+        start = _monotonic_ms();
+        ctx->deadline = start + step->timeout;
 
-                usleep(SSIDWAITTIME);
+        IOT_OS_TRACE_BEGIN(step->name, ctx->dev);
+        err = step->run(ctx);
+        IOT_OS_TRACE_END(step->name);
 
-                if (!_waitWifiConn(wifi_sta_dev,connected_ssid))  {   // confirm connected SSID
+        IOT_DEBUG("[rpi] set_mode step %s took %llums", step->name, _monotonic_ms() - start);
+        if (err != IOT_ERROR_NONE)
+            return err;
+    }
 
-                    if (Ethernet)
-                        IOT_INFO("[rpi] Didn't connect to ssid %s.  Will use Ethernet",conf->ssid);
-                    else {
-                        IOT_ERROR("[rpi] Failed to connect to ssid %s",conf->ssid);
-                        return IOT_ERROR_NET_CONNECT;
-                    }
-                } else
-                    IOT_INFO("[rpi] Connected to AP SSID: %s", conf->ssid);
+    return IOT_ERROR_NONE;
+}
 
-            }
+// Wait until cond(dev) holds or the deadline passes
+bool _waitfor(bool (*cond)(const char *dev), const char *dev, unsigned long long deadline, const char *what) {
 
-        }
+    unsigned int backoff = MODEPOLLMIN;
+    long long left;
+    IOT_OS_TRACE_SCOPE("waitfor", what);
 
-		break;
+    if (!evthread) {                                        // no link events: old fixed settle
+        _modewait(SOFTAPWAITTIME);
+        return cond(dev);
+    }
 
-	case IOT_WIFI_MODE_SOFTAP:
+    while (!cond(dev)) {
 
-        IOT_INFO("[rpi] Requested mode SoftAP");
+        left = (long long)(deadline - _monotonic_ms());
+        if (left <= 0) {
+            IOT_WARN("[rpi] Timed out waiting for %s on %s", what, dev);
+            return false;
+        }
 
-        if (!WIFI_INITIALIZED)
-            return IOT_ERROR_CONN_CONNECT_FAIL;
+        iot_os_eventgroup_wait_bits(linkevents, LINKEVT_CHANGE, true, (left < backoff) ? left : backoff);
+        backoff = (backoff * 2 > MODEPOLLMAX) ? MODEPOLLMAX : backoff * 2;
+    }
 
-        if (STWifionly)
-            strcpy(SoftAPdev,wifi_sta_dev);
-        else
-            strcpy(SoftAPdev,wifi_ap_dev);
+    return true;
+}
 
-        if (!_setupHostapd(conf->ssid,conf->pass,SoftAPdev)) {       // Setup hostapd.conf file with ssid & password
-            IOT_ERROR("[rpi] Couldn't update hostapd.conf file");
-            return IOT_ERROR_CONN_OPERATE_FAIL;
-        }
+/* Conditions */
 
+bool _cond_linkup(const char *dev) {
 
-        if (!DualWifidev)
-            usleep(SOFTAPWAITTIME);                                 // pause to let wireless come up
+    bool up = false;
+    int i;
 
-        if (STWifionly) {
-            if (!_switchmode("AP")) {
-                IOT_ERROR("[rpi] Failed to switch to AP wifi mode on device %s",SoftAPdev);
-                return IOT_ERROR_CONN_OPERATE_FAIL;
-            }
-        }
+    iot_os_mutex_lock(&linklock);
+    for (i = 0; i < linkcount; i++) {
+        if (strcmp(linkstates[i].name, dev) == 0)
+            up = linkstates[i].up;
+    }
+    iot_os_mutex_unlock(&linklock);
 
-        usleep(SOFTAPWAITTIME);
-        usleep(SOFTAPWAITTIME);
+    return up;
+}
 
-        // If Full-time AP, then shut down current SoftAP config (it was saved prior)
-        if (APWifionly) {
-            if (!_SoftAPControl("stop")) {
-                IOT_ERROR("[rpi] Problem stopping SoftAP");
-                return IOT_ERROR_CONN_OPERATE_FAIL;
-            }
-            usleep(SOFTAPWAITTIME);
-        }
+bool _cond_carrieroff(const char *dev) {
 
-        // Start up SoftAP with new config
-        if (!_SoftAPControl("start")) {                             // start hostapd & dnsmasq services
-            IOT_ERROR("[rpi] Problem starting SoftAP");
-                return IOT_ERROR_CONN_OPERATE_FAIL;
-            }
+    bool off = true;
+    int i;
 
-        usleep(SOFTAPWAITTIME);                                 //pause to let hostapd & dnsmasq to come up
-        
-        // Confirm hostapd has started
-        if (!_checkstartSoftAP("hostapd")) {
-            usleep(SOFTAPWAITTIME);
-            usleep(SOFTAPWAITTIME);
-            if (!_checkstartSoftAP("hostapd")) {
-                IOT_ERROR("[rpi] SoftAP service failed to start");
-                    return IOT_ERROR_CONN_OPERATE_FAIL;
-            }
-        }
+    iot_os_mutex_lock(&linklock);
+    for (i = 0; i < linkcount; i++) {
+        if (strcmp(linkstates[i].name, dev) == 0)
+            off = !linkstates[i].carrier;
+    }
+    iot_os_mutex_unlock(&linklock);
 
-        // Reminder flag to restore prior AP config after we're done
-        if (APWifionly)
-            APWifionlyRestore=true;
+    return off;
+}
 
-		IOT_DEBUG("wifi_init_softap finished.SSID:%s password:%s",
-				conf->ssid, conf->pass);
+bool _cond_ipv4(const char *dev) {
 
+    bool addr = false;
+    int i;
 
-        IOT_INFO("[rpi] AP Mode Started on device %s",SoftAPdev);
+    iot_os_mutex_lock(&linklock);
+    for (i = 0; i < linkcount; i++) {
+        if (strcmp(linkstates[i].name, dev) == 0)
+            addr = linkstates[i].addrcount > 0;
+    }
+    iot_os_mutex_unlock(&linklock);
 
-		break;
+    return addr;
+}
 
-	default:
-		IOT_ERROR("RPI cannot support this mode = %d", conf->mode);
-		IOT_DUMP(IOT_DEBUG_LEVEL_ERROR, IOT_DUMP_BSP_WIFI_ERROR, conf->mode, __LINE__);
-		return IOT_ERROR_CONN_OPERATE_FAIL;
-	}
+// The SoftAP's static address (from dhcpcd_ap.conf) is on dev
+bool _cond_apaddress(const char *dev) {
 
-	return IOT_ERROR_NONE;
+    bool found = false;
+    int i;
+    int j;
+
+    iot_os_mutex_lock(&linklock);
+    for (i = 0; i < linkcount; i++) {
+        if (strcmp(linkstates[i].name, dev) != 0)
+            continue;
+        for (j = 0; j < linkstates[i].addrcount; j++) {
+            if (linkstates[i].addrs[j] == apaddress)
+                found = true;
+        }
+    }
+    iot_os_mutex_unlock(&linklock);
+
+    return found;
 }
 
-int _enableWifi(char *dev) {
+// wpa_supplicant answers on dev's control socket: after AP mode it was only told to
+// DISCONNECT, but the old config-swap path (no known AP address) restarts it through dhcpcd
+bool _cond_wpaready(const char *dev) {
 
+    struct ctrlsock ctrl;
+    char reply[16];
+    bool ready;
 
-    if(_softblock(PHYSWIFIDEV,'N')) {                       // ensure softblock is off for wifi
+    if (_ctrl_open(&ctrl, WPACTRLDIR, dev) < 0)
+        return false;
 
-        usleep(SEQSYSCMDWAIT);
+    ready = (_ctrl_request(&ctrl, "PING", reply, sizeof(reply)) > 0) && (strncmp(reply, "PONG", 4) == 0);
+    _ctrl_close(&ctrl);
 
-        if (strcmp(dev,wifi_ap_dev) != 0) {                 // If not AP device check (won't show 'UP')
+    return ready;
+}
 
-            if (_isupIface(dev))                            // verify interface is up
-                return(1);
+// Pick up "static ip_address=a.b.c.d/nn" from dev's "interface" block of the dhcpcd AP config
+bool _readapaddress(char *fname, const char *dev) {
 
-            else
-                IOT_ERROR("[rpi] Wifi interface is down");
-        } else
-            return(1);
-    }
-    else
-        IOT_ERROR("[rpi] Wifi couldn't be enabled");
+    FILE *fp;
+    char data[100];
+    char *textptr;
+    char *slash;
+    struct in_addr addr;
+    bool inblock = false;
 
+    fp = fopen(fname,"r");
+    if (!fp)
+        return false;
 
-    return(0);
+    while (fgets(data,sizeof(data),fp)) {
+
+        textptr = data + strspn(data," \t");
+        if (strncmp(textptr,"interface ",10) == 0) {
+            textptr += 10;
+            textptr[strcspn(textptr," \t\n")] = '\0';
+            inblock = (strcmp(textptr,dev) == 0);
+        }
+        else if (inblock && strncmp(textptr,"static ip_address=",18) == 0) {
+            textptr += 18;
+            slash = textptr + strcspn(textptr,"/ \t\n");
+            if (*slash == '/')
+                apprefix = atoi(slash + 1);
+            *slash = '\0';
+            if (inet_pton(AF_INET, textptr, &addr) == 1)
+                apaddress = addr.s_addr;
+            break;
+        }
+    }
 
+    fclose(fp);
+    return apaddress != 0;
 }
 
-int _softblock(char *phys, char setter) {                                       // input parm = 'Y' or 'N' to turn off or on wifi
+/* Steps */
 
-    const int maxdatasize = 100;
-    char data[maxdatasize];
-    char unblockcommand[25] = "sudo rfkill unblock ";
-    char blockcommand[25] = "sudo rfkill block ";
-    char getblockstat[] ="sudo rfkill list all";
+iot_error_t _step_stopsoftap(struct modectx *ctx) {
+
+    if (AP_ON && ManageAP) {
+
+        if (!_SoftAPControl("stop"))                // make sure hostapd/dnsmasq are stopped
+            IOT_INFO("[rpi] Problem stopping SoftAP");
+
+        if (STWifionly) {                           // if wlan0 only then switch mode back to station
+            if (! _switchmode("STA")) {
+                IOT_ERROR("[rpi] Failed to switch wireless modes");
+                return IOT_ERROR_CONN_OPERATE_FAIL;
+            }
+        }
+
+        if (ConcurrentWifi)                         // station link never went down; just drop the AP
+            _apiface(false);
+    }
+
+    return IOT_ERROR_NONE;
+}
+
+iot_error_t _step_restoreap(struct modectx *ctx) {
+
+    _restoreAP();                                   // restore prior AP config if AP-only wifi
+    return IOT_ERROR_NONE;
+}
+
+iot_error_t _step_scan(struct modectx *ctx) {
+
+    unsigned int backoff = SCANBACKOFFMIN;
+    unsigned int generation;
+    int cached;
+    int scancount = 0;
+    int sretry;
+
+    if (_scancache_fresh(&generation, &cached)) {
+        IOT_INFO("[rpi] WiFi scan served from cache (generation %u, %d APs)",generation,cached);
+        return IOT_ERROR_NONE;
+    }
+
+    if (AP_ON && !DualWifidev && !APWifionly) {
+        IOT_INFO("[rpi] Scan not performed while in AP mode");
+        return IOT_ERROR_NONE;
+    }
+
+    for (sretry = SCANRETRIES; sretry > 0 && _monotonic_ms() < ctx->deadline; sretry--) {
+
+        scancount = _refresh_scan();                        // do scan and check resulting AP count
+        if (scancount > 0)
+            break;
+
+        _modewait(backoff * 1000);                          // nothing heard; back off and try again
+        backoff *= 2;
+    }
+
+    if (scancount > 0)
+        IOT_INFO("[rpi] WiFi scan completed. %d APs found",scancount);
+    else {
+        IOT_ERROR("[rpi] WiFi scan unable to find available APs");
+        return IOT_ERROR_CONN_OPERATE_FAIL;
+    }
+
+    return IOT_ERROR_NONE;
+}
+
+iot_error_t _step_stationready(struct modectx *ctx) {
+
+    if (!DualWifidev && !STWifionly) {              // AP-only wifi: station is Ethernet
+        ctx->finished = true;
+        return IOT_ERROR_NONE;
+    }
+
+    // After an AP->STA switch (AP address removed, dhcpcd --rebind, wpa_supplicant RECONNECT)
+    // wait for the link and for wpa_supplicant to answer before associating
+    if (_waitfor(_cond_linkup, ctx->dev, ctx->deadline, "link up"))
+        _waitfor(_cond_wpaready, ctx->dev, ctx->deadline, "wpa_supplicant");
+
+    return IOT_ERROR_NONE;
+}
+
+iot_error_t _step_associate(struct modectx *ctx) {
+
+	char connected_ssid[IOT_WIFI_MAX_SSID_LEN+1];
+    iot_wifi_conf *conf = ctx->conf;
+
+    //NOW CHANGE CONNECTION PER conf->ssid
+
+    if (!_switchSSID(ctx->dev,conf->ssid)) {        // Switch to ssid and wait for association; if failed...
+
+        if (Ethernet) {
+            IOT_INFO("[rpi] Could not connect to ssid %s. Will use Ethernet",conf->ssid);
+            ctx->finished = true;
+        } else {
+            IOT_ERROR("[rpi] Failed to connect to ssid %s",conf->ssid);
+            return IOT_ERROR_CONNECT_FAIL;
+        }
+
+    } else if (!_waitWifiConn(ctx->dev,connected_ssid))  {   // confirm connected SSID
+
+        if (Ethernet) {
+            IOT_INFO("[rpi] Didn't connect to ssid %s.  Will use Ethernet",conf->ssid);
+            ctx->finished = true;
+        } else {
+            IOT_ERROR("[rpi] Failed to connect to ssid %s",conf->ssid);
+            return IOT_ERROR_NET_CONNECT;
+        }
+
+    } else {
+        IOT_INFO("[rpi] Connected to AP SSID: %s", conf->ssid);
+        STA_ON = true;
+    }
+
+    return IOT_ERROR_NONE;
+}
+
+iot_error_t _step_stationaddress(struct modectx *ctx) {
+
+    // The SDK connects to the cloud next; give DHCP a chance so that doesn't fail straight away
+    if (!_waitfor(_cond_ipv4, ctx->dev, ctx->deadline, "IPv4 address"))
+        IOT_WARN("[rpi] %s has no IPv4 address yet",ctx->dev);
+
+    return IOT_ERROR_NONE;
+}
+
+// Concurrent mode: create the AP interface, on the channel the station is using (one radio, one channel)
+iot_error_t _step_apiface(struct modectx *ctx) {
+
+    uint32_t wiphy;
+    uint32_t freq = 0;
+
+    if (!ConcurrentWifi)
+        return IOT_ERROR_NONE;
+
+    apchannel = 0;
+    if (_wifiinfo(wifi_sta_dev, &wiphy, &freq, NULL) == 0 && freq != 0) {
+        apchannel = _freq2channel(freq);
+        IOT_INFO("[rpi] SoftAP locked to station channel %d (%u MHz)",apchannel,freq);
+    }
+
+    if (!_apiface(true)) {
+        IOT_ERROR("[rpi] Cannot create SoftAP interface %s",ctx->dev);
+        return IOT_ERROR_CONN_OPERATE_FAIL;
+    }
+
+    return IOT_ERROR_NONE;
+}
+
+iot_error_t _step_hostapdconf(struct modectx *ctx) {
+
+    if (!_setupHostapd(ctx->conf->ssid,ctx->conf->pass,ctx->dev)) {   // Setup hostapd.conf file with ssid & password
+        IOT_ERROR("[rpi] Couldn't update hostapd.conf file");
+        return IOT_ERROR_CONN_OPERATE_FAIL;
+    }
+
+    if (!DualWifidev)
+        _waitfor(_cond_linkup, ctx->dev, ctx->deadline, "link up");
+
+    return IOT_ERROR_NONE;
+}
+
+iot_error_t _step_apaddress(struct modectx *ctx) {
+
+    if (ConcurrentWifi) {
+        if (!_setapaddress(ctx->dev, true)) {
+            IOT_ERROR("[rpi] Failed to set SoftAP address on %s",ctx->dev);
+            return IOT_ERROR_CONN_OPERATE_FAIL;
+        }
+        return IOT_ERROR_NONE;
+    }
+
+    if (!STWifionly)
+        return IOT_ERROR_NONE;
+
+    if (!_switchmode("AP")) {
+        IOT_ERROR("[rpi] Failed to switch to AP wifi mode on device %s",ctx->dev);
+        return IOT_ERROR_CONN_OPERATE_FAIL;
+    }
+
+    // The AP address is added over rtnetlink (dhcpcd only releases its lease); wait for the
+    // RTM_NEWADDR, or just link up when swapping whole dhcpcd configs without a known address
+    _waitfor(apaddress ? _cond_apaddress : _cond_linkup, ctx->dev, ctx->deadline, "SoftAP address");
+
+    return IOT_ERROR_NONE;
+}
+
+iot_error_t _step_stopfullap(struct modectx *ctx) {
+
+    // If Full-time AP, then shut down current SoftAP config (it was saved prior)
+    if (APWifionly) {
+        if (!_SoftAPControl("stop")) {
+            IOT_ERROR("[rpi] Problem stopping SoftAP");
+            return IOT_ERROR_CONN_OPERATE_FAIL;
+        }
+        _waitfor(_cond_carrieroff, ctx->dev, ctx->deadline, "AP down");
+    }
+
+    return IOT_ERROR_NONE;
+}
+
+iot_error_t _step_startsoftap(struct modectx *ctx) {
+
+    long long left;
+
+    // Start up SoftAP with new config
+    if (!_SoftAPControl("start")) {                             // start hostapd & dnsmasq services
+        IOT_ERROR("[rpi] Problem starting SoftAP");
+        return IOT_ERROR_CONN_OPERATE_FAIL;
+    }
+
+    // Confirm hostapd has the AP up
+    left = (long long)(ctx->deadline - _monotonic_ms());
+    if (!_waitSoftAP(ctx->dev, (left > 0) ? left : 1)) {
+        IOT_ERROR("[rpi] SoftAP service failed to start");
+        return IOT_ERROR_CONN_OPERATE_FAIL;
+    }
+
+    // Reminder flag to restore prior AP config after we're done
+    if (APWifionly)
+        APWifionlyRestore=true;
+
+    IOT_DEBUG("wifi_init_softap finished.SSID:%s password:%s",
+            ctx->conf->ssid, ctx->conf->pass);
+
+    IOT_INFO("[rpi] AP Mode Started on device %s",ctx->dev);
+
+    return IOT_ERROR_NONE;
+}
+
+// Fixed settle delays (scan backoff, no-event fallback), traced so they stand out on the timeline
+void _modewait(useconds_t usec) {
+
+    IOT_OS_TRACE_BEGIN("settle", NULL);
+    usleep(usec);
+    IOT_OS_TRACE_END("settle");
+}
+
+int _enableWifi(char *dev) {
+
+
+    if(_softblock(PHYSWIFIDEV,'N')) {                       // ensure softblock is off for wifi
+
+        usleep(SEQSYSCMDWAIT);
+
+        if (strcmp(dev,wifi_ap_dev) != 0) {                 // If not AP device check (won't show 'UP')
+
+            if (_isupIface(dev))                            // verify interface is up
+                return(1);
+
+            else
+                IOT_ERROR("[rpi] Wifi interface is down");
+        } else
+            return(1);
+    }
+    else
+        IOT_ERROR("[rpi] Wifi couldn't be enabled");
+
+
+    return(0);
+
+}
+
+int _softblock(char *phys, char setter) {                                       // input parm = 'Y' or 'N' to turn off or on wifi
+
+    const int maxdatasize = 100;
+    char data[maxdatasize];
+    char unblockcommand[25] = "sudo rfkill unblock ";
+    char blockcommand[25] = "sudo rfkill block ";
+    char getblockstat[] ="sudo rfkill list all";
     char *lineptr;
     char devid[2];
     FILE *pf, *pf2;;
 
-    pf = popen(getblockstat,"r");
+    pf = _popencmd(getblockstat,"r");
     if (pf) {
 
         while (fgets(data,maxdatasize,pf)) {
@@ -1094,12 +1694,12 @@ int _softblock(char *phys, char setter) {
                     if (lineptr) {
 
                         if ((strstr(data,"yes") && (setter == 'N'))) {
-                            pf2 = popen(unblockcommand,"r");
-                            pclose(pf2);
+                            pf2 = _popencmd(unblockcommand,"r");
+                            _pclosecmd(pf2);
                         }
                         else if ((strstr(data,"no") && (setter == 'Y'))) {
-                            pf2 = popen(blockcommand,"r");
-                            pclose(pf2);
+                            pf2 = _popencmd(blockcommand,"r");
+                            _pclosecmd(pf2);
                         }
                     }
                 }
@@ -1110,28 +1710,27 @@ int _softblock(char *phys, char setter) {
         return (0);
     }
 
-    pclose(pf);
+    _pclosecmd(pf);
 
     return (1);
 }
 
 int _waitWifiConn(char *dev, char *ssid) {
 
-    int retries;
-
-    retries = SSIDWAITRETRIES;
+    struct ctrlsock ctrl;
+    char state[20];
+    IOT_OS_TRACE_SCOPE("waitWifiConn", ssid);
+    PHASE_SCOPE(IOT_BSP_WIFI_PHASE_WAIT_CONN);
 
     strcpy(ssid, "");
 
-    while (retries > 0) {
-
-        _isconfWifi(wifi_sta_dev,ssid);
-        if (strlen(ssid) > 0)
-            retries = 0;
-        else {
-            usleep(SSIDWAITTIME);    // give some time for wlan connection
-            retries--;
-        }
+    // _switchSSID has already waited for association; this just confirms what we're on
+    if (_ctrl_open(&ctrl, WPACTRLDIR, dev) < 0) {
+        _isconfWifi(dev,ssid);
+    } else {
+        if ((_wpa_status(&ctrl, state, ssid) < 0) || (strcmp(state,"COMPLETED") != 0))
+            strcpy(ssid, "");
+        _ctrl_close(&ctrl);
     }
 
     if (strlen(ssid)>0)
@@ -1141,6 +1740,53 @@ int _waitWifiConn(char *dev, char *ssid) {
 
 }
 
+// Wait for hostapd on dev to answer PING and report the AP enabled (STATUS or AP-ENABLED event)
+bool _waitSoftAP(char *dev, int timeout_ms) {
+
+    static const char *apevents[] = { "AP-ENABLED", "AP-DISABLED", "INTERFACE-DISABLED", NULL };
+    struct ctrlsock ctrl;
+    char reply[CTRLREPLYSIZE];
+    unsigned long long deadline;
+    long long left;
+    bool ready = false;
+    IOT_OS_TRACE_SCOPE("waitSoftAP", dev);
+    PHASE_SCOPE(IOT_BSP_WIFI_PHASE_SOFTAP_READY);
+
+    deadline = _monotonic_ms() + timeout_ms;
+
+    // The socket appears once hostapd has parsed its config
+    while (_ctrl_open(&ctrl, HOSTAPDCTRLDIR, dev) < 0) {
+        if (_monotonic_ms() >= deadline) {
+            IOT_INFO("[rpi] hostapd control socket not available; checking service status");
+            return _checkstartSoftAP("hostapd");
+        }
+        usleep(CTRLOPENRETRYTIME);
+    }
+
+    if (_ctrl_request(&ctrl, "PING", reply, sizeof(reply)) < 0 || strncmp(reply, "PONG", 4) != 0) {
+        IOT_ERROR("[rpi] hostapd not responding");
+        goto out;
+    }
+
+    if (_ctrl_request(&ctrl, "ATTACH", reply, sizeof(reply)) < 0 || strncmp(reply, "OK", 2) != 0)
+        goto out;
+
+    if (_ctrl_request(&ctrl, "STATUS", reply, sizeof(reply)) > 0 && strstr(reply, "state=ENABLED\n")) {
+        ready = true;
+    } else {
+        left = (long long)(deadline - _monotonic_ms());
+        if (left > 0 && _ctrl_waitevent(&ctrl, apevents, left) == 0)
+            ready = true;
+        else
+            IOT_ERROR("[rpi] hostapd did not enable the AP on %s", dev);
+    }
+
+    _ctrl_request(&ctrl, "DETACH", reply, sizeof(reply));
+out:
+    _ctrl_close(&ctrl);
+    return ready;
+}
+
 // This function checks status of hostapd service to be sure it started
 bool _checkstartSoftAP(char *service) {
 
@@ -1153,10 +1799,11 @@ bool _checkstartSoftAP(char *service) {
     char data[maxdatasize];
     bool fflag = false;
     int linecounter = 0;
+    IOT_OS_TRACE_SCOPE("checkstartSoftAP", service);
 
     strcpy(command,SERVSTATCMD);
     strcat(command,service);
-    pf = popen(command,"r");
+    pf = _popencmd(command,"r");
 
     if (pf) {
 
@@ -1168,7 +1815,7 @@ bool _checkstartSoftAP(char *service) {
                 break;
             }
         }
-        pclose(pf);
+        _pclosecmd(pf);
         if (fflag)
             return true;
 
@@ -1180,8 +1827,129 @@ bool _checkstartSoftAP(char *service) {
     return false;
 }
 
+// Move the station interface between AP and station addressing, leaving other interfaces alone
 bool _switchmode(char *mode) {
 
+    char command[100];
+    char *dev = wifi_sta_dev;
+    IOT_OS_TRACE_SCOPE("switchmode", mode);
+    PHASE_SCOPE(IOT_BSP_WIFI_PHASE_DHCPCD_SWITCH);
+
+    if (apaddress == 0)                             // don't know the AP address: swap whole dhcpcd configs
+        return _switchmode_dhcpcd(mode);
+
+    if (strcmp(mode,"AP") == 0) {
+
+        // Idle wpa_supplicant (hostapd takes the interface), drop the lease, put the AP address on
+        _wpacommand(dev, "DISCONNECT");
+
+        sprintf(command,"sudo dhcpcd --release %s",dev);
+        _pipecommand(command);
+
+        if (!_setapaddress(dev, true)) {
+            IOT_ERROR("[rpi] Failed to set SoftAP address on %s",dev);
+            return false;
+        }
+
+    } else if (strcmp(mode,"STA") == 0) {
+
+        _setapaddress(dev, false);
+
+        sprintf(command,"sudo dhcpcd --rebind %s",dev);
+        if (_pipecommand(command) != 0) {
+            IOT_ERROR("[rpi] Failed to restart DHCP on %s",dev);
+            return false;
+        }
+
+        _wpacommand(dev, "RECONNECT");              // if dhcpcd's hook restarted it, it reconnects by itself
+
+    } else {
+
+        IOT_ERROR("[rpi] Unknown mode switch request '%s'",mode);
+        return false;
+    }
+
+    return true;
+}
+
+// RTM_NEWADDR / RTM_DELADDR for an IPv4 address on dev; returns 0 or -errno
+int _nladdr(uint16_t cmd, const char *dev, uint32_t addr, int prefix) {
+
+    uint32_t req[NLREQSIZE/4];
+    struct nlmsghdr *nlh;
+    struct ifaddrmsg *ifa;
+    uint32_t brd;
+    int fd;
+    int ret;
+
+    nlh = _nlmsg_init(req, cmd, (cmd == RTM_NEWADDR) ? NLM_F_CREATE | NLM_F_REPLACE : 0, sizeof(struct ifaddrmsg));
+    ifa = NLMSG_DATA(nlh);
+    ifa->ifa_family = AF_INET;
+    ifa->ifa_prefixlen = prefix;
+    ifa->ifa_scope = RT_SCOPE_UNIVERSE;
+    ifa->ifa_index = if_nametoindex(dev);
+    if (ifa->ifa_index == 0)
+        return -ENODEV;
+
+    brd = addr | htonl((prefix < 32) ? 0xffffffffu >> prefix : 0);
+    _nla_put(nlh, IFA_LOCAL, &addr, sizeof(addr));
+    _nla_put(nlh, IFA_ADDRESS, &addr, sizeof(addr));
+    if (cmd == RTM_NEWADDR)
+        _nla_put(nlh, IFA_BROADCAST, &brd, sizeof(brd));
+
+    fd = _nlsocket(NETLINK_ROUTE);
+    if (fd < 0)
+        return -errno;
+
+    ret = _nltalk(fd, nlh, NULL, NULL);
+    close(fd);
+
+    return ret;
+}
+
+// Add or remove the static SoftAP address; needs CAP_NET_ADMIN, else falls back to 'sudo ip'
+bool _setapaddress(const char *dev, bool add) {
+
+    char command[100];
+    char addrtext[INET_ADDRSTRLEN];
+    int ret;
+
+    ret = _nladdr(add ? RTM_NEWADDR : RTM_DELADDR, dev, apaddress, apprefix);
+    if (ret == 0 || (!add && ret == -EADDRNOTAVAIL))
+        return true;
+
+    if (ret != -EPERM) {
+        IOT_ERROR("[rpi] Cannot %s SoftAP address on %s; error #%d", add ? "add" : "remove", dev, -ret);
+        return false;
+    }
+
+    inet_ntop(AF_INET, &apaddress, addrtext, sizeof(addrtext));
+    sprintf(command,"sudo ip addr %s %s/%d dev %s", add ? "replace" : "del", addrtext, apprefix, dev);
+    return _pipecommand(command) == 0;
+}
+
+// One-shot wpa_supplicant command expecting "OK"
+bool _wpacommand(const char *dev, const char *cmd) {
+
+    struct ctrlsock ctrl;
+    char reply[16];
+    bool ok;
+
+    if (_ctrl_open(&ctrl, WPACTRLDIR, dev) < 0)
+        return false;
+
+    ok = (_ctrl_request(&ctrl, cmd, reply, sizeof(reply)) > 0) && (strncmp(reply, "OK", 2) == 0);
+    _ctrl_close(&ctrl);
+
+    if (!ok)
+        IOT_DEBUG("[rpi] wpa_supplicant %s on %s not applied", cmd, dev);
+
+    return ok;
+}
+
+// Original method: swap /etc/dhcpcd.conf for the AP version and restart dhcpcd
+bool _switchmode_dhcpcd(char *mode) {
+
     int errnum=0;
     int accumerr=0;
     char command[100];
@@ -1228,23 +1996,53 @@ int _pipecommand(char *command) {
     FILE *pf;
     int errnum;
 
-    pf = popen(command,"r");
+    pf = _popencmd(command,"r");
     errnum=errno;
     if (!pf) {
         IOT_ERROR("[rpi] OS command failed; error #%d",errnum);
         return errnum;
     } else {
-        pclose(pf);
+        _pclosecmd(pf);
         return 0;
     }
 
 }
 
+// popen() wrapper; each command shows up in the trace from start until _pclosecmd()
+FILE *_popencmd(const char *command, const char *mode) {
+
+    FILE *pf;
+    int errnum;
+
+    IOT_OS_TRACE_BEGIN("popen", command);
+    pf = popen(command, mode);
+    if (!pf) {
+        errnum = errno;
+        IOT_OS_TRACE_END("popen");
+        errno = errnum;
+    }
+    return pf;
+}
+
+int _pclosecmd(FILE *pf) {
+
+    int status;
+
+    if (!pf)
+        return -1;
+
+    status = pclose(pf);
+    IOT_OS_TRACE_END("popen");
+    return status;
+}
+
 int _SoftAPControl(char *cmd) {
 
     FILE *pf;
     char command[30];
     int errnum;
+    IOT_OS_TRACE_SCOPE("SoftAPControl", cmd);
+    PHASE_SCOPE((strcmp(cmd,"start") == 0) ? IOT_BSP_WIFI_PHASE_SOFTAP_START : IOT_BSP_WIFI_PHASE_SOFTAP_STOP);
 
 
 	strcpy(command,"bash ");
@@ -1259,7 +2057,7 @@ int _SoftAPControl(char *cmd) {
             return 0;
 	}
 
-    pf = popen(command,"r");
+    pf = _popencmd(command,"r");
 
     if (!pf) {
 
@@ -1272,7 +2070,7 @@ int _SoftAPControl(char *cmd) {
         return (0);
     }
 
-    pclose(pf);
+    _pclosecmd(pf);
 
     if (strcmp(cmd,"start") == 0)
         AP_ON = true;
@@ -1297,6 +2095,8 @@ int _setupHostapd(char*ssid, char *password, char *iface) {
     int errnum;
     int progcount = 0;
     int updateflag = 0;
+    IOT_OS_TRACE_SCOPE("setupHostapd", iface);
+    PHASE_SCOPE(IOT_BSP_WIFI_PHASE_HOSTAPD_CONF);
 
     if((pf=fopen(SOFTAPCONFFILE, "r"))) {
 
@@ -1320,8 +2120,9 @@ int _setupHostapd(char*ssid, char *password, char *iface) {
                         updateflag++;
                 } else {
 
-                    if ((textptr = strstr(readline,"interface"))) {
+                    if (strncmp(readline,"interface=",10) == 0) {     // not ctrl_interface=
 
+                        textptr = readline;
                         progcount++;
                         _parseconfparm(readInterface,textptr);
 
@@ -1329,6 +2130,16 @@ int _setupHostapd(char*ssid, char *password, char *iface) {
                             updateflag++;
 
                     }
+                    else if ((apchannel > 0) && (strncmp(readline,"channel=",8) == 0)) {
+
+                        if (atoi(readline + 8) != apchannel)
+                            updateflag++;
+                    }
+                    else if ((apchannel > 0) && (strncmp(readline,"hw_mode=",8) == 0)) {
+
+                        if (readline[8] != (apchannel > 14 ? 'a' : 'g'))
+                            updateflag++;
+                    }
 
                 }
 
@@ -1381,6 +2192,7 @@ int _updateHfile(char *fname, char *ssid,char *password, char *iface) {
     size_t len = 0;
     char *textptr;
     char command[400];
+    bool ctrliface = false;
 
     fp1 = fopen(fname,"r");
     if (!fp1) {
@@ -1412,7 +2224,20 @@ int _updateHfile(char *fname, char *ssid,char *password, char *iface) {
 
             else {
 
-                if ((textptr = strstr(readline,"interface=")))
+                if (strncmp(readline,"ctrl_interface",14) == 0) {
+
+                    ctrliface = true;
+                    fprintf(fp2,"%s",readline);
+
+                } else if ((apchannel > 0) && (strncmp(readline,"channel=",8) == 0)) {
+
+                    fprintf(fp2,"channel=%d\n",apchannel);
+
+                } else if ((apchannel > 0) && (strncmp(readline,"hw_mode=",8) == 0)) {
+
+                    fprintf(fp2,"hw_mode=%c\n",apchannel > 14 ? 'a' : 'g');
+
+                } else if ((textptr = strstr(readline,"interface=")))
 
                     fprintf(fp2,"interface=%s\n",iface);
 
@@ -1424,30 +2249,33 @@ int _updateHfile(char *fname, char *ssid,char *password, char *iface) {
 
     }
 
+    if (!ctrliface)
+        fprintf(fp2,HOSTAPDCTRLIFACE);              // we wait on hostapd's control socket for AP-ENABLED
+
 
     free(readline);
     fclose(fp1);
     fclose(fp2);
 
     sprintf(command,"rm -f %s",PRIORCONF);
-    fp3 = popen(command,"r");                               // delete prior saved config file (ok if doesn't exist)
-    fclose(fp3);
+    fp3 = _popencmd(command,"r");                               // delete prior saved config file (ok if doesn't exist)
+    _pclosecmd(fp3);
 
     sprintf(command,"cp %s %s",fname,PRIORCONF);
-    fp3 = popen(command, "r");                              // save current hostapd.conf to another file
+    fp3 = _popencmd(command, "r");                              // save current hostapd.conf to another file
     if (fp3) {
-        fclose(fp3);
+        _pclosecmd(fp3);
         //sprintf(command,"sudo rm %s",fname);
         //fp3 = popen(command, "r");                       // delete current hostapd.conf
         //if (fp3) {
         //  fclose(fp3);
         sprintf(command,"sudo cp %s %s",TMPFILENAME,fname);
-        fp3 = popen(command, "r");                   // copy new file to hostapd.conf
+        fp3 = _popencmd(command, "r");                   // copy new file to hostapd.conf
         if (fp3) {
-            fclose(fp3);
+            _pclosecmd(fp3);
             sprintf(command,"rm %s",TMPFILENAME);
-            fp3 = popen(command, "r");              // delete temporary file
-            fclose(fp3);
+            fp3 = _popencmd(command, "r");              // delete temporary file
+            _pclosecmd(fp3);
         }
         else {
             IOT_ERROR("[rpi] Cannot copy new %s",fname);
@@ -1476,14 +2304,14 @@ bool _restorehfile(char *backupfile) {
 
     sprintf(command,"sudo cp %s %s",backupfile,SOFTAPCONFFILE);
 
-    pf = popen(command, "r");
+    pf = _popencmd(command, "r");
     errnum = errno;
 
     if (!pf) {
         IOT_ERROR("[rpi] Failed to restore hostapd config file to prior state; error #%d",errnum);
         return false;
     } else {
-        pclose(pf);
+        _pclosecmd(pf);
         return true;
     }
 
@@ -1493,6 +2321,7 @@ bool _restorehfile(char *backupfile) {
 bool _restoreAP() {
 
     if (AP_ON && APWifionly && APWifionlyRestore) {
+        IOT_OS_TRACE_SCOPE("restoreAP", NULL);
 
         if (!_SoftAPControl("stop")) {
             IOT_ERROR("[rpi] Problem stopping SoftAP");
@@ -1516,55 +2345,125 @@ bool _restoreAP() {
 
 int _switchSSID(char *dev, char *ssid) {
 
-    FILE *pf;
-    char command[100];
-    const int maxdatasize = 50;
-    char data[maxdatasize];
-    char *lineptr;
-    int foundid = 0;
-    char netid;
+    static const char *connevents[] = { "CTRL-EVENT-CONNECTED", "CTRL-EVENT-SSID-TEMP-DISABLED", NULL };
+    struct ctrlsock ctrl;
+    char command[40];
+    char reply[CTRLREPLYSIZE];
+    char state[20];
+    char current[IOT_WIFI_MAX_SSID_LEN+1];
+    int netid;
+    int ret = 0;
+    IOT_OS_TRACE_SCOPE("switchSSID", ssid);
+    PHASE_SCOPE(IOT_BSP_WIFI_PHASE_SWITCH_SSID);
+
+    if (_ctrl_open(&ctrl, WPACTRLDIR, dev) < 0) {
+        IOT_ERROR("[rpi] Cannot reach wpa_supplicant for %s",dev);
+        return(0);
+    }
 
-    sprintf(command,"wpa_cli -i %s list_networks",dev);
+    netid = _wpa_findnetwork(&ctrl, ssid);
+    if (netid < 0) {
+        IOT_ERROR("[rpi] %s not currently available to connect",ssid);
+        goto out;
+    }
 
-    pf = popen(command, "r");
-    if (pf) {
-        while ((fgets(data,maxdatasize,pf)) && (foundid == 0)) {
+    // Already associated to it: re-selecting would only force a reconnect
+    if ((_wpa_status(&ctrl, state, current) == 0) && (strcmp(state,"COMPLETED") == 0) && (strcmp(current,ssid) == 0)) {
+        ret = 1;
+        goto out;
+    }
 
-            lineptr = strstr(data,ssid);
-            if (lineptr) {
-                netid = *data;
-                foundid = 1;
-                pclose(pf);
-                sprintf(command,"wpa_cli -i %s select_network %c",dev,netid);
-                pf = popen(command,"r");
-                if (!pf) {
-                    IOT_ERROR("[rpi] Cannot connect to %s",ssid);
-                    return(0);
-                } else
-                    pclose(pf);
-            }
-        }
+    // Attach first so the connect event can't slip past between select and wait
+    if (_ctrl_request(&ctrl, "ATTACH", reply, sizeof(reply)) < 0 || strncmp(reply,"OK",2) != 0) {
+        IOT_ERROR("[rpi] Cannot attach to wpa_supplicant events");
+        goto out;
+    }
 
-        if (!foundid) {
-            pclose(pf);
-            IOT_ERROR("[rpi] %s not currently available to connect",ssid);
-            return(0);
-        }
+    sprintf(command,"SELECT_NETWORK %d",netid);
+    if (_ctrl_request(&ctrl, command, reply, sizeof(reply)) < 0 || strncmp(reply,"OK",2) != 0) {
+        IOT_ERROR("[rpi] Cannot connect to %s",ssid);
+        goto detach;
+    }
 
+    switch (_ctrl_waitevent(&ctrl, connevents, WPACONNTIMEOUT)) {
+        case 0:
+            ret = 1;
+            break;
+        case 1:
+            IOT_ERROR("[rpi] %s rejected the connection (check password)",ssid);
+            break;
+        default:
+            IOT_ERROR("[rpi] Timed out connecting to %s",ssid);
+            break;
+    }
 
-    } else {
-        IOT_ERROR("[rpi] Failed to issue wpa_cli command");
-        return(0);
+detach:
+    _ctrl_request(&ctrl, "DETACH", reply, sizeof(reply));
+out:
+    _ctrl_close(&ctrl);
+    return(ret);
+}
+
+// LIST_NETWORKS; returns the id of the configured network with this exact SSID, or -1
+int _wpa_findnetwork(struct ctrlsock *ctrl, const char *ssid) {
+
+    char reply[CTRLREPLYSIZE];
+    char *line;
+    char *field;
+    char *saveline;
+    char *savefield;
+    int netid;
+
+    if (_ctrl_request(ctrl, "LIST_NETWORKS", reply, sizeof(reply)) < 0)
+        return -1;
+
+    // "network id / ssid / bssid / flags" header, then one tab-separated line per network
+    line = strtok_r(reply, "\n", &saveline);
+    while ((line = strtok_r(NULL, "\n", &saveline))) {
+
+        field = strtok_r(line, "\t", &savefield);
+        if (!field)
+            continue;
+        netid = atoi(field);
+
+        field = strtok_r(NULL, "\t", &savefield);
+        if (field && strcmp(field, ssid) == 0)
+            return netid;
     }
 
-    return(1);
+    return -1;
+}
+
+// STATUS; copies wpa_state and ssid (either may come back empty)
+int _wpa_status(struct ctrlsock *ctrl, char *state, char *ssid) {
+
+    char reply[CTRLREPLYSIZE];
+    char *line;
+    char *saveline;
+
+    strcpy(state, "");
+    strcpy(ssid, "");
+
+    if (_ctrl_request(ctrl, "STATUS", reply, sizeof(reply)) < 0)
+        return -1;
+
+    for (line = strtok_r(reply, "\n", &saveline); line; line = strtok_r(NULL, "\n", &saveline)) {
+        if (strncmp(line, "wpa_state=", 10) == 0)
+            snprintf(state, 20, "%s", line + 10);
+        else if (strncmp(line, "ssid=", 5) == 0)
+            snprintf(ssid, IOT_WIFI_MAX_SSID_LEN+1, "%s", line + 5);
+    }
+
+    return 0;
 }
 
 uint16_t iot_bsp_wifi_get_scan_result(iot_wifi_scan_result_t * scan_result)
 {
     int index;
+    int apcount;
+    unsigned int generation;
 
-
+    iot_os_mutex_lock(&scanlock);
 
     for(index = 0;index < scanstore.apcount;index++) {
 
@@ -1584,246 +2483,2061 @@ uint16_t iot_bsp_wifi_get_scan_result(iot_wifi_scan_result_t * scan_result)
 
     }
 
-    IOT_INFO("[rpi] Get scan result requested; %d available", scanstore.apcount);
+    apcount = scanstore.apcount;
+    generation = scanstore.generation;
+    iot_os_mutex_unlock(&scanlock);
+
+    IOT_INFO("[rpi] Get scan result requested; %d available (generation %u)", apcount, generation);
 
-    return(scanstore.apcount);
+    return(apcount);
 }
 
-int _perform_scan()  {
+/*******************************************************************************************
+    Scan cache
 
-    const int maxdatasize = 1200;
-    #define LINUXWIFISCAN_p1 "sudo iw "
-    #define LINUXWIFISCAN_p2 " scan"
+    Scans land in a private buffer and are published to scanstore under scanlock with a new
+    generation number. While the station interface is in use a background task refreshes the
+    cache every 3/4 of SCAN_CACHE_TTL, so a SCAN request can usually be answered at once.
 
-    FILE *pf;
-    char command[30];
-    char data[maxdatasize];
-    char scandev[16];
-    int ap_num;
-    char *lineptr;
-    int errnum, ferr;
-    int i;
-    char tmpbuf[IOT_WIFI_MAX_SSID_LEN+1];
+*******************************************************************************************/
 
-    if (strcmp(wifi_sta_dev,"") != 0)
-        strcpy(scandev,wifi_sta_dev);
-    else
-        strcpy(scandev,wifi_ap_dev);
+unsigned long long _monotonic_ms() {
 
-    IOT_INFO("[rpi] Running Wifi AP scan using %s",scandev);
+    struct timespec ts;
 
-    // Execute system command to get wifi scan list
-    strcpy(command,LINUXWIFISCAN_p1);
-    strcat(command, scandev);
-    strcat(command, LINUXWIFISCAN_p2);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    scanstore.apcount = 0;
-    ap_num = -1;
+// Run a scan and publish it if it found anything; returns AP count
+int _refresh_scan() {
 
-    pf = popen(command,"r");
+    struct scandata *fresh;
+    int count;
 
-    if (pf) {
+    fresh = calloc(1, sizeof(struct scandata));
+    if (!fresh)
+        return 0;
 
-        // Read each line output from system command
-        while ((fgets(data,maxdatasize,pf)) && (ap_num < (IOT_WIFI_MAX_SCAN_RESULT-1))) {
+    iot_os_mutex_lock(&scanrunlock);
+    count = _perform_scan(fresh);
+    iot_os_mutex_unlock(&scanrunlock);
 
-            lineptr = strstr(data,"BSS ");                          // Start of new Mac Address? (BSS)
-            if (lineptr) {
+    if (count > 0) {
+        iot_os_mutex_lock(&scanlock);
+        fresh->generation = scanstore.generation + 1;
+        fresh->updated_ms = _monotonic_ms();
+        memcpy(&scanstore, fresh, sizeof(scanstore));
+        iot_os_mutex_unlock(&scanlock);
+    }
 
+    free(fresh);
+    return count;
+}
 
-                if (lineptr == data) {                              // Make sure it is really a BSS record; should be no leading chars
-                    ap_num = ap_num + 1;                                // Increment AP index
+// True if scanstore holds a result younger than SCAN_CACHE_TTL; also returns its generation
+// and AP count as read under scanlock (a refresh may replace it right after)
+bool _scancache_fresh(unsigned int *generation, int *apcount) {
 
-                    scanstore.apdata[ap_num].authmode = IOT_WIFI_AUTH_OPEN;  // Deafult to Open auth mode in case not specified
+    bool fresh;
 
-                    _parsemac(lineptr+4, scanstore.apdata[ap_num].bssid);    // Get Mac Addr and convert ASCII to 6-byte format
-                }
-            }
+    if (ScanCacheTTL <= 0)
+        return false;
 
-            else {
-                lineptr = strstr(data,"\t\t * primary channel:");
-                if (lineptr)
-                                                                    // Found Wifi Channel
-                    scanstore.apdata[ap_num].freq = _getnumeric(2,lineptr+22);
+    iot_os_mutex_lock(&scanlock);
+    fresh = (scanstore.generation > 0) && (scanstore.apcount > 0) &&
+            (_monotonic_ms() - scanstore.updated_ms < (unsigned long long)ScanCacheTTL * 1000);
+    *generation = scanstore.generation;
+    *apcount = scanstore.apcount;
+    iot_os_mutex_unlock(&scanlock);
 
-                else {
-                    lineptr = strstr(data,"\tsignal:");
-                    if (lineptr)
-                                                                    // Found Wifi Signal Level (RSSI)
-                        scanstore.apdata[ap_num].rssi = _getnumeric(6,lineptr+9);
+    return fresh;
+}
 
-                    else {
-                        lineptr = strstr(data,"\tSSID:");
-                        if (lineptr) {
-                                                                                    // Found SSID
-                            i=0;                   // ****VVV 010722 Removed test for space char (for SSIDs with embedded spaces)
-                            while ((i < IOT_WIFI_MAX_SSID_LEN) && (*(lineptr+i+7) != '\n')) {
-                                tmpbuf[i] = *(lineptr + i + 7);
-                                i++;
-                            }
-                            tmpbuf[i] = 0;
+void _scan_refresher(void *arg) {
 
-                            strcpy((char*)scanstore.apdata[ap_num].ssid, tmpbuf);
+    unsigned int interval = ScanCacheTTL * 750;                  // refresh before entries go stale
 
-                        }
-                        else {
-                            lineptr = strstr(data,"\t\t * Pairwise ciphers:");          // This is the Auth mode line
-                            if (lineptr) {
+    while (!iot_os_thread_should_stop()) {
 
-                                if (strstr(lineptr,"CCMP TKIP"))
-                                    scanstore.apdata[ap_num].authmode = IOT_WIFI_AUTH_WPA_WPA2_PSK;
+        iot_os_eventgroup_wait_bits(scanevents, SCANEVT_REFRESH, true, interval);
 
-                                else
+        if (STA_ON && !iot_os_thread_should_stop())
+            _refresh_scan();
+    }
+}
 
-                                    if (strstr(lineptr,"TKIP CCMP"))
-                                        scanstore.apdata[ap_num].authmode = IOT_WIFI_AUTH_WPA_WPA2_PSK;
+/*******************************************************************************************
+    Link event monitor
 
-                                    else
+    A background task listens for rtnetlink link / IPv4 address changes and nl80211 MLME
+    events (connect, disconnect, station join / leave) on the station, AP and Ethernet
+    interfaces. Current state is kept in linkstates under linklock, and every change sets
+    LINKEVT_CHANGE in linkevents so waiters can re-check instead of polling. SoftAP client
+    join / leave is reported to the SDK through the registered event callback.
 
-                                        if (strstr(lineptr,"CCMP"))
-                                            scanstore.apdata[ap_num].authmode = IOT_WIFI_AUTH_WPA2_PSK;
+*******************************************************************************************/
 
-                                        else
+int _start_eventmonitor() {
 
-                                            if (strstr(lineptr,"TKIP"))
-                                                scanstore.apdata[ap_num].authmode = IOT_WIFI_AUTH_WPA_PSK;
+    iot_os_mutex_init(&linklock);
+    linkevents = iot_os_eventgroup_create();
+    if (!linkevents)
+        return 0;
 
-                                            else
+    _tracklink(wifi_sta_dev);
+    _tracklink(wifi_ap_dev);
+    _tracklink(eth_dev);
 
-                                                if (strstr(lineptr,"WEP"))
-                                                    scanstore.apdata[ap_num].authmode = IOT_WIFI_AUTH_WEP;   //Need to test this
+    // Seed the table; events that race the dump are caught once the monitor subscribes
+    if (!_seedlinks())
+        return 0;
 
-                            }
-                        }
-                    }
-                }
-            }
-        }
-        ferr = ferror(pf);
-        if (ferr) {
-            errnum = errno;
-            IOT_ERROR("[rpi] Error reading scan results; ferror=%d, errno=%d",ferr,errnum);
-        }
-        pclose(pf);
+    return iot_os_thread_create(_eventmonitor, "wifievents", 8192, NULL, 2, &evthread) == IOT_OS_TRUE;
+}
 
-    } else
-        IOT_ERROR("[rpi] Failed to issue iw scan command");
+// Add an interface to the tracked set, or reset an already tracked one (it may have been re-created)
+void _tracklink(const char *devname) {
 
-    scanstore.apcount = ap_num+1;
+    struct linkstate *link;
+    int i;
 
-    return (ap_num+1);
+    if (strcmp(devname,"") == 0)
+        return;
+
+    iot_os_mutex_lock(&linklock);
+
+    for (i = 0; i < linkcount; i++) {
+        if (strcmp(linkstates[i].name, devname) == 0)
+            break;
+    }
+
+    if (i < linkcount || linkcount < MAXTRACKEDLINKS) {      // new, or re-created under a new ifindex
+        link = &linkstates[i];
+        if (i == linkcount)
+            linkcount++;
+        memset(link, 0, sizeof(struct linkstate));
+        strcpy(link->name, devname);
+        link->ifindex = if_nametoindex(devname);
+    }
+
+    iot_os_mutex_unlock(&linklock);
 }
 
-// This function parses presumed ASCII numeric digits; stops when max digits parsed or space or carriage return found
-int _getnumeric(int maxdigits, char *text) {
+// (Re)build up / carrier / IPv4 state of the tracked links from RTM_GETLINK and RTM_GETADDR dumps.
+// Runs before the monitor starts and on the monitor thread after ENOBUFS, when missed events
+// may have left the table stale; the dumps fill a copy so waiters never see it half built.
+bool _seedlinks() {
 
-    int index = 0;
-    char tmpbuf[10];
+    uint32_t req[NLREQSIZE/4];
+    struct linkstate snap[MAXTRACKEDLINKS];
+    struct nlmsghdr *nlh;
+    struct ifaddrmsg *ifa;
+    int fd;
+    int i;
 
-    while ((index < maxdigits) && (*(text+index) != ' ') && (*(text+index) != '\n')) {
-        tmpbuf[index] = *(text+index);
-        index++;
+    iot_os_mutex_lock(&linklock);
+    memcpy(snap, linkstates, sizeof(snap));
+    iot_os_mutex_unlock(&linklock);
+
+    for (i = 0; i < MAXTRACKEDLINKS; i++) {
+        snap[i].up = false;
+        snap[i].carrier = false;
+        snap[i].addrcount = 0;
     }
-    tmpbuf[index] = 0;
-    return(atoi(tmpbuf));
 
+    fd = _nlsocket(NETLINK_ROUTE);
+    if (fd < 0)
+        return false;
+
+    nlh = _nlmsg_init(req, RTM_GETLINK, NLM_F_DUMP, sizeof(struct ifinfomsg));
+    _nltalk(fd, nlh, _rtevent_cb, snap);
+
+    nlh = _nlmsg_init(req, RTM_GETADDR, NLM_F_DUMP, sizeof(struct ifaddrmsg));
+    ifa = NLMSG_DATA(nlh);
+    ifa->ifa_family = AF_INET;
+    _nltalk(fd, nlh, _rtevent_cb, snap);
+    close(fd);
+
+    iot_os_mutex_lock(&linklock);
+    for (i = 0; i < linkcount; i++) {
+        if (linkstates[i].ifindex != snap[i].ifindex)      // re-created meanwhile; _tracklink reset it
+            continue;
+        linkstates[i].up = snap[i].up;
+        linkstates[i].carrier = snap[i].carrier;
+        if (!linkstates[i].carrier)
+            linkstates[i].stations = 0;
+        linkstates[i].addrcount = snap[i].addrcount;
+        memcpy(linkstates[i].addrs, snap[i].addrs, sizeof(snap[i].addrs));
+    }
+    iot_os_mutex_unlock(&linklock);
+
+    iot_os_eventgroup_set_bits(linkevents, LINKEVT_CHANGE);
+
+    return true;
 }
 
-/*******************************************************************************************
-    Required BSP fuction: iot_bsp_wifi_get_mac()
+// Caller holds linklock (or owns table)
+struct linkstate *_findlink(struct linkstate *table, int ifindex) {
 
-    Purpose:    Discover and return this device's mac address
+    int i;
 
-    Input:      mac address structure (iot_mac)
+    for (i = 0; i < linkcount; i++) {
+        if (table[i].ifindex == ifindex)
+            return &table[i];
+    }
+    return NULL;
+}
 
-    Output:     return IOT_ERROR_ value (IOT_ERROR_NONE if no errors) + filled-in wifi_mac
+void _eventmonitor(void *arg) {
 
-*******************************************************************************************/
-iot_error_t iot_bsp_wifi_get_mac(struct iot_mac *wifi_mac)  {
+    struct pollfd pfd[2];
+    struct nlmsghdr *nlh;
+    uint32_t group;
+    uint32_t mlmegroup = 0;
+    char *buf;
+    int len;
+    int i;
 
-    char txt[18];
+    buf = malloc(NLBUFSIZE);
+    pfd[0].fd = _nlsocket(NETLINK_ROUTE);
+    pfd[1].fd = _nlsocket(NETLINK_GENERIC);
+    pfd[0].events = pfd[1].events = POLLIN;
 
-    IOT_INFO("[rpi] Mac address requested");
+    if (!buf || pfd[0].fd < 0) {
+        IOT_ERROR("[rpi] Link event monitor cannot start");
+        goto out;
+    }
 
-    if (Ethernet)
-        memcpy(wifi_mac->addr,ethmacaddr,IOT_WIFI_MAX_BSSID_LEN);
+    group = RTNLGRP_LINK;
+    setsockopt(pfd[0].fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group));
+    group = RTNLGRP_IPV4_IFADDR;
+    setsockopt(pfd[0].fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group));
 
-    else
-        memcpy(wifi_mac->addr,wifimacaddr,IOT_WIFI_MAX_BSSID_LEN);
+    // Without nl80211 (no wireless driver) only link and address changes are monitored
+    if (pfd[1].fd >= 0 && (_genl_resolve(pfd[1].fd, NL80211_GENL_NAME, "mlme", &nl80211family, &mlmegroup) < 0 ||
+            setsockopt(pfd[1].fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &mlmegroup, sizeof(mlmegroup)) < 0)) {
+        close(pfd[1].fd);
+        pfd[1].fd = -1;                                     // poll() ignores negative fds
+    }
 
+    IOT_INFO("[rpi] Link event monitor started%s", (pfd[1].fd < 0) ? " (no nl80211 events)" : "");
 
-    sprintf(txt,"%x:%x:%x:%x:%x:%x", wifi_mac->addr[0], \
-                                            wifi_mac->addr[1], \
-                                            wifi_mac->addr[2], \
-                                            wifi_mac->addr[3], \
-                                            wifi_mac->addr[4], \
-                                            wifi_mac->addr[5]);
-    IOT_INFO("[rpi] Mac=%s",txt);
+    while (!iot_os_thread_should_stop()) {
 
-    return IOT_ERROR_NONE;
+        if (poll(pfd, 2, EVENTPOLLTIME) <= 0)
+            continue;
+
+        for (i = 0; i < 2; i++) {
+
+            if (pfd[i].fd < 0 || !(pfd[i].revents & POLLIN))
+                continue;
+
+            len = recv(pfd[i].fd, buf, NLBUFSIZE, MSG_DONTWAIT);
+            if (len < 0) {
+                if (errno == ENOBUFS) {
+                    IOT_WARN("[rpi] Link events were dropped; re-reading link state");
+                    _seedlinks();
+                }
+                continue;
+            }
+
+            for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len))
+                (i == 0) ? _rtevent_cb(nlh, NULL) : _wifievent_cb(nlh, NULL);
+        }
+    }
+
+out:
+    if (pfd[0].fd >= 0)
+        close(pfd[0].fd);
+    if (pfd[1].fd >= 0)
+        close(pfd[1].fd);
+    free(buf);
 }
 
-/*******************************************************************************************
-    Required BSP fuction: iot_bsp_wifi_get_freq()
+// rtnetlink link and IPv4 address messages (dump replies or multicast events); arg is the
+// table being rebuilt by _seedlinks, or NULL for linkstates
+int _rtevent_cb(struct nlmsghdr *nlh, void *arg) {
 
-    Purpose:    Determine wireless frequency in use by device
+    struct linkstate *table = arg ? arg : linkstates;
 
-    Input:      none
+    struct ifinfomsg *ifi;
+    struct ifaddrmsg *ifa;
+    struct nlattr *tb[IFLA_MAX+1];
+    struct nlattr *ta[IFA_MAX+1];
+    struct linkstate *link;
+    uint32_t addr;
+    bool changed = false;
+    bool carrier;
+    int i;
 
-    Output:     IOT_WIFI_FREQ_2_4G_ONLY (only valid value at this time; 5 GHz not supported)
+    iot_os_mutex_lock(&linklock);
 
-*******************************************************************************************/
-iot_wifi_freq_t iot_bsp_wifi_get_freq(void)
-{
-    return IOT_WIFI_FREQ_2_4G_ONLY;
+    switch (nlh->nlmsg_type) {
+
+        case RTM_NEWLINK:
+        case RTM_DELLINK:
+            ifi = NLMSG_DATA(nlh);
+            link = _findlink(table, ifi->ifi_index);
+            if (!link)
+                break;
+
+            _nla_parse(tb, IFLA_MAX, (struct nlattr *)IFLA_RTA(ifi), IFLA_PAYLOAD(nlh));
+            carrier = (nlh->nlmsg_type == RTM_NEWLINK) && tb[IFLA_CARRIER] && *(uint8_t *)NLA_DATA(tb[IFLA_CARRIER]);
+
+            if (link->up != ((nlh->nlmsg_type == RTM_NEWLINK) && (ifi->ifi_flags & IFF_UP)) || link->carrier != carrier) {
+                link->up = (nlh->nlmsg_type == RTM_NEWLINK) && (ifi->ifi_flags & IFF_UP);
+                link->carrier = carrier;
+                if (!link->carrier)
+                    link->stations = 0;
+                changed = true;
+                IOT_DEBUG("[rpi] %s is %s, carrier %s", link->name, link->up ? "up" : "down", carrier ? "on" : "off");
+            }
+            break;
+
+        case RTM_NEWADDR:
+        case RTM_DELADDR:
+            ifa = NLMSG_DATA(nlh);
+            link = _findlink(table, ifa->ifa_index);
+            if (!link || ifa->ifa_family != AF_INET)
+                break;
+
+            _nla_parse(ta, IFA_MAX, (struct nlattr *)IFA_RTA(ifa), IFA_PAYLOAD(nlh));
+            if (!ta[IFA_LOCAL] && !ta[IFA_ADDRESS])
+                break;
+            addr = *(uint32_t *)NLA_DATA(ta[IFA_LOCAL] ? ta[IFA_LOCAL] : ta[IFA_ADDRESS]);
+
+            for (i = 0; i < link->addrcount && link->addrs[i] != addr; i++)
+                ;
+
+            if (nlh->nlmsg_type == RTM_NEWADDR && i == link->addrcount && link->addrcount < MAXLINKADDRS) {
+                link->addrs[link->addrcount++] = addr;          // lifetime refreshes of a known address are ignored
+                changed = true;
+            }
+            else if (nlh->nlmsg_type == RTM_DELADDR && i < link->addrcount) {
+                link->addrs[i] = link->addrs[--link->addrcount];
+                changed = true;
+            }
+            if (changed)
+                IOT_DEBUG("[rpi] %s now has %d IPv4 address(es)", link->name, link->addrcount);
+            break;
+    }
+
+    iot_os_mutex_unlock(&linklock);
+
+    if (changed && linkevents && !arg)
+        iot_os_eventgroup_set_bits(linkevents, LINKEVT_CHANGE);
+
+    return 0;
 }
 
+// nl80211 MLME events
+int _wifievent_cb(struct nlmsghdr *nlh, void *arg) {
 
-/* New Callback functions */
-iot_error_t iot_bsp_wifi_register_event_cb(iot_bsp_wifi_event_cb_t cb)
-{
-    return IOT_ERROR_NONE;
+    struct genlmsghdr *genl = NLMSG_DATA(nlh);
+    struct nlattr *tb[NL80211_ATTR_MAX+1];
+    struct nlattr *nla;
+    struct linkstate *link;
+    iot_wifi_event_t event;
+    bool notify = false;
+    int len;
+
+    if (nlh->nlmsg_type != nl80211family)
+        return 0;
+
+    nla = _genl_attrs(nlh, &len);
+    _nla_parse(tb, NL80211_ATTR_MAX, nla, len);
+    if (!tb[NL80211_ATTR_IFINDEX])
+        return 0;
+
+    iot_os_mutex_lock(&linklock);
+
+    link = _findlink(linkstates, *(uint32_t *)NLA_DATA(tb[NL80211_ATTR_IFINDEX]));
+    if (!link) {
+        iot_os_mutex_unlock(&linklock);
+        return 0;
+    }
+
+    switch (genl->cmd) {
+
+        case NL80211_CMD_CONNECT:
+            link->reason = tb[NL80211_ATTR_STATUS_CODE] ? *(uint16_t *)NLA_DATA(tb[NL80211_ATTR_STATUS_CODE]) : 0;
+            if (link->reason)
+                IOT_WARN("[rpi] %s connect failed; status %d", link->name, link->reason);
+            else
+                IOT_INFO("[rpi] %s connected", link->name);
+            break;
+
+        case NL80211_CMD_DISCONNECT:
+            link->reason = tb[NL80211_ATTR_REASON_CODE] ? *(uint16_t *)NLA_DATA(tb[NL80211_ATTR_REASON_CODE]) : 0;
+            IOT_INFO("[rpi] %s disconnected; reason %d", link->name, link->reason);
+            break;
+
+        case NL80211_CMD_NEW_STATION:
+            link->stations++;
+            event = IOT_WIFI_EVENT_SOFTAP_STA_JOIN;
+            notify = AP_ON;
+            IOT_INFO("[rpi] Client joined %s (%d associated)", link->name, link->stations);
+            break;
+
+        case NL80211_CMD_DEL_STATION:
+            if (link->stations > 0)
+                link->stations--;
+            event = IOT_WIFI_EVENT_SOFTAP_STA_LEAVE;
+            notify = AP_ON;
+            IOT_INFO("[rpi] Client left %s (%d associated)", link->name, link->stations);
+            break;
+
+        default:
+            iot_os_mutex_unlock(&linklock);
+            return 0;
+    }
+
+    iot_os_mutex_unlock(&linklock);
+
+    iot_os_eventgroup_set_bits(linkevents, LINKEVT_CHANGE);
+    if (notify)
+        _notify_event(event, IOT_ERROR_NONE);
+
+    return 0;
 }
 
-void iot_bsp_wifi_clear_event_cb(void)
-{
+void _notify_event(iot_wifi_event_t event, iot_error_t error) {
+
+    iot_bsp_wifi_event_cb_t cb = wifi_event_cb;
+
+    if (cb)
+        cb(event, error);
 }
 
-/************************************************/
+/*******************************************************************************************
+    Concurrent station + SoftAP
 
-void _parsemac(char *textptr, uint8_t *hexbuf) {
+    On radios whose nl80211 interface combinations allow a station and an AP at once (the
+    Pi's brcmfmac does, on a single channel), the SoftAP runs on a virtual interface created
+    next to the station one. The uplink stays associated while provisioning, and the AP is
+    created on the station's current channel.
 
-    *(hexbuf+0) = _htoi(textptr + 0);
-    *(hexbuf+1) = _htoi(textptr + 3);
-    *(hexbuf+2) = _htoi(textptr + 6);
-    *(hexbuf+3) = _htoi(textptr + 9);
-    *(hexbuf+4) = _htoi(textptr + 12);
-    *(hexbuf+5) = _htoi(textptr + 15);
+*******************************************************************************************/
 
-    return;
-}
+struct wifiinfo {
+    uint32_t wiphy;
+    uint32_t freq;
+    uint8_t mac[IOT_WIFI_MAX_BSSID_LEN];
+    bool hasmac;
+    bool found;
+};
 
-unsigned int _htoi (const char *ptr) {
+struct ifcombs {
+    bool staap;                             // some combination allows a station and an AP together
+};
 
-    unsigned int value = 0;
-    char ch = *ptr;
+int _freq2channel(uint32_t freq) {
 
-    while (ch == ' ' || ch == '\t')
-        ch = *(++ptr);
+    if (freq == 2484)
+        return 14;
+    if (freq >= 2412 && freq < 2484)
+        return (freq - 2407) / 5;
+    if (freq >= 5000 && freq < 5900)
+        return (freq - 5000) / 5;
 
-    for (;;) {
+    return 0;
+}
 
-        if (ch >= '0' && ch <= '9')
-            value = (value << 4) + (ch - '0');
-        else if (ch >= 'A' && ch <= 'F')
-            value = (value << 4) + (ch - 'A' + 10);
-        else if (ch >= 'a' && ch <= 'f')
-            value = (value << 4) + (ch - 'a' + 10);
-        else
-            return value;
+int _wifiinfo_cb(struct nlmsghdr *nlh, void *arg) {
 
-        ch = *(++ptr);
+    struct wifiinfo *info = arg;
+    struct nlattr *tb[NL80211_ATTR_MAX+1];
+    struct nlattr *nla;
+    int len;
+
+    nla = _genl_attrs(nlh, &len);
+    _nla_parse(tb, NL80211_ATTR_MAX, nla, len);
+
+    if (tb[NL80211_ATTR_WIPHY]) {
+        info->wiphy = *(uint32_t *)NLA_DATA(tb[NL80211_ATTR_WIPHY]);
+        info->found = true;
+    }
+    if (tb[NL80211_ATTR_WIPHY_FREQ])
+        info->freq = *(uint32_t *)NLA_DATA(tb[NL80211_ATTR_WIPHY_FREQ]);
+    if (tb[NL80211_ATTR_MAC] && NLA_PAYLOAD(tb[NL80211_ATTR_MAC]) >= IOT_WIFI_MAX_BSSID_LEN) {
+        memcpy(info->mac, NLA_DATA(tb[NL80211_ATTR_MAC]), IOT_WIFI_MAX_BSSID_LEN);
+        info->hasmac = true;
     }
 
+    return 0;
 }
 
+// GET_INTERFACE: the radio (wiphy) behind dev, its hardware address and, if associated /
+// beaconing, its frequency
+int _wifiinfo(const char *dev, uint32_t *wiphy, uint32_t *freq, uint8_t *mac) {
+
+    uint32_t req[NLREQSIZE/4];
+    struct nlmsghdr *nlh;
+    struct wifiinfo info = { 0 };
+    uint32_t ifindex;
+    uint16_t family;
+    int fd;
+    int ret;
+
+    ifindex = if_nametoindex(dev);
+    if (ifindex == 0)
+        return -ENODEV;
+
+    fd = _nlsocket(NETLINK_GENERIC);
+    if (fd < 0)
+        return -EIO;
+
+    ret = _genl_resolve(fd, NL80211_GENL_NAME, NULL, &family, NULL);
+    if (ret == 0) {
+        nlh = _genlmsg_init(req, family, NL80211_CMD_GET_INTERFACE, 0);
+        _nla_put(nlh, NL80211_ATTR_IFINDEX, &ifindex, sizeof(ifindex));
+        ret = _nltalk(fd, nlh, _wifiinfo_cb, &info);
+    }
+    close(fd);
+
+    if (ret < 0)
+        return ret;
+    if (!info.found)
+        return -ENODEV;
+    if (mac && !info.hasmac)
+        return -ENODATA;
+
+    *wiphy = info.wiphy;
+    if (freq)
+        *freq = info.freq;
+    if (mac)
+        memcpy(mac, info.mac, IOT_WIFI_MAX_BSSID_LEN);
+
+    return 0;
+}
+
+// Split GET_WIPHY dump of one radio; capabilities arrive spread over several messages
+int _wiphy_dump(uint32_t wiphy, nlmsg_cb_t cb, void *arg) {
+
+    uint32_t req[NLREQSIZE/4];
+    struct nlmsghdr *nlh;
+    uint16_t family;
+    int fd;
+    int ret;
+
+    fd = _nlsocket(NETLINK_GENERIC);
+    if (fd < 0)
+        return -EIO;
+
+    ret = _genl_resolve(fd, NL80211_GENL_NAME, NULL, &family, NULL);
+    if (ret == 0) {
+        nlh = _genlmsg_init(req, family, NL80211_CMD_GET_WIPHY, NLM_F_DUMP);
+        _nla_put(nlh, NL80211_ATTR_WIPHY, &wiphy, sizeof(wiphy));
+        _nla_put(nlh, NL80211_ATTR_SPLIT_WIPHY_DUMP, NULL, 0);
+        ret = _nltalk(fd, nlh, cb, arg);
+    }
+    close(fd);
+
+    return ret;
+}
+
+int _ifcomb_cb(struct nlmsghdr *nlh, void *arg) {
+
+    struct ifcombs *combs = arg;
+    struct nlattr *tb[NL80211_ATTR_MAX+1];
+    struct nlattr *comb[NUM_NL80211_IFACE_COMB];
+    struct nlattr *limit[NUM_NL80211_IFACE_LIMIT];
+    struct nlattr *nla;
+    struct nlattr *lim;
+    struct nlattr *type;
+    bool sta;
+    bool ap;
+    int len;
+    int rem;
+    int limrem;
+    int typerem;
+
+    nla = _genl_attrs(nlh, &len);
+    _nla_parse(tb, NL80211_ATTR_MAX, nla, len);
+    if (!tb[NL80211_ATTR_INTERFACE_COMBINATIONS])
+        return 0;
+
+    rem = NLA_PAYLOAD(tb[NL80211_ATTR_INTERFACE_COMBINATIONS]);
+    for (nla = NLA_DATA(tb[NL80211_ATTR_INTERFACE_COMBINATIONS]); NLA_OK(nla, rem); nla = NLA_NEXT(nla, rem)) {
+
+        _nla_parse(comb, MAX_NL80211_IFACE_COMB, NLA_DATA(nla), NLA_PAYLOAD(nla));
+        if (!comb[NL80211_IFACE_COMB_LIMITS] || !comb[NL80211_IFACE_COMB_MAXNUM] ||
+                *(uint32_t *)NLA_DATA(comb[NL80211_IFACE_COMB_MAXNUM]) < 2)
+            continue;
+
+        sta = ap = false;
+        limrem = NLA_PAYLOAD(comb[NL80211_IFACE_COMB_LIMITS]);
+        for (lim = NLA_DATA(comb[NL80211_IFACE_COMB_LIMITS]); NLA_OK(lim, limrem); lim = NLA_NEXT(lim, limrem)) {
+
+            _nla_parse(limit, MAX_NL80211_IFACE_LIMIT, NLA_DATA(lim), NLA_PAYLOAD(lim));
+            if (!limit[NL80211_IFACE_LIMIT_TYPES])
+                continue;
+
+            // TYPES is a nest of flag attributes whose type is the iftype
+            typerem = NLA_PAYLOAD(limit[NL80211_IFACE_LIMIT_TYPES]);
+            for (type = NLA_DATA(limit[NL80211_IFACE_LIMIT_TYPES]); NLA_OK(type, typerem); type = NLA_NEXT(type, typerem)) {
+                if ((type->nla_type & NLA_TYPE_MASK) == NL80211_IFTYPE_STATION)
+                    sta = true;
+                else if ((type->nla_type & NLA_TYPE_MASK) == NL80211_IFTYPE_AP)
+                    ap = true;
+            }
+        }
+
+        if (sta && ap)
+            combs->staap = true;
+    }
+
+    return 0;
+}
+
+// Collect the bands (nl80211_band) in which the radio has at least one enabled frequency
+int _bands_cb(struct nlmsghdr *nlh, void *arg) {
+
+    int *bands = arg;
+    struct nlattr *tb[NL80211_ATTR_MAX+1];
+    struct nlattr *band[NL80211_BAND_ATTR_MAX+1];
+    struct nlattr *freq[NL80211_FREQUENCY_ATTR_MAX+1];
+    struct nlattr *nla;
+    struct nlattr *fnla;
+    int len;
+    int rem;
+    int frem;
+
+    nla = _genl_attrs(nlh, &len);
+    _nla_parse(tb, NL80211_ATTR_MAX, nla, len);
+    if (!tb[NL80211_ATTR_WIPHY_BANDS])
+        return 0;
+
+    rem = NLA_PAYLOAD(tb[NL80211_ATTR_WIPHY_BANDS]);
+    for (nla = NLA_DATA(tb[NL80211_ATTR_WIPHY_BANDS]); NLA_OK(nla, rem); nla = NLA_NEXT(nla, rem)) {
+
+        _nla_parse(band, NL80211_BAND_ATTR_MAX, NLA_DATA(nla), NLA_PAYLOAD(nla));
+        if (!band[NL80211_BAND_ATTR_FREQS])
+            continue;
+
+        frem = NLA_PAYLOAD(band[NL80211_BAND_ATTR_FREQS]);
+        for (fnla = NLA_DATA(band[NL80211_BAND_ATTR_FREQS]); NLA_OK(fnla, frem); fnla = NLA_NEXT(fnla, frem)) {
+
+            _nla_parse(freq, NL80211_FREQUENCY_ATTR_MAX, NLA_DATA(fnla), NLA_PAYLOAD(fnla));
+            if (freq[NL80211_FREQUENCY_ATTR_FREQ] && !freq[NL80211_FREQUENCY_ATTR_DISABLED]) {
+                *bands |= 1 << (nla->nla_type & NLA_TYPE_MASK);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+bool _concurrentsupported(const char *dev) {
+
+    struct ifcombs combs = { false };
+    uint32_t wiphy;
+
+    if (_wifiinfo(dev, &wiphy, NULL, NULL) < 0 || _wiphy_dump(wiphy, _ifcomb_cb, &combs) < 0)
+        return false;
+
+    return combs.staap;
+}
+
+// Create (or delete) the virtual AP interface; needs CAP_NET_ADMIN, else falls back to 'sudo iw'
+bool _apiface(bool create) {
+
+    uint32_t req[NLREQSIZE/4];
+    struct nlmsghdr *nlh;
+    uint32_t wiphy;
+    uint32_t ifindex;
+    uint32_t iftype = NL80211_IFTYPE_AP;
+    uint8_t stamac[IOT_WIFI_MAX_BSSID_LEN];
+    uint8_t mac[IOT_WIFI_MAX_BSSID_LEN];
+    uint16_t family;
+    char command[120];
+    int fd;
+    int ret;
+
+    ifindex = if_nametoindex(wifi_ap_dev);
+    if (create == (ifindex != 0)) {
+        _tracklink(wifi_ap_dev);
+        return true;                                        // already in the requested state
+    }
+
+    if (create) {
+        if (_wifiinfo(wifi_sta_dev, &wiphy, NULL, stamac) < 0)
+            return false;
+
+        // Same radio, so a distinct (locally administered) address for the AP's BSSID; a station
+        // address that is already locally administered (randomized MAC) gets its last octet changed
+        memcpy(mac, stamac, IOT_WIFI_MAX_BSSID_LEN);
+        mac[0] |= 0x02;
+        if (memcmp(mac, stamac, IOT_WIFI_MAX_BSSID_LEN) == 0)
+            mac[5] ^= 0x01;
+    }
+
+    fd = _nlsocket(NETLINK_GENERIC);
+    if (fd < 0)
+        return false;
+
+    ret = _genl_resolve(fd, NL80211_GENL_NAME, NULL, &family, NULL);
+    if (ret == 0) {
+        if (create) {
+            nlh = _genlmsg_init(req, family, NL80211_CMD_NEW_INTERFACE, 0);
+            _nla_put(nlh, NL80211_ATTR_WIPHY, &wiphy, sizeof(wiphy));
+            _nla_put(nlh, NL80211_ATTR_IFNAME, wifi_ap_dev, strlen(wifi_ap_dev) + 1);
+            _nla_put(nlh, NL80211_ATTR_IFTYPE, &iftype, sizeof(iftype));
+            _nla_put(nlh, NL80211_ATTR_MAC, mac, IOT_WIFI_MAX_BSSID_LEN);
+        } else {
+            nlh = _genlmsg_init(req, family, NL80211_CMD_DEL_INTERFACE, 0);
+            _nla_put(nlh, NL80211_ATTR_IFINDEX, &ifindex, sizeof(ifindex));
+        }
+        ret = _nltalk(fd, nlh, NULL, NULL);
+    }
+    close(fd);
+
+    if (ret == -EPERM) {
+        if (create)
+            sprintf(command,"sudo iw phy#%u interface add %s type __ap addr %02x:%02x:%02x:%02x:%02x:%02x",
+                        wiphy, wifi_ap_dev, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+        else
+            sprintf(command,"sudo iw dev %s del",wifi_ap_dev);
+        _pipecommand(command);
+        ret = (create == (if_nametoindex(wifi_ap_dev) != 0)) ? 0 : -EPERM;
+    }
+
+    if (ret < 0) {
+        IOT_ERROR("[rpi] Cannot %s %s; error #%d", create ? "create" : "delete", wifi_ap_dev, -ret);
+        return false;
+    }
+
+    if (create)
+        _tracklink(wifi_ap_dev);
+    IOT_INFO("[rpi] %s %s", create ? "Created" : "Deleted", wifi_ap_dev);
+
+    return true;
+}
+
+// Value of a "key=value" line
+bool _getconfline(char *fname, char *key, char *value, size_t len) {
+
+    FILE *fp;
+    char data[200];
+    size_t keylen = strlen(key);
+    bool found = false;
+
+    fp = fopen(fname,"r");
+    if (!fp)
+        return false;
+
+    while (!found && fgets(data,sizeof(data),fp)) {
+        if (strncmp(data,key,keylen) == 0 && data[keylen] == '=') {
+            data[strcspn(data,"\n")] = '\0';
+            snprintf(value, len, "%s", data + keylen + 1);
+            found = true;
+        }
+    }
+
+    fclose(fp);
+    return found;
+}
+
+// Set "key=value" in a root-owned config file (temp copy + sudo cp); no write if already set
+bool _setconfline(char *fname, char *key, char *value) {
+
+    FILE *fp1, *fp2;
+    char *readline = NULL;
+    size_t len = 0;
+    size_t keylen = strlen(key);
+    char current[100];
+    char command[200];
+
+    if (_getconfline(fname, key, current, sizeof(current)) && strcmp(current, value) == 0)
+        return true;
+
+    fp1 = fopen(fname,"r");
+    if (!fp1) {
+        IOT_ERROR("[rpi] Cannot open %s",fname);
+        return false;
+    }
+
+    fp2 = fopen(CONFTMPFILE,"w");
+    if (!fp2) {
+        IOT_ERROR("[rpi] Cannot open temp file %s",CONFTMPFILE);
+        fclose(fp1);
+        return false;
+    }
+
+    while (getline(&readline,&len,fp1) != EOF) {
+        if (strncmp(readline,key,keylen) == 0 && readline[keylen] == '=')
+            fprintf(fp2,"%s=%s\n",key,value);
+        else
+            fprintf(fp2,"%s",readline);
+    }
+
+    free(readline);
+    fclose(fp1);
+    fclose(fp2);
+
+    sprintf(command,"sudo cp %s %s",CONFTMPFILE,fname);
+    if (_pipecommand(command) != 0) {
+        IOT_ERROR("[rpi] Cannot update %s",fname);
+        unlink(CONFTMPFILE);
+        return false;
+    }
+    unlink(CONFTMPFILE);
+
+    IOT_INFO("[rpi] %s: %s=%s",fname,key,value);
+    return true;
+}
+
+// Append a line to a root-owned config file (temp copy + sudo cp) unless it is already there
+bool _addconfline(char *fname, char *line, bool *added) {
+
+    FILE *fp1, *fp2;
+    char *readline = NULL;
+    size_t len = 0;
+    ssize_t n;
+    bool found = false;
+    bool eol = true;
+    char command[200];
+
+    *added = false;
+
+    fp1 = fopen(fname,"r");
+    if (!fp1) {
+        IOT_ERROR("[rpi] Cannot open %s",fname);
+        return false;
+    }
+
+    fp2 = fopen(CONFTMPFILE,"w");
+    if (!fp2) {
+        IOT_ERROR("[rpi] Cannot open temp file %s",CONFTMPFILE);
+        fclose(fp1);
+        return false;
+    }
+
+    while ((n = getline(&readline,&len,fp1)) != EOF) {
+        fprintf(fp2,"%s",readline);
+        eol = (n > 0 && readline[n-1] == '\n');
+        readline[strcspn(readline,"\r\n")] = '\0';
+        if (strcmp(readline,line) == 0)
+            found = true;
+    }
+    if (!found)
+        fprintf(fp2,"%s%s\n",eol ? "" : "\n",line);
+
+    free(readline);
+    fclose(fp1);
+    fclose(fp2);
+
+    if (found) {
+        unlink(CONFTMPFILE);
+        return true;
+    }
+
+    sprintf(command,"sudo cp %s %s",CONFTMPFILE,fname);
+    if (_pipecommand(command) != 0) {
+        IOT_ERROR("[rpi] Cannot update %s",fname);
+        unlink(CONFTMPFILE);
+        return false;
+    }
+    unlink(CONFTMPFILE);
+
+    *added = true;
+    IOT_INFO("[rpi] %s: added '%s'",fname,line);
+    return true;
+}
+
+/*******************************************************************************************
+    Wifi scan over nl80211
+
+    Triggers a scan, waits for NEW_SCAN_RESULTS on the nl80211 "scan" multicast group and
+    dumps the kernel's BSS table into scanstore. Triggering needs CAP_NET_ADMIN; without it
+    the kernel's cached results (kept fresh by wpa_supplicant in station mode) are used, and
+    only if those are empty do we fall back to running 'sudo iw scan'.
+
+*******************************************************************************************/
+
+struct scanwait {
+    uint32_t ifindex;
+};
+
+int _scan_event_cb(struct nlmsghdr *nlh, void *arg) {
+
+    struct scanwait *wait = arg;
+    struct genlmsghdr *genl = NLMSG_DATA(nlh);
+    struct nlattr *tb[NL80211_ATTR_MAX+1];
+    struct nlattr *nla;
+    int len;
+
+    nla = _genl_attrs(nlh, &len);
+    _nla_parse(tb, NL80211_ATTR_MAX, nla, len);
+
+    if (!tb[NL80211_ATTR_IFINDEX] || *(uint32_t *)NLA_DATA(tb[NL80211_ATTR_IFINDEX]) != wait->ifindex)
+        return 0;
+
+    if (genl->cmd == NL80211_CMD_NEW_SCAN_RESULTS)
+        return 1;
+    if (genl->cmd == NL80211_CMD_SCAN_ABORTED)
+        return -ECANCELED;
+
+    return 0;
+}
+
+// Fill SSID and auth mode of a BSS from its information elements
+void _parse_ies(const uint8_t *ie, int len, uint16_t capability, iot_wifi_scan_result_t *ap) {
+
+    static const uint8_t wpa_oui[4] = { 0x00, 0x50, 0xf2, 0x01 };   // Microsoft WPA vendor IE
+    bool rsn = false;
+    bool wpa = false;
+    bool rsn_psk = false;
+    bool rsn_8021x = false;
+    int akmcount;
+    int pos;
+    uint8_t id, elen;
+    const uint8_t *data;
+
+    ap->ssid[0] = '\0';
+
+    while (len >= 2) {
+
+        id = ie[0];
+        elen = ie[1];
+        data = ie + 2;
+        if (elen + 2 > len)
+            break;
+
+        switch (id) {
+
+            case 0:                                                 // SSID
+                if (elen <= IOT_WIFI_MAX_SSID_LEN) {
+                    memcpy(ap->ssid, data, elen);
+                    ap->ssid[elen] = '\0';
+                }
+                break;
+
+            case 48:                                                // RSN: version, group cipher, pairwise list, AKM list
+                rsn = true;
+                pos = 2 + 4;
+                if (pos + 2 <= elen)
+                    pos += 2 + 4 * (data[pos] | (data[pos+1] << 8));
+                if (pos + 2 <= elen) {
+                    akmcount = data[pos] | (data[pos+1] << 8);
+                    for (pos += 2; akmcount > 0 && pos + 4 <= elen; akmcount--, pos += 4) {
+                        if (data[pos] != 0x00 || data[pos+1] != 0x0f || data[pos+2] != 0xac)
+                            continue;
+                        if (data[pos+3] == 1 || data[pos+3] == 5)   // 802.1X, 802.1X-SHA256
+                            rsn_8021x = true;
+                        else
+                            rsn_psk = true;                         // PSK, PSK-SHA256, SAE, ...
+                    }
+                }
+                break;
+
+            case 221:                                               // vendor specific
+                if (elen >= 4 && memcmp(data, wpa_oui, 4) == 0)
+                    wpa = true;
+                break;
+        }
+
+        ie += elen + 2;
+        len -= elen + 2;
+    }
+
+    if (rsn && wpa)
+        ap->authmode = IOT_WIFI_AUTH_WPA_WPA2_PSK;
+    else if (rsn)
+        ap->authmode = (rsn_8021x && !rsn_psk) ? IOT_WIFI_AUTH_WPA2_ENTERPRISE : IOT_WIFI_AUTH_WPA2_PSK;
+    else if (wpa)
+        ap->authmode = IOT_WIFI_AUTH_WPA_PSK;
+    else if (capability & 0x0010)                                   // privacy bit without WPA/RSN
+        ap->authmode = IOT_WIFI_AUTH_WEP;
+    else
+        ap->authmode = IOT_WIFI_AUTH_OPEN;
+}
+
+// One BSS from the GET_SCAN dump; keeps the strongest IOT_WIFI_MAX_SCAN_RESULT entries
+int _scan_dump_cb(struct nlmsghdr *nlh, void *arg) {
+
+    struct scandata *store = arg;
+    struct nlattr *tb[NL80211_ATTR_MAX+1];
+    struct nlattr *bss[NL80211_BSS_MAX+1];
+    struct nlattr *ies;
+    struct nlattr *nla;
+    iot_wifi_scan_result_t ap;
+    uint16_t capability = 0;
+    int len;
+    int slot;
+    int i;
+
+    nla = _genl_attrs(nlh, &len);
+    _nla_parse(tb, NL80211_ATTR_MAX, nla, len);
+    if (!tb[NL80211_ATTR_BSS])
+        return 0;
+
+    _nla_parse(bss, NL80211_BSS_MAX, NLA_DATA(tb[NL80211_ATTR_BSS]), NLA_PAYLOAD(tb[NL80211_ATTR_BSS]));
+    if (!bss[NL80211_BSS_BSSID])
+        return 0;
+
+    memset(&ap, 0, sizeof(ap));
+    memcpy(ap.bssid, NLA_DATA(bss[NL80211_BSS_BSSID]), IOT_WIFI_MAX_BSSID_LEN);
+    if (bss[NL80211_BSS_FREQUENCY])
+        ap.freq = *(uint32_t *)NLA_DATA(bss[NL80211_BSS_FREQUENCY]);
+    if (bss[NL80211_BSS_SIGNAL_MBM])
+        ap.rssi = *(int32_t *)NLA_DATA(bss[NL80211_BSS_SIGNAL_MBM]) / 100;
+    if (bss[NL80211_BSS_CAPABILITY])
+        capability = *(uint16_t *)NLA_DATA(bss[NL80211_BSS_CAPABILITY]);
+
+    ies = bss[NL80211_BSS_INFORMATION_ELEMENTS] ? bss[NL80211_BSS_INFORMATION_ELEMENTS] : bss[NL80211_BSS_BEACON_IES];
+    if (ies)
+        _parse_ies(NLA_DATA(ies), NLA_PAYLOAD(ies), capability, &ap);
+
+    if (ap.ssid[0] == '\0')
+        return 0;                                                   // hidden network; nothing to offer the user
+
+    slot = store->apcount;
+    if (slot >= IOT_WIFI_MAX_SCAN_RESULT) {                          // full: replace the weakest if this one is stronger
+        slot = 0;
+        for (i = 1; i < IOT_WIFI_MAX_SCAN_RESULT; i++)
+            if (store->apdata[i].rssi < store->apdata[slot].rssi)
+                slot = i;
+        if (store->apdata[slot].rssi >= ap.rssi)
+            return 0;
+    } else
+        store->apcount++;
+
+    store->apdata[slot] = ap;
+
+    return 0;
+}
+
+int _perform_scan(struct scandata *store)  {
+
+    uint32_t req[NLREQSIZE/4];
+    struct nlmsghdr *nlh;
+    struct nlattr *nest;
+    struct scanwait wait;
+    char scandev[16];
+    uint16_t family;
+    uint32_t scangroup;
+    int cmdfd = -1;
+    int evfd = -1;
+    int ret;
+    bool triggered = false;
+    IOT_OS_TRACE_SCOPE("perform_scan", NULL);
+    PHASE_SCOPE(IOT_BSP_WIFI_PHASE_SCAN);
+
+    if (strcmp(wifi_sta_dev,"") != 0)
+        strcpy(scandev,wifi_sta_dev);
+    else
+        strcpy(scandev,wifi_ap_dev);
+
+    IOT_INFO("[rpi] Running Wifi AP scan using %s",scandev);
+
+    store->apcount = 0;
+
+    wait.ifindex = if_nametoindex(scandev);
+    if (wait.ifindex == 0) {
+        IOT_ERROR("[rpi] Unknown scan device %s",scandev);
+        return 0;
+    }
+
+    cmdfd = _nlsocket(NETLINK_GENERIC);
+    evfd = _nlsocket(NETLINK_GENERIC);
+    if (cmdfd < 0 || evfd < 0 || _genl_resolve(cmdfd, NL80211_GENL_NAME, "scan", &family, &scangroup) < 0)
+        goto legacy;
+
+    // Subscribe before triggering so the completion event can't be missed
+    if (setsockopt(evfd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &scangroup, sizeof(scangroup)) < 0) {
+        IOT_ERROR("[rpi] Cannot join nl80211 scan group; error #%d", errno);
+        goto legacy;
+    }
+
+    nlh = _genlmsg_init(req, family, NL80211_CMD_TRIGGER_SCAN, 0);
+    _nla_put(nlh, NL80211_ATTR_IFINDEX, &wait.ifindex, sizeof(uint32_t));
+    nest = _nla_put(nlh, NL80211_ATTR_SCAN_SSIDS | NLA_F_NESTED, NULL, 0);
+    _nla_put(nlh, 1, NULL, 0);                                      // wildcard SSID: active scan
+    _nla_nest_end(nlh, nest);
+
+    ret = _nltalk(cmdfd, nlh, NULL, NULL);
+    if (ret == 0 || ret == -EBUSY) {                                // EBUSY: a scan is already running; wait for it
+        triggered = true;
+        ret = _nlwait(evfd, _scan_event_cb, &wait, SCANTIMEOUT);
+        if (ret <= 0)
+            IOT_WARN("[rpi] Scan on %s did not complete (%d); using cached results", scandev, ret);
+    } else if (ret == -EPERM || ret == -EACCES)
+        IOT_INFO("[rpi] No permission to trigger a scan; using cached results");
+    else
+        IOT_WARN("[rpi] Cannot trigger scan on %s; error #%d", scandev, -ret);
+
+    nlh = _genlmsg_init(req, family, NL80211_CMD_GET_SCAN, NLM_F_DUMP);
+    _nla_put(nlh, NL80211_ATTR_IFINDEX, &wait.ifindex, sizeof(uint32_t));
+
+    ret = _nltalk(cmdfd, nlh, _scan_dump_cb, store);
+    if (ret < 0)
+        IOT_ERROR("[rpi] Cannot read scan results; error #%d", -ret);
+
+    close(cmdfd);
+    close(evfd);
+
+    if (store->apcount == 0 && !triggered)
+        return _perform_scan_iw(store);
+
+    return store->apcount;
+
+legacy:
+    if (cmdfd >= 0)
+        close(cmdfd);
+    if (evfd >= 0)
+        close(evfd);
+
+    return _perform_scan_iw(store);
+}
+
+// Fallback: parse 'sudo iw <dev> scan' output
+int _perform_scan_iw(struct scandata *store)  {
+
+    const int maxdatasize = 1200;
+    #define LINUXWIFISCAN_p1 "sudo iw "
+    #define LINUXWIFISCAN_p2 " scan"
+
+    FILE *pf;
+    char command[30];
+    char data[maxdatasize];
+    char scandev[16];
+    int ap_num;
+    char *lineptr;
+    int errnum, ferr;
+    int i;
+    char tmpbuf[IOT_WIFI_MAX_SSID_LEN+1];
+
+    if (strcmp(wifi_sta_dev,"") != 0)
+        strcpy(scandev,wifi_sta_dev);
+    else
+        strcpy(scandev,wifi_ap_dev);
+
+    IOT_INFO("[rpi] Running Wifi AP scan using %s",scandev);
+
+    // Execute system command to get wifi scan list
+    strcpy(command,LINUXWIFISCAN_p1);
+    strcat(command, scandev);
+    strcat(command, LINUXWIFISCAN_p2);
+
+    store->apcount = 0;
+    ap_num = -1;
+
+    pf = _popencmd(command,"r");
+
+    if (pf) {
+
+        // Read each line output from system command
+        while ((fgets(data,maxdatasize,pf)) && (ap_num < (IOT_WIFI_MAX_SCAN_RESULT-1))) {
+
+            lineptr = strstr(data,"BSS ");                          // Start of new Mac Address? (BSS)
+            if (lineptr) {
+
+
+                if (lineptr == data) {                              // Make sure it is really a BSS record; should be no leading chars
+                    ap_num = ap_num + 1;                                // Increment AP index
+
+                    store->apdata[ap_num].authmode = IOT_WIFI_AUTH_OPEN;  // Deafult to Open auth mode in case not specified
+
+                    _parsemac(lineptr+4, store->apdata[ap_num].bssid);    // Get Mac Addr and convert ASCII to 6-byte format
+                }
+            }
+
+            else {
+                lineptr = strstr(data,"\tfreq:");
+                if (lineptr)
+                                                                    // Found Wifi centre frequency (MHz; newer iw adds ".0")
+                    store->apdata[ap_num].freq = atoi(lineptr+7);
+
+                else {
+                    lineptr = strstr(data,"\tsignal:");
+                    if (lineptr)
+                                                                    // Found Wifi Signal Level (RSSI)
+                        store->apdata[ap_num].rssi = _getnumeric(6,lineptr+9);
+
+                    else {
+                        lineptr = strstr(data,"\tSSID:");
+                        if (lineptr) {
+                                                                                    // Found SSID
+                            i=0;                   // ****VVV 010722 Removed test for space char (for SSIDs with embedded spaces)
+                            while ((i < IOT_WIFI_MAX_SSID_LEN) && (*(lineptr+i+7) != '\n')) {
+                                tmpbuf[i] = *(lineptr + i + 7);
+                                i++;
+                            }
+                            tmpbuf[i] = 0;
+
+                            strcpy((char*)store->apdata[ap_num].ssid, tmpbuf);
+
+                        }
+                        else {
+                            lineptr = strstr(data,"\t\t * Pairwise ciphers:");          // This is the Auth mode line
+                            if (lineptr) {
+
+                                if (strstr(lineptr,"CCMP TKIP"))
+                                    store->apdata[ap_num].authmode = IOT_WIFI_AUTH_WPA_WPA2_PSK;
+
+                                else
+
+                                    if (strstr(lineptr,"TKIP CCMP"))
+                                        store->apdata[ap_num].authmode = IOT_WIFI_AUTH_WPA_WPA2_PSK;
+
+                                    else
+
+                                        if (strstr(lineptr,"CCMP"))
+                                            store->apdata[ap_num].authmode = IOT_WIFI_AUTH_WPA2_PSK;
+
+                                        else
+
+                                            if (strstr(lineptr,"TKIP"))
+                                                store->apdata[ap_num].authmode = IOT_WIFI_AUTH_WPA_PSK;
+
+                                            else
+
+                                                if (strstr(lineptr,"WEP"))
+                                                    store->apdata[ap_num].authmode = IOT_WIFI_AUTH_WEP;   //Need to test this
+
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        ferr = ferror(pf);
+        if (ferr) {
+            errnum = errno;
+            IOT_ERROR("[rpi] Error reading scan results; ferror=%d, errno=%d",ferr,errnum);
+        }
+        _pclosecmd(pf);
+
+    } else
+        IOT_ERROR("[rpi] Failed to issue iw scan command");
+
+    store->apcount = ap_num+1;
+
+    return (ap_num+1);
+}
+
+// This function parses presumed ASCII numeric digits; stops when max digits parsed or space or carriage return found
+int _getnumeric(int maxdigits, char *text) {
+
+    int index = 0;
+    char tmpbuf[10];
+
+    while ((index < maxdigits) && (*(text+index) != ' ') && (*(text+index) != '\n')) {
+        tmpbuf[index] = *(text+index);
+        index++;
+    }
+    tmpbuf[index] = 0;
+    return(atoi(tmpbuf));
+
+}
+
+/*******************************************************************************************
+    Required BSP fuction: iot_bsp_wifi_get_mac()
+
+    Purpose:    Discover and return this device's mac address
+
+    Input:      mac address structure (iot_mac)
+
+    Output:     return IOT_ERROR_ value (IOT_ERROR_NONE if no errors) + filled-in wifi_mac
+
+*******************************************************************************************/
+iot_error_t iot_bsp_wifi_get_mac(struct iot_mac *wifi_mac)  {
+
+    char txt[18];
+
+    IOT_INFO("[rpi] Mac address requested");
+
+    if (Ethernet)
+        memcpy(wifi_mac->addr,ethmacaddr,IOT_WIFI_MAX_BSSID_LEN);
+
+    else
+        memcpy(wifi_mac->addr,wifimacaddr,IOT_WIFI_MAX_BSSID_LEN);
+
+
+    sprintf(txt,"%x:%x:%x:%x:%x:%x", wifi_mac->addr[0], \
+                                            wifi_mac->addr[1], \
+                                            wifi_mac->addr[2], \
+                                            wifi_mac->addr[3], \
+                                            wifi_mac->addr[4], \
+                                            wifi_mac->addr[5]);
+    IOT_INFO("[rpi] Mac=%s",txt);
+
+    return IOT_ERROR_NONE;
+}
+
+/*******************************************************************************************
+    Required BSP fuction: iot_bsp_wifi_get_freq()
+
+    Purpose:    Determine wireless frequency in use by device
+
+    Input:      none
+
+    Output:     IOT_WIFI_FREQ_2_4G_ONLY, IOT_WIFI_FREQ_5G_ONLY or IOT_WIFI_FREQ_2_4G_5G_BOTH, from
+                the bands the radio (and its regulatory domain) has enabled; 2.4 GHz only if
+                nl80211 can't tell
+
+*******************************************************************************************/
+iot_wifi_freq_t iot_bsp_wifi_get_freq(void)
+{
+    uint32_t wiphy;
+    int bands = 0;
+    char *dev;
+
+    if (wifibands < 0) {
+
+        dev = (strcmp(wifi_sta_dev,"") != 0) ? wifi_sta_dev : wifi_ap_dev;
+        if (_wifiinfo(dev, &wiphy, NULL, NULL) < 0 || _wiphy_dump(wiphy, _bands_cb, &bands) < 0 || bands == 0)
+            return IOT_WIFI_FREQ_2_4G_ONLY;                 // not cached; init may not have found the device yet
+
+        wifibands = bands;                                  // radio capabilities don't change; ask once
+        IOT_INFO("[rpi] Wifi bands:%s%s", (bands & (1 << NL80211_BAND_2GHZ)) ? " 2.4GHz" : "",
+                    (bands & (1 << NL80211_BAND_5GHZ)) ? " 5GHz" : "");
+    }
+
+    if (!(wifibands & (1 << NL80211_BAND_5GHZ)))
+        return IOT_WIFI_FREQ_2_4G_ONLY;
+    if (!(wifibands & (1 << NL80211_BAND_2GHZ)))
+        return IOT_WIFI_FREQ_5G_ONLY;
+
+    return IOT_WIFI_FREQ_2_4G_5G_BOTH;
+}
+
+
+/*******************************************************************************************
+    Required BSP fuctions: iot_bsp_wifi_register_event_cb() / iot_bsp_wifi_clear_event_cb()
+
+    Purpose:    Register (or clear) the callback the event monitor uses to report SoftAP
+                client join / leave
+
+    Input:      callback function
+
+    Output:     IOT_ERROR_NONE
+
+*******************************************************************************************/
+iot_error_t iot_bsp_wifi_register_event_cb(iot_bsp_wifi_event_cb_t cb)
+{
+    wifi_event_cb = cb;
+    return IOT_ERROR_NONE;
+}
+
+void iot_bsp_wifi_clear_event_cb(void)
+{
+    wifi_event_cb = NULL;
+}
+
+/************************************************/
+
+void _parsemac(char *textptr, uint8_t *hexbuf) {
+
+    *(hexbuf+0) = _htoi(textptr + 0);
+    *(hexbuf+1) = _htoi(textptr + 3);
+    *(hexbuf+2) = _htoi(textptr + 6);
+    *(hexbuf+3) = _htoi(textptr + 9);
+    *(hexbuf+4) = _htoi(textptr + 12);
+    *(hexbuf+5) = _htoi(textptr + 15);
+
+    return;
+}
+
+unsigned int _htoi (const char *ptr) {
+
+    unsigned int value = 0;
+    char ch = *ptr;
+
+    while (ch == ' ' || ch == '\t')
+        ch = *(++ptr);
+
+    for (;;) {
+
+        if (ch >= '0' && ch <= '9')
+            value = (value << 4) + (ch - '0');
+        else if (ch >= 'A' && ch <= 'F')
+            value = (value << 4) + (ch - 'A' + 10);
+        else if (ch >= 'a' && ch <= 'f')
+            value = (value << 4) + (ch - 'a' + 10);
+        else
+            return value;
+
+        ch = *(++ptr);
+    }
+
+}
+
+
+/*******************************************************************************************
+    Mode-transition latency histograms
+
+    Log-linear (HDR-style) histograms of how long each phase of a mode switch takes; see
+    iot_bsp_wifi_rpi.h. Saved as text, one line per phase:
+        <phase> <count> <min> <max> <sum> <bucket>:<n> ...
+    after a "platform <model> / <kernel>" line that decides whether old data still applies.
+
+*******************************************************************************************/
+
+struct phasehist {
+    unsigned long count;
+    unsigned long min;
+    unsigned long max;
+    unsigned long long sum;
+    unsigned long buckets[PHASEHIST_BUCKETS];
+};
+
+static const char *phasenames[IOT_BSP_WIFI_PHASE_MAX] = {
+    "softap_stop", "dhcpcd_switch", "hostapd_conf", "softap_start", "softap_ready",
+    "switch_ssid", "wait_conn", "scan", "mode_off", "mode_scan", "mode_station", "mode_softap"
+};
+
+void _phase_end(struct phasetimer *timer) {
+
+    _phase_record(timer->phase, _monotonic_ms() - timer->start);
+}
+
+void _phase_record(iot_bsp_wifi_phase_t phase, unsigned long ms) {
+
+    struct phasehist *hist;
+
+    if (!phasehists || phase >= IOT_BSP_WIFI_PHASE_MAX)
+        return;
+
+    iot_os_mutex_lock(&histlock);
+    hist = &phasehists[phase];
+    if (hist->count == 0 || ms < hist->min)
+        hist->min = ms;
+    if (ms > hist->max)
+        hist->max = ms;
+    hist->count++;
+    hist->sum += ms;
+    hist->buckets[_phase_bucket(ms)]++;
+    iot_os_mutex_unlock(&histlock);
+}
+
+// Values below PHASEHIST_SUB map 1:1; above, each power of two splits into PHASEHIST_SUB buckets
+int _phase_bucket(unsigned long ms) {
+
+    int exp;
+    int bucket;
+
+    if (ms < PHASEHIST_SUB)
+        return ms;
+
+    exp = (int)(sizeof(unsigned long) * 8 - 1) - __builtin_clzl(ms);           // ms >= 2^exp, exp >= 3
+    bucket = PHASEHIST_SUB + (exp - 3) * PHASEHIST_SUB + (int)((ms >> (exp - 3)) & (PHASEHIST_SUB - 1));
+
+    return (bucket < PHASEHIST_BUCKETS) ? bucket : PHASEHIST_BUCKETS - 1;
+}
+
+// Highest value that lands in a bucket
+unsigned long _phase_bucketvalue(int bucket) {
+
+    int exp;
+
+    if (bucket < PHASEHIST_SUB)
+        return bucket;
+
+    exp = (bucket - PHASEHIST_SUB) / PHASEHIST_SUB + 3;
+    return ((unsigned long)(PHASEHIST_SUB + (bucket % PHASEHIST_SUB) + 1) << (exp - 3)) - 1;
+}
+
+unsigned long _phase_percentile(const struct phasehist *hist, unsigned int pct) {
+
+    unsigned long long target;
+    unsigned long long seen = 0;
+    int i;
+
+    if (hist->count == 0)
+        return 0;
+
+    target = ((unsigned long long)hist->count * pct + 99) / 100;
+
+    for (i = 0; i < PHASEHIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target)
+            return (_phase_bucketvalue(i) < hist->max) ? _phase_bucketvalue(i) : hist->max;
+    }
+
+    return hist->max;
+}
+
+// "<board model> / <kernel release>"; latencies from different hardware or OS don't mix
+void _platformid(char *buf, size_t len) {
+
+    struct utsname uts;
+    char model[80] = "unknown";
+    FILE *fp;
+    size_t n;
+
+    fp = fopen("/proc/device-tree/model","r");
+    if (fp) {
+        n = fread(model, 1, sizeof(model) - 1, fp);
+        model[n] = '\0';                                    // file is NUL-terminated already
+        fclose(fp);
+    }
+
+    if (uname(&uts) != 0)
+        strcpy(uts.release, "unknown");
+
+    snprintf(buf, len, "%s / %s", model, uts.release);
+}
+
+void _loadphasehist() {
+
+    FILE *fp;
+    char *readline = NULL;
+    size_t len = 0;
+    char platform[200];
+    char *field;
+    char *saveptr;
+    char prevname[sizeof(IOT_BSP_WIFI_LATENCY_FILE) + 5];
+    struct phasehist *hist;
+    unsigned long count;
+    int bucket;
+    int n;
+    int i;
+
+    phasehists = calloc(IOT_BSP_WIFI_PHASE_MAX, sizeof(struct phasehist));
+    if (!phasehists)
+        return;
+    iot_os_mutex_init(&histlock);
+
+    fp = fopen(IOT_BSP_WIFI_LATENCY_FILE,"r");
+    if (!fp)
+        return;
+
+    _platformid(platform, sizeof(platform));
+
+    if (getline(&readline,&len,fp) == EOF || strncmp(readline,"platform ",9) != 0 ||
+            strncmp(readline + 9, platform, strlen(platform)) != 0 || readline[9 + strlen(platform)] != '\n') {
+
+        IOT_INFO("[rpi] Platform changed; starting new latency histograms");
+        fclose(fp);
+        free(readline);
+        sprintf(prevname, "%s.prev", IOT_BSP_WIFI_LATENCY_FILE);
+        rename(IOT_BSP_WIFI_LATENCY_FILE, prevname);
+        return;
+    }
+
+    while (getline(&readline,&len,fp) != EOF) {
+
+        field = strtok_r(readline, " \n", &saveptr);
+        for (i = 0; field && i < IOT_BSP_WIFI_PHASE_MAX && strcmp(field, phasenames[i]) != 0; i++)
+            ;
+        if (!field || i == IOT_BSP_WIFI_PHASE_MAX)
+            continue;
+
+        hist = &phasehists[i];
+        if (sscanf(saveptr, "%lu %lu %lu %llu%n", &hist->count, &hist->min, &hist->max, &hist->sum, &n) != 4) {
+            memset(hist, 0, sizeof(struct phasehist));
+            continue;
+        }
+
+        for (field = strtok_r(saveptr + n, " \n", &saveptr); field; field = strtok_r(NULL, " \n", &saveptr)) {
+            if (sscanf(field, "%d:%lu", &bucket, &count) == 2 && bucket >= 0 && bucket < PHASEHIST_BUCKETS)
+                hist->buckets[bucket] = count;
+        }
+    }
+
+    fclose(fp);
+    free(readline);
+}
+
+// Written to a temp file and renamed so a crash mid-write can't lose the history
+void _savephasehist() {
+
+    FILE *fp;
+    char platform[200];
+    char tmpname[sizeof(IOT_BSP_WIFI_LATENCY_FILE) + 4];
+    struct phasehist *hist;
+    int i;
+    int j;
+
+    if (!phasehists)
+        return;
+
+    _platformid(platform, sizeof(platform));
+    sprintf(tmpname, "%s.tmp", IOT_BSP_WIFI_LATENCY_FILE);
+
+    fp = fopen(tmpname,"w");
+    if (!fp) {
+        IOT_WARN("[rpi] Cannot save latency histograms; error #%d", errno);
+        return;
+    }
+
+    fprintf(fp, "platform %s\n", platform);
+
+    iot_os_mutex_lock(&histlock);
+    for (i = 0; i < IOT_BSP_WIFI_PHASE_MAX; i++) {
+
+        hist = &phasehists[i];
+        if (hist->count == 0)
+            continue;
+
+        fprintf(fp, "%s %lu %lu %lu %llu", phasenames[i], hist->count, hist->min, hist->max, hist->sum);
+        for (j = 0; j < PHASEHIST_BUCKETS; j++) {
+            if (hist->buckets[j])
+                fprintf(fp, " %d:%lu", j, hist->buckets[j]);
+        }
+        fprintf(fp, "\n");
+    }
+    iot_os_mutex_unlock(&histlock);
+
+    if (fclose(fp) != 0 || rename(tmpname, IOT_BSP_WIFI_LATENCY_FILE) != 0) {
+        IOT_WARN("[rpi] Cannot save latency histograms; error #%d", errno);
+        unlink(tmpname);
+    }
+}
+
+int iot_bsp_wifi_get_phase_stats(iot_bsp_wifi_phase_t phase, iot_bsp_wifi_phase_stats_t *stats)
+{
+    struct phasehist *hist;
+
+    if (phase >= IOT_BSP_WIFI_PHASE_MAX || !stats)
+        return -1;
+
+    memset(stats, 0, sizeof(iot_bsp_wifi_phase_stats_t));
+    if (!phasehists)
+        return 0;
+
+    iot_os_mutex_lock(&histlock);
+    hist = &phasehists[phase];
+    if (hist->count) {
+        stats->count = hist->count;
+        stats->min_ms = hist->min;
+        stats->max_ms = hist->max;
+        stats->mean_ms = hist->sum / hist->count;
+        stats->p50_ms = _phase_percentile(hist, 50);
+        stats->p90_ms = _phase_percentile(hist, 90);
+        stats->p99_ms = _phase_percentile(hist, 99);
+    }
+    iot_os_mutex_unlock(&histlock);
+
+    return 0;
+}
+
+void iot_bsp_wifi_dump_phase_stats(FILE *fp)
+{
+    iot_bsp_wifi_phase_stats_t stats;
+    char platform[200];
+    int i;
+
+    _platformid(platform, sizeof(platform));
+    fprintf(fp, "# wifi mode-transition latency (ms) on %s\n", platform);
+    fprintf(fp, "%-14s %8s %8s %8s %8s %8s %8s %8s\n", "phase", "count", "min", "mean", "p50", "p90", "p99", "max");
+
+    for (i = 0; i < IOT_BSP_WIFI_PHASE_MAX; i++) {
+        iot_bsp_wifi_get_phase_stats(i, &stats);
+        if (stats.count)
+            fprintf(fp, "%-14s %8lu %8lu %8lu %8lu %8lu %8lu %8lu\n", phasenames[i], stats.count,
+                    stats.min_ms, stats.mean_ms, stats.p50_ms, stats.p90_ms, stats.p99_ms, stats.max_ms);
+    }
+}
+
+void iot_bsp_wifi_reset_phase_stats(void)
+{
+    if (phasehists) {
+        iot_os_mutex_lock(&histlock);
+        memset(phasehists, 0, IOT_BSP_WIFI_PHASE_MAX * sizeof(struct phasehist));
+        iot_os_mutex_unlock(&histlock);
+    }
+    unlink(IOT_BSP_WIFI_LATENCY_FILE);
+}
+
+/*******************************************************************************************
+    Control interface client
+
+    wpa_supplicant (and hostapd) accept text commands on a Unix datagram socket named
+    <dir>/<iface>; this is what wpa_cli talks to. We bind our own socket in /tmp so
+    replies and, once ATTACHed, unsolicited "<level>EVENT ..." messages come back to it.
+
+*******************************************************************************************/
+
+int _ctrl_open(struct ctrlsock *ctrl, const char *dir, const char *dev) {
+
+    static int counter = 0;
+    struct sockaddr_un dest;
+
+    ctrl->pending = 0;
+    ctrl->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (ctrl->fd < 0)
+        return -1;
+
+    memset(&ctrl->local, 0, sizeof(ctrl->local));
+    ctrl->local.sun_family = AF_UNIX;
+    snprintf(ctrl->local.sun_path, sizeof(ctrl->local.sun_path), "/tmp/stdk_ctrl_%d-%d", (int)getpid(), counter++);
+    unlink(ctrl->local.sun_path);
+
+    memset(&dest, 0, sizeof(dest));
+    dest.sun_family = AF_UNIX;
+    snprintf(dest.sun_path, sizeof(dest.sun_path), "%s/%s", dir, dev);
+
+    if (bind(ctrl->fd, (struct sockaddr *)&ctrl->local, sizeof(ctrl->local)) < 0 ||
+            connect(ctrl->fd, (struct sockaddr *)&dest, sizeof(dest)) < 0) {
+        IOT_DEBUG("[rpi] Cannot open control socket %s; error #%d", dest.sun_path, errno);
+        _ctrl_close(ctrl);
+        return -1;
+    }
+
+    return 0;
+}
+
+void _ctrl_close(struct ctrlsock *ctrl) {
+
+    if (ctrl->fd >= 0) {
+        close(ctrl->fd);
+        unlink(ctrl->local.sun_path);
+    }
+    ctrl->fd = -1;
+}
+
+// Send a command and return the reply length (reply NUL-terminated); events in between are held
+int _ctrl_request(struct ctrlsock *ctrl, const char *cmd, char *reply, size_t replylen) {
+
+    unsigned long long deadline;
+    long long left;
+    int len;
+
+    if (send(ctrl->fd, cmd, strlen(cmd), 0) < 0)
+        return -1;
+
+    deadline = _monotonic_ms() + CTRLREPLYTIMEOUT;
+
+    while ((left = (long long)(deadline - _monotonic_ms())) > 0 && _nlpoll(ctrl->fd, left) > 0) {
+
+        len = recv(ctrl->fd, reply, replylen - 1, 0);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        reply[len] = '\0';
+
+        if (len > 0 && reply[0] == '<') {           // unsolicited event while attached; keep for _ctrl_waitevent
+            if (ctrl->pending < CTRLHELDEVENTS)
+                snprintf(ctrl->held[ctrl->pending++], CTRLEVENTSIZE, "%s", reply);
+            continue;
+        }
+
+        return len;
+    }
+
+    IOT_ERROR("[rpi] No reply from control socket to %s", cmd);
+    return -1;
+}
+
+// Wait for one of a NULL-terminated list of events; returns its index, or -1 on timeout
+int _ctrl_waitevent(struct ctrlsock *ctrl, const char **events, int timeout_ms) {
+
+    char msg[CTRLREPLYSIZE];
+    unsigned long long deadline;
+    long long left;
+    int held;
+    int len;
+    int i;
+
+    for (held = 0; held < ctrl->pending; held++) {
+        for (i = 0; events[i]; i++) {
+            if (strstr(ctrl->held[held], events[i])) {
+                ctrl->pending = 0;
+                return i;
+            }
+        }
+    }
+    ctrl->pending = 0;
+
+    deadline = _monotonic_ms() + timeout_ms;
+
+    while ((left = (long long)(deadline - _monotonic_ms())) > 0 && _nlpoll(ctrl->fd, left) > 0) {
+
+        len = recv(ctrl->fd, msg, sizeof(msg) - 1, 0);
+        if (len <= 0)
+            continue;
+        msg[len] = '\0';
+
+        for (i = 0; events[i]; i++) {
+            if (strstr(msg, events[i]))
+                return i;
+        }
+    }
+
+    return -1;
+}
+
+/*******************************************************************************************
+    Netlink helpers
+
+    Minimal rtnetlink and generic netlink (nl80211) plumbing, used instead of running
+    iw / ip / cat through popen. Requests are built in a caller buffer of NLREQSIZE bytes;
+    replies are handed to a callback one message at a time.
+
+*******************************************************************************************/
+
+int _nlsocket(int protocol) {
+
+    struct sockaddr_nl addr;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, protocol);
+    if (fd < 0) {
+        IOT_ERROR("[rpi] Cannot open netlink socket; error #%d", errno);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        IOT_ERROR("[rpi] Cannot bind netlink socket; error #%d", errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Start a request; hdrlen bytes of family header follow the nlmsghdr (zeroed)
+struct nlmsghdr *_nlmsg_init(void *buf, uint16_t type, uint16_t flags, size_t hdrlen) {
+
+    static uint32_t nlseq = 0;
+    struct nlmsghdr *nlh = buf;
+
+    memset(buf, 0, NLMSG_SPACE(hdrlen));
+    nlh->nlmsg_len = NLMSG_LENGTH(hdrlen);
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+    if ((flags & NLM_F_DUMP) != NLM_F_DUMP)           // NLM_F_REPLACE/EXCL share these bits on new requests
+        nlh->nlmsg_flags |= NLM_F_ACK;                 // every request ends in an ack or NLMSG_DONE
+    nlh->nlmsg_seq = __atomic_add_fetch(&nlseq, 1, __ATOMIC_RELAXED);
+
+    return nlh;
+}
+
+struct nlmsghdr *_genlmsg_init(void *buf, uint16_t family, uint8_t cmd, uint16_t flags) {
+
+    struct nlmsghdr *nlh = _nlmsg_init(buf, family, flags, GENL_HDRLEN);
+    struct genlmsghdr *genl = NLMSG_DATA(nlh);
+
+    genl->cmd = cmd;
+    genl->version = 1;
+
+    return nlh;
+}
+
+// Append an attribute; data may be NULL for an empty or nested attribute
+struct nlattr *_nla_put(struct nlmsghdr *nlh, uint16_t type, const void *data, uint16_t len) {
+
+    struct nlattr *nla = (struct nlattr *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+
+    if (NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(NLA_HDRLEN + len) > NLREQSIZE) {
+        IOT_ERROR("[rpi] Netlink request too large");
+        return NULL;
+    }
+
+    nla->nla_type = type;
+    nla->nla_len = NLA_HDRLEN + len;
+    if (data && len)
+        memcpy(NLA_DATA(nla), data, len);
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+
+    return nla;
+}
+
+// Close a nested attribute opened with _nla_put(nlh, type | NLA_F_NESTED, NULL, 0)
+void _nla_nest_end(struct nlmsghdr *nlh, struct nlattr *nest) {
+
+    if (nest)
+        nest->nla_len = (char *)nlh + nlh->nlmsg_len - (char *)nest;
+}
+
+void _nla_parse(struct nlattr **tb, int max, struct nlattr *nla, int len) {
+
+    int type;
+
+    memset(tb, 0, sizeof(struct nlattr *) * (max + 1));
+
+    while (NLA_OK(nla, len)) {
+        type = nla->nla_type & NLA_TYPE_MASK;
+        if (type <= max)
+            tb[type] = nla;
+        nla = NLA_NEXT(nla, len);
+    }
+}
+
+// First attribute of a generic netlink message and the length of the attribute area
+struct nlattr *_genl_attrs(struct nlmsghdr *nlh, int *len) {
+
+    *len = (int)nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+    return (struct nlattr *)((char *)NLMSG_DATA(nlh) + GENL_HDRLEN);
+}
+
+// Wait up to timeout_ms for the socket to become readable
+int _nlpoll(int fd, int timeout_ms) {
+
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int ret;
+
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+// Send a request and feed each reply to cb until the ack / NLMSG_DONE; returns 0 or -errno
+int _nltalk(int fd, struct nlmsghdr *req, nlmsg_cb_t cb, void *arg) {
+
+    struct sockaddr_nl kernel;
+    struct nlmsghdr *nlh;
+    struct nlmsgerr *err;
+    char *buf;
+    int len;
+    int ret = -ETIMEDOUT;
+    bool done = false;
+
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+
+    if (sendto(fd, req, req->nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0)
+        return -errno;
+
+    buf = malloc(NLBUFSIZE);
+    if (!buf)
+        return -ENOMEM;
+
+    while (!done) {
+
+        if (_nlpoll(fd, NLREPLYTIMEOUT) <= 0) {
+            ret = -ETIMEDOUT;
+            break;
+        }
+
+        len = recv(fd, buf, NLBUFSIZE, 0);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = -errno;
+            break;
+        }
+
+        for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+
+            if (nlh->nlmsg_seq != req->nlmsg_seq)
+                continue;                               // stale reply to an earlier request
+
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                err = NLMSG_DATA(nlh);
+                ret = err->error;
+                done = true;
+                break;
+            }
+            if (nlh->nlmsg_type == NLMSG_DONE) {
+                ret = 0;
+                done = true;
+                break;
+            }
+            if (cb)
+                cb(nlh, arg);
+        }
+    }
+
+    free(buf);
+    return ret;
+}
+
+// Feed multicast messages to cb until it returns non-zero or timeout_ms passes (returns 0)
+int _nlwait(int fd, nlmsg_cb_t cb, void *arg, int timeout_ms) {
+
+    struct timespec start, now;
+    struct nlmsghdr *nlh;
+    char *buf;
+    int len;
+    int left;
+    int ret = 0;
+
+    buf = malloc(NLBUFSIZE);
+    if (!buf)
+        return -ENOMEM;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (ret == 0) {
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = timeout_ms - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+        if (left <= 0 || _nlpoll(fd, left) <= 0)
+            break;
+
+        len = recv(fd, buf, NLBUFSIZE, 0);
+        if (len < 0) {
+            if (errno == EINTR || errno == ENOBUFS)     // ENOBUFS: events were dropped, keep going
+                continue;
+            ret = -errno;
+            break;
+        }
+
+        for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len) && ret == 0; nlh = NLMSG_NEXT(nlh, len))
+            ret = cb(nlh, arg);
+    }
+
+    free(buf);
+    return ret;
+}
+
+struct genlfamily {
+    const char *group;
+    uint16_t id;
+    uint32_t groupid;
+};
+
+int _genl_family_cb(struct nlmsghdr *nlh, void *arg) {
+
+    struct genlfamily *family = arg;
+    struct nlattr *tb[CTRL_ATTR_MAX+1];
+    struct nlattr *grp[CTRL_ATTR_MCAST_GRP_MAX+1];
+    struct nlattr *nla;
+    int len;
+    int rem;
+
+    nla = _genl_attrs(nlh, &len);
+    _nla_parse(tb, CTRL_ATTR_MAX, nla, len);
+
+    if (tb[CTRL_ATTR_FAMILY_ID])
+        family->id = *(uint16_t *)NLA_DATA(tb[CTRL_ATTR_FAMILY_ID]);
+
+    if (family->group && tb[CTRL_ATTR_MCAST_GROUPS]) {
+        rem = NLA_PAYLOAD(tb[CTRL_ATTR_MCAST_GROUPS]);
+        for (nla = NLA_DATA(tb[CTRL_ATTR_MCAST_GROUPS]); NLA_OK(nla, rem); nla = NLA_NEXT(nla, rem)) {
+            _nla_parse(grp, CTRL_ATTR_MCAST_GRP_MAX, NLA_DATA(nla), NLA_PAYLOAD(nla));
+            if (grp[CTRL_ATTR_MCAST_GRP_NAME] && grp[CTRL_ATTR_MCAST_GRP_ID] &&
+                    strcmp(NLA_DATA(grp[CTRL_ATTR_MCAST_GRP_NAME]), family->group) == 0)
+                family->groupid = *(uint32_t *)NLA_DATA(grp[CTRL_ATTR_MCAST_GRP_ID]);
+        }
+    }
+
+    return 0;
+}
+
+// Look up a generic netlink family id and, optionally, one of its multicast group ids
+int _genl_resolve(int fd, const char *name, const char *group, uint16_t *familyid, uint32_t *groupid) {
+
+    uint32_t req[NLREQSIZE/4];
+    struct nlmsghdr *nlh;
+    struct genlfamily family = { group, 0, 0 };
+    int ret;
+
+    nlh = _genlmsg_init(req, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 0);
+    _nla_put(nlh, CTRL_ATTR_FAMILY_NAME, name, strlen(name) + 1);
+
+    ret = _nltalk(fd, nlh, _genl_family_cb, &family);
+    if (ret < 0 || family.id == 0 || (group && family.groupid == 0)) {
+        IOT_ERROR("[rpi] Generic netlink family %s%s%s not available; error #%d",
+                    name, group ? "/" : "", group ? group : "", -ret);
+        return (ret < 0) ? ret : -ENOENT;
+    }
+
+    *familyid = family.id;
+    if (groupid)
+        *groupid = family.groupid;
+
+    return 0;
+}
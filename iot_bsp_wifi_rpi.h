@@ -0,0 +1,93 @@
+/* ***************************************************************************
+ *
+ * Raspberry Pi Wifi BSP extensions
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ ****************************************************************************/
+
+#ifndef _IOT_BSP_WIFI_RPI_H_
+#define _IOT_BSP_WIFI_RPI_H_
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Mode-transition latency. Each phase below is timed (CLOCK_MONOTONIC, ms)
+ * into a log-linear histogram: values under 8 ms get their own bucket, above
+ * that every power of two is split in 8, so any value is within 12.5%.
+ * Histograms are saved to IOT_BSP_WIFI_LATENCY_FILE after every
+ * iot_bsp_wifi_set_mode() and reloaded at init, so they build up across
+ * runs. They are tagged with the board model and kernel release and start
+ * over (keeping the old file as .prev) when either changes.
+ */
+#define IOT_BSP_WIFI_LATENCY_FILE	"/var/tmp/stdk_wifi_latency"
+
+typedef enum {
+	IOT_BSP_WIFI_PHASE_SOFTAP_STOP,		/**< @brief softapstop script (hostapd/dnsmasq stop) */
+	IOT_BSP_WIFI_PHASE_DHCPCD_SWITCH,	/**< @brief dhcpcd config swap and restart */
+	IOT_BSP_WIFI_PHASE_HOSTAPD_CONF,	/**< @brief hostapd.conf rewrite */
+	IOT_BSP_WIFI_PHASE_SOFTAP_START,	/**< @brief softapstart script */
+	IOT_BSP_WIFI_PHASE_SOFTAP_READY,	/**< @brief softapstart done until hostapd has the AP enabled */
+	IOT_BSP_WIFI_PHASE_SWITCH_SSID,		/**< @brief SELECT_NETWORK until associated */
+	IOT_BSP_WIFI_PHASE_WAIT_CONN,		/**< @brief connected SSID confirmation */
+	IOT_BSP_WIFI_PHASE_SCAN,		/**< @brief one scan, foreground or background */
+	IOT_BSP_WIFI_PHASE_MODE_OFF,		/**< @brief whole iot_bsp_wifi_set_mode(OFF) */
+	IOT_BSP_WIFI_PHASE_MODE_SCAN,		/**< @brief whole iot_bsp_wifi_set_mode(SCAN) */
+	IOT_BSP_WIFI_PHASE_MODE_STATION,	/**< @brief whole iot_bsp_wifi_set_mode(STATION) */
+	IOT_BSP_WIFI_PHASE_MODE_SOFTAP,		/**< @brief whole iot_bsp_wifi_set_mode(SOFTAP) */
+	IOT_BSP_WIFI_PHASE_MAX
+} iot_bsp_wifi_phase_t;
+
+/**
+ * @brief	Summary of one phase's histogram
+ */
+typedef struct {
+	unsigned long count;		/**< @brief samples recorded */
+	unsigned long min_ms;		/**< @brief fastest */
+	unsigned long max_ms;		/**< @brief slowest */
+	unsigned long mean_ms;		/**< @brief average */
+	unsigned long p50_ms;		/**< @brief median, to bucket precision */
+	unsigned long p90_ms;		/**< @brief 90th percentile, to bucket precision */
+	unsigned long p99_ms;		/**< @brief 99th percentile, to bucket precision */
+} iot_bsp_wifi_phase_stats_t;
+
+/**
+ * @brief	Get the latency summary of one phase
+ *
+ * @param[in] phase	phase to report
+ * @param[out] stats	filled with the summary (all zero if never recorded)
+ * @return	0 on success, -1 for an unknown phase
+ */
+int iot_bsp_wifi_get_phase_stats(iot_bsp_wifi_phase_t phase, iot_bsp_wifi_phase_stats_t *stats);
+
+/**
+ * @brief	Write a table of every phase's latency summary
+ *
+ * @param[in] fp	output stream
+ */
+void iot_bsp_wifi_dump_phase_stats(FILE *fp);
+
+/**
+ * @brief	Clear all histograms, in memory and on disk
+ */
+void iot_bsp_wifi_reset_phase_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _IOT_BSP_WIFI_RPI_H_ */
@@ -16,6 +16,11 @@
  *
  ****************************************************************************/
 
+/* pthread_setname_np() for pool workers, pthread_getname_np() for trace rings */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -26,9 +31,21 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <setjmp.h>
+#include <semaphore.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "iot_debug.h"
 #include "iot_error.h"
 #include "iot_os_util.h"
+#include "iot_os_util_posix.h"
 #include "iot_bsp_random.h"
 
 const unsigned int iot_os_max_delay = 0xFFFFFFFF;
@@ -51,39 +68,472 @@ const char* iot_os_get_os_version_string()
 #endif
 }
 
+/* Clock and futex helpers */
+
+static unsigned long long _monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int _futex_wait(unsigned int *uaddr, unsigned int val, const struct timespec *deadline)
+{
+	int oldtype;
+	int ret;
+
+	/*
+	 * FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline.
+	 * syscall() is not a cancellation point, so make the sleep one the
+	 * same way libc does for its own blocking calls.
+	 */
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &oldtype);
+	ret = syscall(SYS_futex, uaddr, FUTEX_WAIT_BITSET_PRIVATE, val, deadline,
+			NULL, FUTEX_BITSET_MATCH_ANY);
+	pthread_setcanceltype(oldtype, NULL);
+
+	return ret;
+}
+
+static void _futex_wake(unsigned int *uaddr, int count)
+{
+	syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/*
+ * Convert an iot_os wait time into an absolute CLOCK_MONOTONIC deadline.
+ * Returns 0 for "don't block", 1 with *deadline filled, or 2 for "forever".
+ */
+static int _os_deadline(unsigned int wait_time_ms, struct timespec *deadline)
+{
+	if (wait_time_ms == 0)
+		return 0;
+	if (wait_time_ms == iot_os_max_delay)
+		return 2;
+
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += wait_time_ms / 1000;
+	deadline->tv_nsec += (wait_time_ms % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+	return 1;
+}
+
+/*
+ * Counting semaphore on a futex word. The waiter count lets post skip
+ * the FUTEX_WAKE syscall when nobody is sleeping.
+ */
+typedef struct {
+	unsigned int count;
+	unsigned int waiters;
+} futex_sem_t;
+
+static inline void _fsem_init(futex_sem_t *sem, unsigned int count)
+{
+	__atomic_store_n(&sem->count, count, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&sem->waiters, 0, __ATOMIC_SEQ_CST);
+}
+
+/* Re-initialise the count only; sleepers stay counted so later posts still wake them */
+static inline void _fsem_set(futex_sem_t *sem, unsigned int count)
+{
+	__atomic_store_n(&sem->count, count, __ATOMIC_SEQ_CST);
+}
+
+static inline int _fsem_trywait(futex_sem_t *sem)
+{
+	unsigned int val = __atomic_load_n(&sem->count, __ATOMIC_ACQUIRE);
+
+	while (val > 0) {
+		if (__atomic_compare_exchange_n(&sem->count, &val, val - 1, true,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 0;
+	}
+	return -1;
+}
+
+static inline int _fsem_wait(futex_sem_t *sem, unsigned int wait_time_ms)
+{
+	struct timespec deadline;
+	int mode = _os_deadline(wait_time_ms, &deadline);
+
+	for (;;) {
+		if (_fsem_trywait(sem) == 0)
+			return 0;
+		if (mode == 0)
+			return -1;
+
+		__atomic_fetch_add(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+		int ret = _futex_wait(&sem->count, 0, (mode == 1) ? &deadline : NULL);
+		int err = errno;
+		__atomic_fetch_sub(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+
+		if (ret == -1 && err == ETIMEDOUT)
+			return _fsem_trywait(sem);
+	}
+}
+
+static inline void _fsem_post(futex_sem_t *sem)
+{
+	__atomic_fetch_add(&sem->count, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST) > 0)
+		_futex_wake(&sem->count, 1);
+}
+
 /* Thread */
-int iot_os_thread_create(void * thread_function, const char* name, int stack_size,
-		void* data, int priority, iot_os_thread* thread_handle)
+
+/*
+ * SDK tasks are dispatched onto a pool of pre-spawned workers. A handle
+ * is a reference counted task record, separate from the worker, so it
+ * stays valid for join after the worker has moved on to another task.
+ * Workers only accept cancellation while running a task; once a task
+ * returns, a pending cancel makes the worker exit instead of taking new
+ * work, so a late pthread_cancel can never hit the next task.
+ */
+#ifndef CONFIG_STDK_IOT_CORE_OS_POSIX_THREAD_POOL_SIZE
+#define CONFIG_STDK_IOT_CORE_OS_POSIX_THREAD_POOL_SIZE 4
+#endif
+#define THREAD_POOL_SIZE CONFIG_STDK_IOT_CORE_OS_POSIX_THREAD_POOL_SIZE
+#define THREAD_STOP_GRACE_MS 200
+
+typedef struct os_worker os_worker_t;
+
+typedef struct os_thread {
+	void *(*function)(void *);
+	void *data;
+	char name[16];
+	unsigned int done;
+	unsigned int stop;
+	unsigned int stop_polled;	/* body has called iot_os_thread_should_stop() */
+	unsigned int refs;
+	int cancel_requested;
+	os_worker_t *worker;
+	struct os_thread *next_live;
+} os_thread_t;
+
+struct os_worker {
+	unsigned int assigned;
+	os_thread_t *task;
+	pthread_t pthread;
+	jmp_buf exit_jmp;
+	os_worker_t *next_idle;
+};
+
+static pthread_mutex_t thread_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t thread_pool_once = PTHREAD_ONCE_INIT;
+static os_worker_t *thread_idle_list;
+static int thread_idle_count;
+static os_thread_t *thread_live_list;		/* every task record with refs > 0 */
+static __thread os_worker_t *thread_current_worker;
+
+/* Caller holds thread_pool_mutex; NULL if handle isn't a live task record */
+static os_thread_t *_thread_lookup(iot_os_thread thread_handle)
+{
+	os_thread_t *task;
+
+	for (task = thread_live_list; task != NULL; task = task->next_live) {
+		if ((iot_os_thread)task == thread_handle)
+			return task;
+	}
+	return NULL;
+}
+
+static os_thread_t *_thread_get(iot_os_thread thread_handle)
+{
+	os_thread_t *task;
+
+	pthread_mutex_lock(&thread_pool_mutex);
+	task = _thread_lookup(thread_handle);
+	pthread_mutex_unlock(&thread_pool_mutex);
+
+	return task;
+}
+
+/* Must not be called with thread_pool_mutex held */
+static void _thread_release(os_thread_t *task)
+{
+	os_thread_t **link;
+
+	if (__atomic_sub_fetch(&task->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	pthread_mutex_lock(&thread_pool_mutex);
+	for (link = &thread_live_list; *link != NULL; link = &(*link)->next_live) {
+		if (*link == task) {
+			*link = task->next_live;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&thread_pool_mutex);
+	free(task);
+}
+
+static void _thread_mark_done(os_thread_t *task)
+{
+	__atomic_store_n(&task->done, 1, __ATOMIC_SEQ_CST);
+	_futex_wake(&task->done, INT_MAX);
+}
+
+static void _thread_cancelled(void *arg)
+{
+	os_worker_t *worker = arg;
+	os_thread_t *task = worker->task;
+
+	_thread_mark_done(task);
+	_thread_release(task);
+	free(worker);
+}
+
+/* Returns false if the worker should exit rather than wait for work */
+static bool _thread_park(os_worker_t *worker)
+{
+	pthread_mutex_lock(&thread_pool_mutex);
+	if (thread_idle_count >= THREAD_POOL_SIZE) {
+		pthread_mutex_unlock(&thread_pool_mutex);
+		return false;
+	}
+	worker->task = NULL;
+	__atomic_store_n(&worker->assigned, 0, __ATOMIC_SEQ_CST);
+	worker->next_idle = thread_idle_list;
+	thread_idle_list = worker;
+	thread_idle_count++;
+	pthread_mutex_unlock(&thread_pool_mutex);
+
+	while (__atomic_load_n(&worker->assigned, __ATOMIC_SEQ_CST) == 0)
+		_futex_wait(&worker->assigned, 0, NULL);
+
+	return true;
+}
+
+static void *_thread_worker(void *arg)
+{
+	os_worker_t *worker = arg;
+	os_thread_t *volatile task;
+	bool cancelled;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	thread_current_worker = worker;
+
+	if (worker->task == NULL && !_thread_park(worker)) {
+		free(worker);
+		return NULL;
+	}
+
+	for (;;) {
+		task = worker->task;
+		pthread_setname_np(pthread_self(), task->name);
+		IOT_OS_TRACE_INSTANT("task_start", task->name);
+
+		pthread_cleanup_push(_thread_cancelled, worker);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		if (setjmp(worker->exit_jmp) == 0)
+			task->function(task->data);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		pthread_cleanup_pop(0);
+
+		pthread_mutex_lock(&thread_pool_mutex);
+		cancelled = task->cancel_requested;
+		_thread_mark_done(task);
+		pthread_mutex_unlock(&thread_pool_mutex);
+		_thread_release(task);
+
+		if (cancelled || !_thread_park(worker))
+			break;
+	}
+
+	free(worker);
+	return NULL;
+}
+
+static os_worker_t *_thread_spawn_worker(os_thread_t *task)
 {
-	pthread_t* thread = malloc(sizeof(pthread_t));
+	os_worker_t *worker = calloc(1, sizeof(os_worker_t));
 	pthread_attr_t attr;
+	int ret;
 
-	if (thread == NULL)
-		return IOT_ERROR_MEM_ALLOC;
+	if (worker == NULL)
+		return NULL;
+
+	worker->task = task;
+	if (task)
+		task->worker = worker;
 
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&worker->pthread, &attr, _thread_worker, worker);
+	pthread_attr_destroy(&attr);
+
+	if (ret != 0) {
+		IOT_ERROR("pthread_create failed (%d)", ret);
+		free(worker);
+		return NULL;
+	}
 
-	pthread_create(thread, &attr, thread_function, data);
+	return worker;
+}
 
-	pthread_attr_destroy(&attr);
+static void _thread_pool_init(void)
+{
+	for (int i = 0; i < THREAD_POOL_SIZE; i++)
+		_thread_spawn_worker(NULL);
+}
+
+int iot_os_thread_create(void * thread_function, const char* name, int stack_size,
+		void* data, int priority, iot_os_thread* thread_handle)
+{
+	os_thread_t *task = calloc(1, sizeof(os_thread_t));
+	os_worker_t *worker;
+
+	if (task == NULL)
+		return IOT_ERROR_MEM_ALLOC;
+
+	pthread_once(&thread_pool_once, _thread_pool_init);
+
+	task->function = thread_function;
+	task->data = data;
+	snprintf(task->name, sizeof(task->name), "%s", name ? name : "iot_task");
+	/* One reference for the worker, one for the caller's handle */
+	task->refs = (thread_handle != NULL) ? 2 : 1;
+
+	pthread_mutex_lock(&thread_pool_mutex);
+	task->next_live = thread_live_list;
+	thread_live_list = task;
+	worker = thread_idle_list;
+	if (worker != NULL) {
+		thread_idle_list = worker->next_idle;
+		thread_idle_count--;
+		worker->task = task;
+		task->worker = worker;
+	}
+	pthread_mutex_unlock(&thread_pool_mutex);
+
+	if (worker != NULL) {
+		__atomic_store_n(&worker->assigned, 1, __ATOMIC_SEQ_CST);
+		_futex_wake(&worker->assigned, 1);
+	} else if (_thread_spawn_worker(task) == NULL) {
+		task->refs = 1;
+		_thread_release(task);
+		return IOT_OS_FALSE;
+	}
 
 	if (thread_handle != NULL) {
-		*thread_handle = (iot_os_thread*)thread;
+		*thread_handle = (iot_os_thread)task;
+	}
+
+	return IOT_OS_TRUE;
+}
+
+int iot_os_thread_stop(iot_os_thread thread_handle)
+{
+	os_thread_t *task = _thread_get(thread_handle);
+
+	if (task == NULL)
+		return IOT_OS_FALSE;
+
+	__atomic_store_n(&task->stop, 1, __ATOMIC_SEQ_CST);
+	return IOT_OS_TRUE;
+}
+
+int iot_os_thread_should_stop(void)
+{
+	os_worker_t *worker = thread_current_worker;
+
+	if (worker == NULL || worker->task == NULL)
+		return false;
+
+	if (!__atomic_load_n(&worker->task->stop_polled, __ATOMIC_RELAXED))
+		__atomic_store_n(&worker->task->stop_polled, 1, __ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(&worker->task->stop, __ATOMIC_SEQ_CST);
+}
+
+static int _thread_wait_done(os_thread_t *task, unsigned int wait_time_ms)
+{
+	struct timespec deadline;
+	int mode = _os_deadline(wait_time_ms, &deadline);
+
+	while (__atomic_load_n(&task->done, __ATOMIC_SEQ_CST) == 0) {
+		if (mode == 0)
+			return IOT_OS_FALSE;
+		if (_futex_wait(&task->done, 0, (mode == 1) ? &deadline : NULL) == -1 &&
+				errno == ETIMEDOUT)
+			return __atomic_load_n(&task->done, __ATOMIC_SEQ_CST) ? IOT_OS_TRUE : IOT_OS_FALSE;
 	}
 
 	return IOT_OS_TRUE;
 }
 
+int iot_os_thread_join(iot_os_thread thread_handle, unsigned int wait_time_ms)
+{
+	os_thread_t *task = _thread_get(thread_handle);
+
+	if (task == NULL)
+		return IOT_OS_FALSE;
+
+	if (!_thread_wait_done(task, wait_time_ms))
+		return IOT_OS_FALSE;
+
+	_thread_release(task);
+	return IOT_OS_TRUE;
+}
+
+/* Delete the calling thread, first dropping the reference held by the handle it was deleted through */
+static void __attribute__((noreturn)) _thread_exit(os_thread_t *handle_ref)
+{
+	os_worker_t *self = thread_current_worker;
+
+	if (handle_ref != NULL)
+		_thread_release(handle_ref);		/* the worker's own reference keeps it alive */
+
+	if (self != NULL && self->task != NULL) {
+		/* Unwind straight back to the worker loop */
+		longjmp(self->exit_jmp, 1);
+	}
+	pthread_exit(NULL);
+}
+
 void iot_os_thread_delete(iot_os_thread thread_handle)
 {
-	if (thread_handle != NULL) {
-		pthread_t* thread = (pthread_t*)thread_handle;
-		pthread_cancel(*thread);
-		free(thread);
-	} else {
-		pthread_cancel(pthread_self());
+	os_worker_t *self = thread_current_worker;
+	os_thread_t *task;
+	unsigned int polled;
+
+	if (thread_handle == NULL)
+		_thread_exit(NULL);
+
+	task = _thread_get(thread_handle);
+	if (task == NULL) {
+		/* get_current_handle of a thread outside the pool */
+		if (thread_handle == (iot_os_thread)pthread_self())
+			_thread_exit(NULL);
+		IOT_WARN("iot_os_thread_delete: %p is not a task handle", thread_handle);
+		return;
+	}
+
+	if (self != NULL && self->task == task)
+		_thread_exit(task);
+
+	/*
+	 * Ask politely first, then fall back to cancellation. Bodies that never
+	 * poll iot_os_thread_should_stop() (all of the SDK's) are cancelled at once.
+	 */
+	iot_os_thread_stop(task);
+	polled = __atomic_load_n(&task->stop_polled, __ATOMIC_SEQ_CST);
+	if (!polled || !_thread_wait_done(task, THREAD_STOP_GRACE_MS)) {
+		pthread_mutex_lock(&thread_pool_mutex);
+		if (!__atomic_load_n(&task->done, __ATOMIC_SEQ_CST)) {
+			if (polled)
+				IOT_WARN("task %s did not stop, cancelling", task->name);
+			task->cancel_requested = true;
+			pthread_cancel(task->worker->pthread);
+		}
+		pthread_mutex_unlock(&thread_pool_mutex);
 	}
+
+	_thread_release(task);
 }
 
 void iot_os_thread_yield()
@@ -91,24 +541,65 @@ void iot_os_thread_yield()
 	sched_yield();
 }
 
+/*
+ * A task gets a handle of its own, with its own reference, released by
+ * iot_os_thread_delete/join like one from iot_os_thread_create. Threads
+ * outside the pool get their pthread_t, which only self-delete accepts.
+ */
 int iot_os_thread_get_current_handle(iot_os_thread* thread_handle)
 {
+    os_thread_t *task;
+
     if (thread_handle == NULL) {
         return IOT_OS_FALSE;
     }
 
-    *thread_handle = (iot_os_thread)pthread_self();
+    if (thread_current_worker != NULL && thread_current_worker->task != NULL) {
+        task = thread_current_worker->task;
+        __atomic_add_fetch(&task->refs, 1, __ATOMIC_ACQ_REL);
+        *thread_handle = (iot_os_thread)task;
+    } else
+        *thread_handle = (iot_os_thread)pthread_self();
     return IOT_OS_TRUE;
 }
 
+/*
+ * Reactor hook: objects registered with an iot_os_reactor carry an
+ * eventfd that is poked on state changes. Unregistered objects keep -1
+ * here and pay only an atomic load.
+ */
+static inline void _notify_fd_signal(int *notify_fd)
+{
+	int fd = __atomic_load_n(notify_fd, __ATOMIC_ACQUIRE);
+
+	if (fd >= 0) {
+		uint64_t one = 1;
+		ssize_t ret = write(fd, &one, sizeof(one));
+		(void)ret;
+	}
+}
+
+/* Deleting an object that is still attached detaches it first */
+static inline void _notify_release(iot_os_reactor **reactor, void *source)
+{
+	iot_os_reactor *owner = __atomic_load_n(reactor, __ATOMIC_ACQUIRE);
+
+	if (owner != NULL)
+		iot_os_reactor_remove(owner, source);
+}
+
 /* Queue */
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_QUEUE_MQUEUE)
 typedef struct {
 	char name[20];
 	int length;
 	int msg_size;
 	mqd_t mqd;
+	iot_os_reactor *reactor;
 } iot_os_queue_posix_t;
 
+static int _reactor_refd(iot_os_reactor *reactor_handle, void *source, int fd);
+
 iot_os_queue* iot_os_queue_create(int queue_length, int item_size)
 {
 	iot_os_queue_posix_t* queue = malloc(sizeof(iot_os_queue_posix_t));
@@ -125,6 +616,7 @@ iot_os_queue* iot_os_queue_create(int queue_length, int item_size)
 	snprintf(queue->name, sizeof(queue->name), "/q%u", iot_bsp_random());
 	queue->length = queue_length;
 	queue->msg_size = item_size;
+	queue->reactor = NULL;
 
 	queue->mqd = mq_open(queue->name, O_CREAT | O_RDWR, 0644, &attr);
 	if (queue->mqd == -1) {
@@ -154,6 +646,10 @@ int iot_os_queue_reset(iot_os_queue* queue_handle)
 		return IOT_OS_FALSE;
 	}
 
+	/* Closing the old descriptor dropped it from the reactor's epoll set */
+	if (queue->reactor != NULL)
+		return _reactor_refd(queue->reactor, queue, queue->mqd);
+
 	return IOT_OS_TRUE;
 }
 
@@ -161,21 +657,34 @@ void iot_os_queue_delete(iot_os_queue* queue_handle)
 {
 	iot_os_queue_posix_t* queue = (iot_os_queue_posix_t*)queue_handle;
 
+	_notify_release(&queue->reactor, queue);
 	mq_close(queue->mqd);
 	mq_unlink(queue->name);
 	free(queue);
 }
 
+/* mq_timed* want an absolute CLOCK_REALTIME deadline, not a relative wait */
+static void _mq_deadline(unsigned int wait_time_ms, struct timespec *ts)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += wait_time_ms / 1000;
+	ts->tv_nsec += (wait_time_ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
 int iot_os_queue_send(iot_os_queue* queue_handle, void * data, unsigned int wait_time_ms)
 {
 	iot_os_queue_posix_t* queue = (iot_os_queue_posix_t*)queue_handle;
 	struct timespec ts = {0,};
+	IOT_OS_TRACE_SCOPE("queue_send", NULL);
 
 	if (!queue || !data)
 	    return IOT_OS_FALSE;
 
-	ts.tv_sec = wait_time_ms / 1000;
-	ts.tv_nsec = (wait_time_ms % 1000) * 1000000;
+	_mq_deadline(wait_time_ms, &ts);
 
 	int ret = mq_timedsend(queue->mqd, data, queue->msg_size, 0, &ts);
 	if (ret == -1) {
@@ -189,9 +698,9 @@ int iot_os_queue_receive(iot_os_queue* queue_handle, void * data, unsigned int w
 {
 	iot_os_queue_posix_t* queue = (iot_os_queue_posix_t*)queue_handle;
 	struct timespec ts = {0,};
+	IOT_OS_TRACE_SCOPE("queue_receive", NULL);
 
-	ts.tv_sec = wait_time_ms / 1000;
-	ts.tv_nsec = (wait_time_ms % 1000) * 1000000;
+	_mq_deadline(wait_time_ms, &ts);
 
 	int ret = mq_timedreceive(queue->mqd, data, queue->msg_size, NULL, &ts);
 	if (ret == -1) {
@@ -200,325 +709,2092 @@ int iot_os_queue_receive(iot_os_queue* queue_handle, void * data, unsigned int w
 
 	return IOT_OS_TRUE;
 }
-
-/* Event Group */
-
-#define EVENT_MAX 8
-
+#else
+/*
+ * Bounded MPMC ring. The space/items semaphores bound occupancy to
+ * queue_length, so a ticket from head/tail always owns its slot once the
+ * previous lap's peer has published the slot sequence number.
+ */
 typedef struct {
-	unsigned char id;
-	int fd[2];
-} event_t;
+	unsigned int seq;
+	unsigned char data[];
+} queue_slot_t;
 
 typedef struct {
-	event_t group[EVENT_MAX];
-	unsigned char event_status;
-	pthread_mutex_t mutex;
-} eventgroup_t;
-
-iot_os_eventgroup* iot_os_eventgroup_create(void)
-{
-	eventgroup_t *eventgroup = malloc(sizeof(eventgroup_t));
-	if (eventgroup == NULL)
-		return NULL;
-
-	if (pthread_mutex_init(&eventgroup->mutex, NULL)) {
-		free(eventgroup);
-		return NULL;
-	}
+	int length;
+	int msg_size;
+	unsigned int mask;
+	size_t stride;
+	futex_sem_t space;
+	futex_sem_t items;
+	unsigned int head;
+	unsigned int tail;
+	unsigned char *slots;
+	int notify_fd;
+	iot_os_reactor *reactor;
+} iot_os_queue_posix_t;
 
-	for (int i = 0; i < EVENT_MAX; i++) {
-		eventgroup->group[i].id = (1 << i);
-		int ret = pipe(eventgroup->group[i].fd);
-		if (ret == -1) {
-			free(eventgroup);
-			return NULL;
-		}
-	}
+#define QUEUE_SLOT(q, pos) ((queue_slot_t *)((q)->slots + ((pos) & (q)->mask) * (q)->stride))
 
-	eventgroup->event_status = 0;
+static void _queue_init_slots(iot_os_queue_posix_t *queue)
+{
+	for (unsigned int i = 0; i <= queue->mask; i++)
+		__atomic_store_n(&QUEUE_SLOT(queue, i)->seq, i, __ATOMIC_RELAXED);
 
-	return eventgroup;
+	__atomic_store_n(&queue->head, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&queue->tail, 0, __ATOMIC_RELAXED);
+	_fsem_set(&queue->items, 0);
+	_fsem_set(&queue->space, queue->length);
 }
 
-void iot_os_eventgroup_delete(iot_os_eventgroup* eventgroup_handle)
+static void _queue_slot_wait(queue_slot_t *slot, unsigned int seq)
 {
-	eventgroup_t* eventgroup = eventgroup_handle;
-
-	for (int i = 0; i < EVENT_MAX; i++) {
-		close(eventgroup->group[i].fd[0]);
-		close(eventgroup->group[i].fd[1]);
-	}
-	pthread_mutex_destroy(&eventgroup->mutex);
-	free(eventgroup);
+	/* Only spins while a peer from the previous lap is mid-copy */
+	while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq)
+		sched_yield();
 }
 
-unsigned char iot_os_eventgroup_wait_bits(iot_os_eventgroup* eventgroup_handle,
-		const unsigned char bits_to_wait_for, const int clear_on_exit, const unsigned int wait_time_ms)
+iot_os_queue* iot_os_queue_create(int queue_length, int item_size)
 {
-	eventgroup_t *eventgroup = eventgroup_handle;
-	fd_set readfds;
-	int fd_max = 0;
-	unsigned char event_status_backup;
-
-	FD_ZERO(&readfds);
+	iot_os_queue_posix_t* queue;
+	unsigned int slots = 1;
 
-	for (int i = 0; i < EVENT_MAX; i++) {
-		if (eventgroup->group[i].id == (eventgroup->group[i].id & bits_to_wait_for)) {
-			FD_SET(eventgroup->group[i].fd[0], &readfds);
-			if (eventgroup->group[i].fd[0] >= fd_max) {
-				fd_max = eventgroup->group[i].fd[0];
-			}
-		}
-	}
+	if (queue_length <= 0 || item_size <= 0)
+		return NULL;
 
-	char buf[3] = {0,};
-	struct timeval tv;
-	memset(&tv, 0x00, sizeof(tv));
-	unsigned char bits = 0x00;
-	ssize_t read_size = 0;
+	while (slots < (unsigned int)queue_length)
+		slots <<= 1;
 
-	tv.tv_sec = wait_time_ms / 1000;
-	tv.tv_usec = (wait_time_ms % 1000) * 1000;
+	queue = malloc(sizeof(iot_os_queue_posix_t));
+	if (queue == NULL)
+		return NULL;
 
-	int ret = select(fd_max + 1, &readfds, NULL, NULL, &tv);
-	pthread_mutex_lock(&eventgroup->mutex);
-	if (ret == -1) {
-		// Select Error
-		pthread_mutex_unlock(&eventgroup->mutex);
-		return 0;
-	} else if (ret == 0) {
-		// Select Timeout
-		pthread_mutex_unlock(&eventgroup->mutex);
-		return (unsigned int)eventgroup->event_status;
-	} else {
-		// read pipe
-		for (int i = 0; i < EVENT_MAX; i++) {
-			if (eventgroup->group[i].id == (eventgroup->group[i].id & bits_to_wait_for)) {
-				if (FD_ISSET(eventgroup->group[i].fd[0], &readfds)) {
-					memset(buf, 0, sizeof(buf));
-					read_size = read(eventgroup->group[i].fd[0], buf, sizeof(buf));
-					IOT_DEBUG("read_size = %d (%d)", read_size, i);
-					bits |= eventgroup->group[i].id;
-				}
-			}
-		}
+	queue->length = queue_length;
+	queue->msg_size = item_size;
+	queue->mask = slots - 1;
+	queue->notify_fd = -1;
+	queue->reactor = NULL;
+	queue->stride = (sizeof(queue_slot_t) + item_size + 7) & ~(size_t)7;
+	queue->slots = malloc(queue->stride * slots);
+	if (queue->slots == NULL) {
+		free(queue);
+		return NULL;
+	}
 
-		event_status_backup = eventgroup->event_status;
-		if (clear_on_exit) {
-			eventgroup->event_status &= ~(bits);
-		}
-		pthread_mutex_unlock(&eventgroup->mutex);
+	_fsem_init(&queue->items, 0);
+	_fsem_init(&queue->space, queue->length);
+	_queue_init_slots(queue);
 
-		return (unsigned int)event_status_backup;
-	}
+	return (void*)queue;
 }
 
-int iot_os_eventgroup_set_bits(iot_os_eventgroup* eventgroup_handle,
-		const unsigned char bits_to_set)
+int iot_os_queue_reset(iot_os_queue* queue_handle)
 {
-	eventgroup_t *eventgroup = eventgroup_handle;
-	unsigned char bits = 0;
-	ssize_t write_size = 0;
-
-	pthread_mutex_lock(&eventgroup->mutex);
-	for (int i = 0; i < EVENT_MAX; i++) {
-        if (eventgroup->group[i].id == (eventgroup->group[i].id & eventgroup->event_status)) {
-            IOT_DEBUG("already set 0x%08x (%d)", eventgroup->group[i].id, i);
-            continue;
-        }
-		if (eventgroup->group[i].id == (eventgroup->group[i].id & bits_to_set)) {
-			write_size = write(eventgroup->group[i].fd[1], "Set", strlen("Set"));
-			IOT_DEBUG("write_size = %d (%d)", write_size, i);
-			bits |= eventgroup->group[i].id;
-		}
-	}
+	iot_os_queue_posix_t* queue = (iot_os_queue_posix_t*)queue_handle;
+
+	if (!queue)
+		return IOT_OS_FALSE;
 
-	eventgroup->event_status |= bits;
-	pthread_mutex_unlock(&eventgroup->mutex);
+	_queue_init_slots(queue);
+	/* Every sleeper re-checks against the emptied queue */
+	_futex_wake(&queue->space.count, INT_MAX);
+	_futex_wake(&queue->items.count, INT_MAX);
 
 	return IOT_OS_TRUE;
 }
 
-int iot_os_eventgroup_clear_bits(iot_os_eventgroup* eventgroup_handle,
-		const unsigned char bits_to_clear)
+void iot_os_queue_delete(iot_os_queue* queue_handle)
 {
-	eventgroup_t *eventgroup = eventgroup_handle;
+	iot_os_queue_posix_t* queue = (iot_os_queue_posix_t*)queue_handle;
 
-	pthread_mutex_lock(&eventgroup->mutex);
-	eventgroup->event_status &= ~(bits_to_clear);
-	// TODO: clear written event to pipe
-	pthread_mutex_unlock(&eventgroup->mutex);
+	if (!queue)
+		return;
 
-	return IOT_OS_TRUE;
+	_notify_release(&queue->reactor, queue);
+	free(queue->slots);
+	free(queue);
 }
 
-/* Mutex */
-
-int iot_os_mutex_init(iot_os_mutex* mutex)
+int iot_os_queue_send(iot_os_queue* queue_handle, void * data, unsigned int wait_time_ms)
 {
-	if (!mutex) {
-		return IOT_OS_FALSE;
-	}
+	iot_os_queue_posix_t* queue = (iot_os_queue_posix_t*)queue_handle;
+	queue_slot_t *slot;
+	unsigned int pos;
+	IOT_OS_TRACE_SCOPE("queue_send", NULL);
 
-	pthread_mutex_t* mutex_p = malloc(sizeof(pthread_mutex_t));
-	if (!mutex_p) {
-		return IOT_OS_FALSE;
-	} else {
-		pthread_mutex_init(mutex_p, NULL);
-		mutex->sem = mutex_p;
-	}
-	return IOT_OS_TRUE;
-}
+	if (!queue || !data)
+	    return IOT_OS_FALSE;
 
-int iot_os_mutex_lock(iot_os_mutex* mutex)
-{
-	if (!mutex || !mutex->sem) {
+	if (_fsem_wait(&queue->space, wait_time_ms) != 0)
 		return IOT_OS_FALSE;
-	}
 
-	pthread_mutex_t* mutex_p = mutex->sem;
+	pos = __atomic_fetch_add(&queue->tail, 1, __ATOMIC_RELAXED);
+	slot = QUEUE_SLOT(queue, pos);
+	_queue_slot_wait(slot, pos);
+	memcpy(slot->data, data, queue->msg_size);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
 
-	pthread_mutex_lock(mutex_p);
+	_fsem_post(&queue->items);
+	_notify_fd_signal(&queue->notify_fd);
 
 	return IOT_OS_TRUE;
 }
 
-int iot_os_mutex_unlock(iot_os_mutex* mutex)
+int iot_os_queue_receive(iot_os_queue* queue_handle, void * data, unsigned int wait_time_ms)
 {
-	if (!mutex || !mutex->sem) {
-		return IOT_OS_FALSE;
-	}
+	iot_os_queue_posix_t* queue = (iot_os_queue_posix_t*)queue_handle;
+	queue_slot_t *slot;
+	unsigned int pos;
+	IOT_OS_TRACE_SCOPE("queue_receive", NULL);
+
+	if (!queue || !data)
+	    return IOT_OS_FALSE;
+
+	if (_fsem_wait(&queue->items, wait_time_ms) != 0)
+		return IOT_OS_FALSE;
+
+	pos = __atomic_fetch_add(&queue->head, 1, __ATOMIC_RELAXED);
+	slot = QUEUE_SLOT(queue, pos);
+	_queue_slot_wait(slot, pos + 1);
+	memcpy(data, slot->data, queue->msg_size);
+	__atomic_store_n(&slot->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+
+	_fsem_post(&queue->space);
+
+	return IOT_OS_TRUE;
+}
+#endif /* CONFIG_STDK_IOT_CORE_OS_POSIX_QUEUE_MQUEUE */
+
+/*
+ * Zero-copy mode: a queue that carries buffer pointers, fed from a fixed
+ * pool. The pool free list is a Treiber stack over buffer indices; the
+ * head word packs a 16-bit index with a 16-bit tag so a pop racing with
+ * pop/push of the same buffer cannot succeed on a stale next link.
+ */
+#define BUFPOOL_EMPTY 0xFFFFu
+#define BUFPOOL_MAX 0xFFFE
+
+typedef struct bufpool bufpool_t;
+
+typedef union {
+	struct {
+		bufpool_t *pool;
+		unsigned int index;
+	} h;
+	long long align_ll;
+	long double align_ld;
+} bufpool_hdr_t;
+
+struct bufpool {
+	unsigned int head;
+	futex_sem_t avail;
+	int count;
+	size_t buf_size;
+	size_t stride;
+	unsigned int *next;
+	unsigned char *bufs;
+};
+
+#define BUFPOOL_HDR(p, idx) ((bufpool_hdr_t *)((p)->bufs + (size_t)(idx) * (p)->stride))
+
+static void _bufpool_push(bufpool_t *pool, unsigned int index)
+{
+	unsigned int head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+	unsigned int new_head;
+
+	do {
+		__atomic_store_n(&pool->next[index], head & 0xFFFFu, __ATOMIC_RELAXED);
+		new_head = (((head >> 16) + 1) << 16) | index;
+	} while (!__atomic_compare_exchange_n(&pool->head, &head, new_head, true,
+			__ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+static unsigned int _bufpool_pop(bufpool_t *pool)
+{
+	unsigned int head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+	unsigned int new_head;
+	unsigned int index;
+
+	do {
+		index = head & 0xFFFFu;
+		if (index == BUFPOOL_EMPTY)
+			return BUFPOOL_EMPTY;
+		new_head = (((head >> 16) + 1) << 16) |
+				__atomic_load_n(&pool->next[index], __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&pool->head, &head, new_head, true,
+			__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+	return index;
+}
+
+iot_os_bufpool* iot_os_bufpool_create(int buf_count, size_t buf_size)
+{
+	bufpool_t *pool;
+
+	if (buf_count <= 0 || buf_count > BUFPOOL_MAX || buf_size == 0)
+		return NULL;
+
+	pool = calloc(1, sizeof(bufpool_t));
+	if (pool == NULL)
+		return NULL;
+
+	pool->count = buf_count;
+	pool->buf_size = buf_size;
+	/* Round to the header's alignment, not its size (12 bytes but 4-aligned on i386) */
+	pool->stride = (sizeof(bufpool_hdr_t) + buf_size + __alignof__(bufpool_hdr_t) - 1) /
+			__alignof__(bufpool_hdr_t) * __alignof__(bufpool_hdr_t);
+	pool->next = malloc(sizeof(unsigned int) * buf_count);
+	pool->bufs = malloc(pool->stride * buf_count);
+	if (pool->next == NULL || pool->bufs == NULL) {
+		free(pool->next);
+		free(pool->bufs);
+		free(pool);
+		return NULL;
+	}
+
+	pool->head = BUFPOOL_EMPTY;
+	for (int i = buf_count - 1; i >= 0; i--) {
+		BUFPOOL_HDR(pool, i)->h.pool = pool;
+		BUFPOOL_HDR(pool, i)->h.index = i;
+		_bufpool_push(pool, i);
+	}
+	_fsem_init(&pool->avail, buf_count);
+
+	return (iot_os_bufpool *)pool;
+}
+
+void iot_os_bufpool_delete(iot_os_bufpool* pool_handle)
+{
+	bufpool_t *pool = (bufpool_t *)pool_handle;
+
+	if (pool == NULL)
+		return;
+
+	free(pool->next);
+	free(pool->bufs);
+	free(pool);
+}
+
+void* iot_os_bufpool_get(iot_os_bufpool* pool_handle, unsigned int wait_time_ms)
+{
+	bufpool_t *pool = (bufpool_t *)pool_handle;
+	unsigned int index;
+
+	if (pool == NULL)
+		return NULL;
+
+	if (_fsem_wait(&pool->avail, wait_time_ms) != 0)
+		return NULL;
+
+	/* The semaphore guarantees a buffer has been pushed for us */
+	while ((index = _bufpool_pop(pool)) == BUFPOOL_EMPTY)
+		sched_yield();
+
+	return BUFPOOL_HDR(pool, index) + 1;
+}
+
+void iot_os_bufpool_put(void* buf)
+{
+	bufpool_hdr_t *hdr;
+
+	if (buf == NULL)
+		return;
+
+	hdr = (bufpool_hdr_t *)buf - 1;
+	_bufpool_push(hdr->h.pool, hdr->h.index);
+	_fsem_post(&hdr->h.pool->avail);
+}
+
+size_t iot_os_bufpool_buf_size(void* buf)
+{
+	if (buf == NULL)
+		return 0;
+
+	return ((bufpool_hdr_t *)buf - 1)->h.pool->buf_size;
+}
+
+iot_os_queue* iot_os_queue_create_buf(int queue_length)
+{
+	return iot_os_queue_create(queue_length, sizeof(void *));
+}
+
+int iot_os_queue_send_buf(iot_os_queue* queue_handle, void* buf, unsigned int wait_time_ms)
+{
+	if (buf == NULL)
+		return IOT_OS_FALSE;
+
+	return iot_os_queue_send(queue_handle, &buf, wait_time_ms);
+}
+
+int iot_os_queue_receive_buf(iot_os_queue* queue_handle, void** buf, unsigned int wait_time_ms)
+{
+	return iot_os_queue_receive(queue_handle, buf, wait_time_ms);
+}
+
+/* Event Group */
+
+/*
+ * One futex word per group: set_bits bumps seq and broadcasts to every
+ * sleeper, which then re-evaluates its own wait condition against bits.
+ */
+typedef struct {
+	unsigned int bits;
+	unsigned int seq;
+	unsigned int waiters;
+	int notify_fd;
+	unsigned int notify_bits;
+	iot_os_reactor *reactor;
+} eventgroup_t;
+
+iot_os_eventgroup* iot_os_eventgroup_create(void)
+{
+	eventgroup_t *eventgroup = malloc(sizeof(eventgroup_t));
+	if (eventgroup == NULL)
+		return NULL;
+
+	eventgroup->bits = 0;
+	eventgroup->seq = 0;
+	eventgroup->waiters = 0;
+	eventgroup->notify_fd = -1;
+	eventgroup->notify_bits = 0;
+	eventgroup->reactor = NULL;
+
+	return eventgroup;
+}
+
+void iot_os_eventgroup_delete(iot_os_eventgroup* eventgroup_handle)
+{
+	eventgroup_t *eventgroup = eventgroup_handle;
+
+	if (eventgroup == NULL)
+		return;
+
+	_notify_release(&eventgroup->reactor, eventgroup);
+	free(eventgroup);
+}
+
+unsigned int iot_os_eventgroup_wait_bits_ex(iot_os_eventgroup* eventgroup_handle,
+		const unsigned int bits_to_wait_for, const int clear_on_exit,
+		const int wait_for_all, const unsigned int wait_time_ms)
+{
+	eventgroup_t *eventgroup = eventgroup_handle;
+	struct timespec deadline;
+	int mode = _os_deadline(wait_time_ms, &deadline);
+	unsigned int seq;
+	unsigned int bits;
+	IOT_OS_TRACE_SCOPE("eventgroup_wait", NULL);
+
+	if (eventgroup == NULL)
+		return 0;
+
+	for (;;) {
+		seq = __atomic_load_n(&eventgroup->seq, __ATOMIC_SEQ_CST);
+		bits = __atomic_load_n(&eventgroup->bits, __ATOMIC_SEQ_CST);
+
+		while (wait_for_all ? ((bits & bits_to_wait_for) == bits_to_wait_for)
+				: (bits & bits_to_wait_for)) {
+			if (!clear_on_exit)
+				return bits;
+			if (__atomic_compare_exchange_n(&eventgroup->bits, &bits,
+					bits & ~bits_to_wait_for, false,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+				return bits;
+		}
+
+		if (mode == 0)
+			return bits;
+
+		__atomic_fetch_add(&eventgroup->waiters, 1, __ATOMIC_SEQ_CST);
+		int ret = _futex_wait(&eventgroup->seq, seq, (mode == 1) ? &deadline : NULL);
+		int err = errno;
+		__atomic_fetch_sub(&eventgroup->waiters, 1, __ATOMIC_SEQ_CST);
+
+		if (ret == -1 && err == ETIMEDOUT) {
+			// Timeout: report current status like the caller expects
+			return __atomic_load_n(&eventgroup->bits, __ATOMIC_SEQ_CST);
+		}
+	}
+}
+
+int iot_os_eventgroup_set_bits_ex(iot_os_eventgroup* eventgroup_handle,
+		const unsigned int bits_to_set)
+{
+	eventgroup_t *eventgroup = eventgroup_handle;
+
+	if (eventgroup == NULL)
+		return IOT_OS_FALSE;
+
+	IOT_OS_TRACE_INSTANT("eventgroup_set", NULL);
+	__atomic_fetch_or(&eventgroup->bits, bits_to_set, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&eventgroup->seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&eventgroup->waiters, __ATOMIC_SEQ_CST) > 0)
+		_futex_wake(&eventgroup->seq, INT_MAX);
+	if (bits_to_set & __atomic_load_n(&eventgroup->notify_bits, __ATOMIC_ACQUIRE))
+		_notify_fd_signal(&eventgroup->notify_fd);
+
+	return IOT_OS_TRUE;
+}
+
+int iot_os_eventgroup_clear_bits_ex(iot_os_eventgroup* eventgroup_handle,
+		const unsigned int bits_to_clear)
+{
+	eventgroup_t *eventgroup = eventgroup_handle;
+
+	if (eventgroup == NULL)
+		return IOT_OS_FALSE;
+
+	__atomic_fetch_and(&eventgroup->bits, ~bits_to_clear, __ATOMIC_SEQ_CST);
+
+	return IOT_OS_TRUE;
+}
+
+unsigned char iot_os_eventgroup_wait_bits(iot_os_eventgroup* eventgroup_handle,
+		const unsigned char bits_to_wait_for, const int clear_on_exit, const unsigned int wait_time_ms)
+{
+	return (unsigned char)iot_os_eventgroup_wait_bits_ex(eventgroup_handle,
+			bits_to_wait_for, clear_on_exit, false, wait_time_ms);
+}
+
+int iot_os_eventgroup_set_bits(iot_os_eventgroup* eventgroup_handle,
+		const unsigned char bits_to_set)
+{
+	return iot_os_eventgroup_set_bits_ex(eventgroup_handle, bits_to_set);
+}
+
+int iot_os_eventgroup_clear_bits(iot_os_eventgroup* eventgroup_handle,
+		const unsigned char bits_to_clear)
+{
+	return iot_os_eventgroup_clear_bits_ex(eventgroup_handle, bits_to_clear);
+}
+
+/* Mutex */
+
+/*
+ * STDK_IOT_CORE_OS_POSIX_MUTEX_PRIO_INHERIT and _MUTEX_ADAPTIVE pick the
+ * pthread mutex protocol/type. With _MUTEX_PROFILE every mutex records
+ * how long lockers waited and how long it was held, in log2 microsecond
+ * histograms, and is kept on a registry for iot_os_mutex_dump_stats().
+ */
+#define MUTEX_HIST_BUCKETS 24
+
+typedef struct os_mutex {
+	pthread_mutex_t mutex;
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MUTEX_PROFILE)
+	void *owner_site;
+	unsigned long long acquired_ns;
+	unsigned long locks;
+	unsigned long contended;
+	unsigned long long wait_total_ns;
+	unsigned long long hold_total_ns;
+	unsigned long wait_hist[MUTEX_HIST_BUCKETS];
+	unsigned long hold_hist[MUTEX_HIST_BUCKETS];
+	struct os_mutex *next;
+	struct os_mutex *prev;
+#endif
+} os_mutex_t;
+
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MUTEX_PROFILE)
+static pthread_mutex_t mutex_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static os_mutex_t *mutex_registry;
+
+static unsigned int _mutex_bucket(unsigned long long ns)
+{
+	unsigned long long us = ns / 1000;
+	unsigned int bucket = 0;
+
+	while (us > 0 && bucket < MUTEX_HIST_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+static void _mutex_dump_hist(FILE *fp, const char *label, const unsigned long *hist)
+{
+	fprintf(fp, "[os]   %s:", label);
+	for (int i = 0; i < MUTEX_HIST_BUCKETS; i++) {
+		if (hist[i])
+			fprintf(fp, " <%luus=%lu", 1UL << i, hist[i]);
+	}
+	fprintf(fp, "\n");
+}
+
+void iot_os_mutex_dump_stats(FILE *fp)
+{
+	pthread_mutex_lock(&mutex_registry_lock);
+	for (os_mutex_t *m = mutex_registry; m != NULL; m = m->next) {
+		if (m->locks == 0)
+			continue;
+		fprintf(fp, "[os] mutex %p (created at %p) locks=%lu contended=%lu wait=%lluus hold=%lluus\n",
+				(void *)m, m->owner_site, m->locks, m->contended,
+				m->wait_total_ns / 1000, m->hold_total_ns / 1000);
+		_mutex_dump_hist(fp, "wait", m->wait_hist);
+		_mutex_dump_hist(fp, "hold", m->hold_hist);
+	}
+	pthread_mutex_unlock(&mutex_registry_lock);
+	fflush(fp);
+}
+#endif
+
+int iot_os_mutex_init(iot_os_mutex* mutex)
+{
+	pthread_mutexattr_t attr;
+
+	if (!mutex) {
+		return IOT_OS_FALSE;
+	}
+
+	os_mutex_t* mutex_p = calloc(1, sizeof(os_mutex_t));
+	if (!mutex_p) {
+		return IOT_OS_FALSE;
+	}
+
+	pthread_mutexattr_init(&attr);
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MUTEX_PRIO_INHERIT)
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+#endif
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MUTEX_ADAPTIVE) && defined(PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP)
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+#endif
+	if (pthread_mutex_init(&mutex_p->mutex, &attr) != 0) {
+		pthread_mutexattr_destroy(&attr);
+		free(mutex_p);
+		return IOT_OS_FALSE;
+	}
+	pthread_mutexattr_destroy(&attr);
+
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MUTEX_PROFILE)
+	mutex_p->owner_site = __builtin_return_address(0);
+	pthread_mutex_lock(&mutex_registry_lock);
+	mutex_p->next = mutex_registry;
+	if (mutex_registry)
+		mutex_registry->prev = mutex_p;
+	mutex_registry = mutex_p;
+	pthread_mutex_unlock(&mutex_registry_lock);
+#endif
+
+	mutex->sem = mutex_p;
+	return IOT_OS_TRUE;
+}
+
+int iot_os_mutex_lock(iot_os_mutex* mutex)
+{
+	if (!mutex || !mutex->sem) {
+		return IOT_OS_FALSE;
+	}
+
+	os_mutex_t* mutex_p = mutex->sem;
+
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MUTEX_PROFILE)
+	unsigned long long wait_ns = 0;
+
+	if (pthread_mutex_trylock(&mutex_p->mutex) != 0) {
+		unsigned long long start = _monotonic_ns();
+		pthread_mutex_lock(&mutex_p->mutex);
+		mutex_p->acquired_ns = _monotonic_ns();
+		wait_ns = mutex_p->acquired_ns - start;
+		mutex_p->contended++;
+	} else {
+		mutex_p->acquired_ns = _monotonic_ns();
+	}
+	mutex_p->locks++;
+	mutex_p->wait_total_ns += wait_ns;
+	mutex_p->wait_hist[_mutex_bucket(wait_ns)]++;
+#else
+	pthread_mutex_lock(&mutex_p->mutex);
+#endif
+
+	return IOT_OS_TRUE;
+}
+
+int iot_os_mutex_unlock(iot_os_mutex* mutex)
+{
+	if (!mutex || !mutex->sem) {
+		return IOT_OS_FALSE;
+	}
+
+	os_mutex_t* mutex_p = mutex->sem;
+
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MUTEX_PROFILE)
+	unsigned long long hold_ns = _monotonic_ns() - mutex_p->acquired_ns;
+
+	mutex_p->hold_total_ns += hold_ns;
+	mutex_p->hold_hist[_mutex_bucket(hold_ns)]++;
+#endif
+	pthread_mutex_unlock(&mutex_p->mutex);
+
+	return IOT_OS_TRUE;
+}
+
+void iot_os_mutex_destroy(iot_os_mutex* mutex)
+{
+	if (!mutex || !mutex->sem) {
+		return;
+	}
+	os_mutex_t* mutex_p = mutex->sem;
+
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MUTEX_PROFILE)
+	pthread_mutex_lock(&mutex_registry_lock);
+	if (mutex_p->prev)
+		mutex_p->prev->next = mutex_p->next;
+	else
+		mutex_registry = mutex_p->next;
+	if (mutex_p->next)
+		mutex_p->next->prev = mutex_p->prev;
+	pthread_mutex_unlock(&mutex_registry_lock);
+#endif
+
+	pthread_mutex_destroy(&mutex_p->mutex);
+	free(mutex_p);
+	mutex->sem = NULL;
+}
+
+/* Delay */
+void iot_os_delay(unsigned int delay_ms)
+{
+	struct timespec ts = {0,};
+
+	ts.tv_sec = delay_ms / 1000;
+	ts.tv_nsec = (delay_ms % 1000) * 1000000;
+
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * Periodic release on absolute CLOCK_MONOTONIC times. The next release
+ * is always derived from the previous one, never from "now", so sleep
+ * latency does not accumulate into drift. A late caller skips the
+ * releases it missed to keep the original phase.
+ */
+static void _timespec_add_ns(struct timespec *ts, unsigned long long ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static long long _timespec_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (long long)(a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec);
+}
+
+int iot_os_periodic_init(iot_os_periodic *periodic, unsigned int period_ms)
+{
+	if (periodic == NULL || period_ms == 0)
+		return IOT_OS_FALSE;
+
+	memset(periodic, 0, sizeof(*periodic));
+	periodic->period_ms = period_ms;
+	clock_gettime(CLOCK_MONOTONIC, &periodic->next);
+	_timespec_add_ns(&periodic->next, (unsigned long long)period_ms * 1000000ULL);
+
+	return IOT_OS_TRUE;
+}
+
+unsigned int iot_os_periodic_wait(iot_os_periodic *periodic)
+{
+	unsigned long long period_ns;
+	struct timespec now;
+	unsigned int missed = 0;
+	long long late_ns;
+
+	if (periodic == NULL || periodic->period_ms == 0)
+		return 0;
+
+	period_ns = (unsigned long long)periodic->period_ms * 1000000ULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	late_ns = _timespec_diff_ns(&now, &periodic->next);
+	if (late_ns > 0) {
+		/* The caller's work overran the release; skip the missed ones */
+		missed = (unsigned int)(late_ns / period_ns) + 1;
+		periodic->overruns += missed;
+		_timespec_add_ns(&periodic->next, missed * period_ns);
+	}
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &periodic->next, NULL) == EINTR)
+		;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	late_ns = _timespec_diff_ns(&now, &periodic->next);
+	periodic->last_slip_us = (late_ns > 0) ? (unsigned int)(late_ns / 1000) : 0;
+	if (periodic->last_slip_us > periodic->max_slip_us)
+		periodic->max_slip_us = periodic->last_slip_us;
+	periodic->cycles++;
+
+	_timespec_add_ns(&periodic->next, period_ns);
+
+	return missed;
+}
+
+/* Timer */
+
+/*
+ * SDK timers are polled deadlines with no expiry callback, so a timer is
+ * just an absolute CLOCK_MONOTONIC deadline. clock_gettime() on that
+ * clock is served from the vDSO, keeping isexpired/left_ms syscall free
+ * and immune to wall clock steps. Timer objects come from a pool that
+ * grows in chunks and is never returned to the heap.
+ */
+#define TIMER_POOL_CHUNK 32
+
+typedef struct os_timer {
+	unsigned long long deadline_ns;
+	int notify_fd;
+	iot_os_reactor *reactor;
+	struct os_timer *next_free;
+} os_timer_t;
+
+static os_timer_t *timer_free_list;
+static pthread_mutex_t timer_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static os_timer_t *_timer_pool_get(void)
+{
+	os_timer_t *timer;
+
+	pthread_mutex_lock(&timer_pool_mutex);
+	if (timer_free_list == NULL) {
+		os_timer_t *chunk = malloc(sizeof(os_timer_t) * TIMER_POOL_CHUNK);
+		if (chunk == NULL) {
+			pthread_mutex_unlock(&timer_pool_mutex);
+			return NULL;
+		}
+		for (int i = 0; i < TIMER_POOL_CHUNK; i++) {
+			chunk[i].next_free = timer_free_list;
+			timer_free_list = &chunk[i];
+		}
+	}
+	timer = timer_free_list;
+	timer_free_list = timer->next_free;
+	pthread_mutex_unlock(&timer_pool_mutex);
+
+	return timer;
+}
+
+/* Mirror the deadline into the timer's timerfd when it is on a reactor */
+static void _timer_notify_arm(os_timer_t *timer)
+{
+	int fd = __atomic_load_n(&timer->notify_fd, __ATOMIC_ACQUIRE);
+	struct itimerspec it;
+
+	if (fd < 0)
+		return;
+
+	memset(&it, 0, sizeof(it));
+	if (timer->deadline_ns != 0) {
+		it.it_value.tv_sec = timer->deadline_ns / 1000000000ULL;
+		it.it_value.tv_nsec = timer->deadline_ns % 1000000000ULL;
+	}
+	timerfd_settime(fd, TFD_TIMER_ABSTIME, &it, NULL);
+}
+
+static void _timer_pool_put(os_timer_t *timer)
+{
+	pthread_mutex_lock(&timer_pool_mutex);
+	timer->next_free = timer_free_list;
+	timer_free_list = timer;
+	pthread_mutex_unlock(&timer_pool_mutex);
+}
+
+void iot_os_timer_count_ms(iot_os_timer timer, unsigned int timeout_ms)
+{
+	os_timer_t *os_timer = (os_timer_t *)timer;
+
+	if (os_timer == NULL)
+		return;
+
+	os_timer->deadline_ns = _monotonic_ns() + (unsigned long long)timeout_ms * 1000000ULL;
+	_timer_notify_arm(os_timer);
+}
+
+unsigned int iot_os_timer_left_ms(iot_os_timer timer)
+{
+	os_timer_t *os_timer = (os_timer_t *)timer;
+	unsigned long long now;
+
+	if (os_timer == NULL)
+		return 0;
+
+	now = _monotonic_ns();
+	if (now >= os_timer->deadline_ns)
+		return 0;
+
+	return (unsigned int)((os_timer->deadline_ns - now) / 1000000ULL);
+}
+
+char iot_os_timer_isexpired(iot_os_timer timer)
+{
+	os_timer_t *os_timer = (os_timer_t *)timer;
+
+	if (os_timer == NULL)
+		return IOT_OS_TRUE;
+
+	if (_monotonic_ns() >= os_timer->deadline_ns) {
+		return IOT_OS_TRUE;
+	} else {
+		return IOT_OS_FALSE;
+	}
+}
+
+int iot_os_timer_init(iot_os_timer *timer)
+{
+	os_timer_t *os_timer = _timer_pool_get();
+
+	if (os_timer == NULL)
+		return IOT_ERROR_MEM_ALLOC;
+
+	os_timer->deadline_ns = 0;
+	os_timer->notify_fd = -1;
+	os_timer->reactor = NULL;
+	*timer = os_timer;
+
+	return IOT_ERROR_NONE;
+}
+
+void iot_os_timer_destroy(iot_os_timer *timer)
+{
+	if (timer == NULL || *timer == NULL)
+		return;
+
+	_notify_release(&((os_timer_t *)*timer)->reactor, *timer);
+	_timer_pool_put((os_timer_t *)*timer);
+	*timer = NULL;
+}
+
+/* Reactor */
+
+/*
+ * One epoll set that event groups, queues and timers can be attached to,
+ * so a single thread can sleep on all of them. Callbacks run on the
+ * thread calling iot_os_reactor_run/run_once and are expected to drain
+ * their source without blocking (wait time 0).
+ */
+#define REACTOR_MAX_EVENTS 16
+
+enum {
+	REACTOR_SRC_EVENTGROUP,
+	REACTOR_SRC_QUEUE,
+	REACTOR_SRC_TIMER,
+};
+
+typedef struct reactor_src {
+	int type;
+	void *source;
+	int fd;
+	bool owns_fd;
+	bool dead;			/* removed; run_once may still hold it in events[] */
+	iot_os_reactor_cb cb;
+	void *user_data;
+	struct reactor_src *next;
+} reactor_src_t;
+
+/*
+ * Removed sources go on the retired list and are freed (and their fd
+ * closed) only when no run_once is between epoll_wait and the end of its
+ * dispatch loop, so a callback may remove or delete a sibling source.
+ */
+typedef struct {
+	int epfd;
+	int stop_fd;
+	bool stop;
+	pthread_mutex_t lock;
+	reactor_src_t *sources;
+	reactor_src_t *retired;
+	unsigned int running;
+} reactor_t;
+
+iot_os_reactor* iot_os_reactor_create(void)
+{
+	reactor_t *reactor = calloc(1, sizeof(reactor_t));
+	struct epoll_event ev = {0,};
+
+	if (reactor == NULL)
+		return NULL;
+
+	reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+	reactor->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (reactor->epfd < 0 || reactor->stop_fd < 0)
+		goto fail;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->stop_fd, &ev) < 0)
+		goto fail;
+
+	pthread_mutex_init(&reactor->lock, NULL);
+	return reactor;
+
+fail:
+	if (reactor->epfd >= 0)
+		close(reactor->epfd);
+	if (reactor->stop_fd >= 0)
+		close(reactor->stop_fd);
+	free(reactor);
+	return NULL;
+}
+
+/* Unhook the source from its object; caller has unlinked it and holds reactor->lock */
+static void _reactor_detach(reactor_t *reactor, reactor_src_t *src)
+{
+	__atomic_store_n(&src->dead, true, __ATOMIC_RELEASE);
+	src->next = reactor->retired;
+	reactor->retired = src;
+
+	switch (src->type) {
+	case REACTOR_SRC_EVENTGROUP:
+		__atomic_store_n(&((eventgroup_t *)src->source)->notify_bits, 0, __ATOMIC_RELEASE);
+		__atomic_store_n(&((eventgroup_t *)src->source)->notify_fd, -1, __ATOMIC_RELEASE);
+		__atomic_store_n(&((eventgroup_t *)src->source)->reactor, NULL, __ATOMIC_RELEASE);
+		break;
+	case REACTOR_SRC_QUEUE:
+#if !defined(CONFIG_STDK_IOT_CORE_OS_POSIX_QUEUE_MQUEUE)
+		__atomic_store_n(&((iot_os_queue_posix_t *)src->source)->notify_fd, -1, __ATOMIC_RELEASE);
+#endif
+		__atomic_store_n(&((iot_os_queue_posix_t *)src->source)->reactor, NULL, __ATOMIC_RELEASE);
+		break;
+	case REACTOR_SRC_TIMER:
+		__atomic_store_n(&((os_timer_t *)src->source)->notify_fd, -1, __ATOMIC_RELEASE);
+		__atomic_store_n(&((os_timer_t *)src->source)->reactor, NULL, __ATOMIC_RELEASE);
+		break;
+	}
+}
+
+static void _reactor_free(reactor_src_t *src)
+{
+	while (src != NULL) {
+		reactor_src_t *next = src->next;
+
+		if (src->owns_fd)
+			close(src->fd);
+		free(src);
+		src = next;
+	}
+}
+
+/* Take the retired list if no dispatch loop can still reference it; caller holds reactor->lock */
+static reactor_src_t *_reactor_reap(reactor_t *reactor)
+{
+	reactor_src_t *retired = NULL;
+
+	if (reactor->running == 0) {
+		retired = reactor->retired;
+		reactor->retired = NULL;
+	}
+	return retired;
+}
+
+void iot_os_reactor_delete(iot_os_reactor* reactor_handle)
+{
+	reactor_t *reactor = (reactor_t *)reactor_handle;
+
+	if (reactor == NULL)
+		return;
+
+	pthread_mutex_lock(&reactor->lock);
+	while (reactor->sources != NULL) {
+		reactor_src_t *src = reactor->sources;
+		reactor->sources = src->next;
+		_reactor_detach(reactor, src);
+	}
+	pthread_mutex_unlock(&reactor->lock);
+	_reactor_free(reactor->retired);
+	close(reactor->epfd);
+	close(reactor->stop_fd);
+	pthread_mutex_destroy(&reactor->lock);
+	free(reactor);
+}
+
+static int _reactor_add(reactor_t *reactor, int type, void *source, int fd, bool owns_fd,
+		iot_os_reactor_cb cb, void *user_data, reactor_src_t **out)
+{
+	reactor_src_t *src;
+	struct epoll_event ev = {0,};
+
+	if (fd < 0)
+		return IOT_OS_FALSE;
+
+	src = calloc(1, sizeof(reactor_src_t));
+	if (src == NULL) {
+		if (owns_fd)
+			close(fd);
+		return IOT_OS_FALSE;
+	}
+
+	src->type = type;
+	src->source = source;
+	src->fd = fd;
+	src->owns_fd = owns_fd;
+	src->cb = cb;
+	src->user_data = user_data;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		if (owns_fd)
+			close(fd);
+		free(src);
+		return IOT_OS_FALSE;
+	}
+
+	pthread_mutex_lock(&reactor->lock);
+	src->next = reactor->sources;
+	reactor->sources = src;
+	pthread_mutex_unlock(&reactor->lock);
+
+	*out = src;
+	return IOT_OS_TRUE;
+}
+
+int iot_os_reactor_add_eventgroup(iot_os_reactor* reactor_handle, iot_os_eventgroup* eventgroup_handle,
+		unsigned int bits, iot_os_reactor_cb cb, void *user_data)
+{
+	eventgroup_t *eventgroup = eventgroup_handle;
+	reactor_src_t *src;
+
+	if (reactor_handle == NULL || eventgroup == NULL || cb == NULL ||
+			__atomic_load_n(&eventgroup->notify_fd, __ATOMIC_ACQUIRE) >= 0)
+		return IOT_OS_FALSE;
+
+	if (!_reactor_add(reactor_handle, REACTOR_SRC_EVENTGROUP, eventgroup,
+			eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), true, cb, user_data, &src))
+		return IOT_OS_FALSE;
+
+	__atomic_store_n(&eventgroup->notify_fd, src->fd, __ATOMIC_RELEASE);
+	__atomic_store_n(&eventgroup->notify_bits, bits, __ATOMIC_RELEASE);
+	__atomic_store_n(&eventgroup->reactor, reactor_handle, __ATOMIC_RELEASE);
+	/* Bits that are already set count as an event */
+	if (__atomic_load_n(&eventgroup->bits, __ATOMIC_SEQ_CST) & bits)
+		_notify_fd_signal(&eventgroup->notify_fd);
+
+	return IOT_OS_TRUE;
+}
+
+int iot_os_reactor_add_queue(iot_os_reactor* reactor_handle, iot_os_queue* queue_handle,
+		iot_os_reactor_cb cb, void *user_data)
+{
+	iot_os_queue_posix_t *queue = (iot_os_queue_posix_t *)queue_handle;
+	reactor_src_t *src;
+
+	if (reactor_handle == NULL || queue == NULL || cb == NULL)
+		return IOT_OS_FALSE;
+
+	if (__atomic_load_n(&queue->reactor, __ATOMIC_ACQUIRE) != NULL)
+		return IOT_OS_FALSE;
+
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_QUEUE_MQUEUE)
+	/* A Linux mqd_t is pollable as is */
+	if (!_reactor_add(reactor_handle, REACTOR_SRC_QUEUE, queue, queue->mqd, false,
+			cb, user_data, &src))
+		return IOT_OS_FALSE;
+#else
+	if (!_reactor_add(reactor_handle, REACTOR_SRC_QUEUE, queue,
+			eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), true, cb, user_data, &src))
+		return IOT_OS_FALSE;
+
+	__atomic_store_n(&queue->notify_fd, src->fd, __ATOMIC_RELEASE);
+	if (__atomic_load_n(&queue->items.count, __ATOMIC_SEQ_CST) > 0)
+		_notify_fd_signal(&queue->notify_fd);
+#endif
+	__atomic_store_n(&queue->reactor, reactor_handle, __ATOMIC_RELEASE);
+
+	return IOT_OS_TRUE;
+}
+
+int iot_os_reactor_add_timer(iot_os_reactor* reactor_handle, iot_os_timer timer,
+		iot_os_reactor_cb cb, void *user_data)
+{
+	os_timer_t *os_timer = (os_timer_t *)timer;
+	reactor_src_t *src;
+
+	if (reactor_handle == NULL || os_timer == NULL || cb == NULL ||
+			__atomic_load_n(&os_timer->notify_fd, __ATOMIC_ACQUIRE) >= 0)
+		return IOT_OS_FALSE;
+
+	if (!_reactor_add(reactor_handle, REACTOR_SRC_TIMER, os_timer,
+			timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), true,
+			cb, user_data, &src))
+		return IOT_OS_FALSE;
+
+	__atomic_store_n(&os_timer->notify_fd, src->fd, __ATOMIC_RELEASE);
+	__atomic_store_n(&os_timer->reactor, reactor_handle, __ATOMIC_RELEASE);
+	_timer_notify_arm(os_timer);
+
+	return IOT_OS_TRUE;
+}
+
+int iot_os_reactor_remove(iot_os_reactor* reactor_handle, void *source)
+{
+	reactor_t *reactor = (reactor_t *)reactor_handle;
+	reactor_src_t **link;
+	reactor_src_t *src = NULL;
+
+	if (reactor == NULL || source == NULL)
+		return IOT_OS_FALSE;
+
+	pthread_mutex_lock(&reactor->lock);
+	for (link = &reactor->sources; *link != NULL; link = &(*link)->next) {
+		if ((*link)->source == source) {
+			src = *link;
+			*link = src->next;
+			epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+			_reactor_detach(reactor, src);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&reactor->lock);
+
+	return (src != NULL) ? IOT_OS_TRUE : IOT_OS_FALSE;
+}
+
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_QUEUE_MQUEUE)
+/* A source's descriptor was replaced (mqueue reset); register the new one */
+static int _reactor_refd(iot_os_reactor *reactor_handle, void *source, int fd)
+{
+	reactor_t *reactor = (reactor_t *)reactor_handle;
+	reactor_src_t *src;
+	struct epoll_event ev = {0,};
+	int ret = IOT_OS_FALSE;
+
+	pthread_mutex_lock(&reactor->lock);
+	for (src = reactor->sources; src != NULL; src = src->next) {
+		if (src->source == source) {
+			src->fd = fd;
+			ev.events = EPOLLIN;
+			ev.data.ptr = src;
+			if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+				ret = IOT_OS_TRUE;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&reactor->lock);
+
+	return ret;
+}
+#endif
+
+int iot_os_reactor_run_once(iot_os_reactor* reactor_handle, unsigned int wait_time_ms)
+{
+	reactor_t *reactor = (reactor_t *)reactor_handle;
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	reactor_src_t *retired;
+	int timeout;
+	int count;
+	int dispatched;
+
+	if (reactor == NULL)
+		return -1;
+
+	if (wait_time_ms == iot_os_max_delay)
+		timeout = -1;
+	else
+		timeout = (wait_time_ms > INT_MAX) ? INT_MAX : (int)wait_time_ms;
+
+	/* Sources retired before this point can't show up in our events[] */
+	pthread_mutex_lock(&reactor->lock);
+	retired = _reactor_reap(reactor);
+	reactor->running++;
+	pthread_mutex_unlock(&reactor->lock);
+	_reactor_free(retired);
+
+	count = epoll_wait(reactor->epfd, events, REACTOR_MAX_EVENTS, timeout);
+	if (count < 0)
+		count = (errno == EINTR) ? 0 : -1;
+
+	dispatched = 0;
+	for (int i = 0; i < count; i++) {
+		reactor_src_t *src = events[i].data.ptr;
+		uint64_t value;
+
+		if (src == NULL) {
+			ssize_t ret = read(reactor->stop_fd, &value, sizeof(value));
+			(void)ret;
+			continue;
+		}
+		if (__atomic_load_n(&src->dead, __ATOMIC_ACQUIRE))
+			continue;			/* removed by an earlier callback or another thread */
+		if (src->owns_fd) {
+			/* Reset the eventfd counter / timerfd expiry count */
+			ssize_t ret = read(src->fd, &value, sizeof(value));
+			(void)ret;
+		}
+		src->cb(src->source, src->user_data);
+		dispatched++;
+	}
+
+	pthread_mutex_lock(&reactor->lock);
+	reactor->running--;
+	retired = _reactor_reap(reactor);
+	pthread_mutex_unlock(&reactor->lock);
+	_reactor_free(retired);
+
+	return (count < 0) ? -1 : dispatched;
+}
+
+int iot_os_reactor_run(iot_os_reactor* reactor_handle)
+{
+	reactor_t *reactor = (reactor_t *)reactor_handle;
 
-	pthread_mutex_t* mutex_p = mutex->sem;
+	if (reactor == NULL)
+		return IOT_OS_FALSE;
 
-	pthread_mutex_unlock(mutex_p);
+	__atomic_store_n(&reactor->stop, false, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&reactor->stop, __ATOMIC_ACQUIRE)) {
+		if (iot_os_reactor_run_once(reactor, iot_os_max_delay) < 0)
+			return IOT_OS_FALSE;
+	}
 
 	return IOT_OS_TRUE;
 }
 
-void iot_os_mutex_destroy(iot_os_mutex* mutex)
+void iot_os_reactor_stop(iot_os_reactor* reactor_handle)
 {
-	if (!mutex || !mutex->sem) {
+	reactor_t *reactor = (reactor_t *)reactor_handle;
+
+	if (reactor == NULL)
+		return;
+
+	__atomic_store_n(&reactor->stop, true, __ATOMIC_RELEASE);
+	_notify_fd_signal(&reactor->stop_fd);
+}
+
+/* Trace */
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_TRACE)
+/*
+ * Each thread writes only to its own ring, so recording is a plain store
+ * sequence with no locks or RMW atomics. Rings are pushed onto a global
+ * list once and never freed; the dumper reads them concurrently and uses
+ * the per-event seq to drop entries that were being overwritten.
+ */
+#ifndef CONFIG_STDK_IOT_CORE_OS_POSIX_TRACE_EVENTS
+#define CONFIG_STDK_IOT_CORE_OS_POSIX_TRACE_EVENTS 2048	/* per thread, power of 2 */
+#endif
+#ifndef CONFIG_STDK_IOT_CORE_OS_POSIX_TRACE_FILE
+#define CONFIG_STDK_IOT_CORE_OS_POSIX_TRACE_FILE "/tmp/iot_os_trace.json"
+#endif
+#define TRACE_ARG_LEN 64
+#define TRACE_MASK (CONFIG_STDK_IOT_CORE_OS_POSIX_TRACE_EVENTS - 1)
+
+typedef struct {
+	unsigned int seq;		/* index + 1 once complete, 0 while being written */
+	char phase;
+	const char *name;
+	unsigned long long ts_ns;
+	char arg[TRACE_ARG_LEN];
+} trace_event_t;
+
+typedef struct trace_ring {
+	struct trace_ring *next;
+	pid_t tid;
+	char thread_name[16];
+	unsigned int head;
+	trace_event_t events[CONFIG_STDK_IOT_CORE_OS_POSIX_TRACE_EVENTS];
+} trace_ring_t;
+
+static trace_ring_t *trace_rings;
+static __thread trace_ring_t *trace_self;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+static void _trace_atexit(void)
+{
+	iot_os_trace_dump_file(NULL);
+}
+
+static void _trace_init(void)
+{
+	atexit(_trace_atexit);
+}
+
+static trace_ring_t *_trace_ring(void)
+{
+	trace_ring_t *ring = trace_self;
+
+	if (ring)
+		return ring;
+
+	pthread_once(&trace_once, _trace_init);
+
+	ring = mmap(NULL, sizeof(trace_ring_t), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED)
+		return NULL;
+
+	ring->tid = syscall(SYS_gettid);
+	pthread_getname_np(pthread_self(), ring->thread_name, sizeof(ring->thread_name));
+
+	ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, true,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	trace_self = ring;
+	return ring;
+}
+
+void iot_os_trace_record(char phase, const char *name, const char *arg)
+{
+	trace_ring_t *ring = _trace_ring();
+	trace_event_t *event;
+	unsigned int index;
+
+	if (ring == NULL)
 		return;
+
+	index = ring->head;
+	event = &ring->events[index & TRACE_MASK];
+
+	__atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	event->phase = phase;
+	event->name = name;
+	event->ts_ns = _monotonic_ns();
+	if (arg) {
+		strncpy(event->arg, arg, TRACE_ARG_LEN - 1);
+		event->arg[TRACE_ARG_LEN - 1] = '\0';
+	} else {
+		event->arg[0] = '\0';
 	}
-	pthread_mutex_t* mutex_p = mutex->sem;
 
-	pthread_mutex_destroy(mutex_p);
-	free(mutex_p);
-	mutex->sem = NULL;
+	__atomic_store_n(&event->seq, index + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, index + 1, __ATOMIC_RELEASE);
 }
 
-/* Delay */
-void iot_os_delay(unsigned int delay_ms)
+static void _trace_json_string(FILE *fp, const char *str)
 {
-	struct timespec ts = {0,};
+	fputc('"', fp);
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			fprintf(fp, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+	fputc('"', fp);
+}
 
-	ts.tv_sec = delay_ms / 1000;
-	ts.tv_nsec = (delay_ms % 1000) * 1000000;
+int iot_os_trace_dump(FILE *fp)
+{
+	trace_ring_t *ring;
+	trace_event_t event;
+	unsigned int head, index, seq;
+	int pid = getpid();
+	int count = 0;
 
-	nanosleep(&ts, NULL);
+	if (fp == NULL)
+		return 0;
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		fprintf(fp, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+				count ? ",\n" : "", pid, ring->tid);
+		_trace_json_string(fp, ring->thread_name);
+		fprintf(fp, "}}");
+		count++;
+
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		index = (head > CONFIG_STDK_IOT_CORE_OS_POSIX_TRACE_EVENTS) ?
+				head - CONFIG_STDK_IOT_CORE_OS_POSIX_TRACE_EVENTS : 0;
+
+		for (; index != head; index++) {
+			trace_event_t *slot = &ring->events[index & TRACE_MASK];
+
+			seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+			if (seq != index + 1)
+				continue;
+			memcpy(&event, slot, sizeof(event));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+				continue;
+			event.arg[TRACE_ARG_LEN - 1] = '\0';
+
+			fprintf(fp, ",\n{\"ph\":\"%c\",\"name\":", event.phase);
+			_trace_json_string(fp, event.name ? event.name : "");
+			fprintf(fp, ",\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03llu",
+					pid, ring->tid, event.ts_ns / 1000, event.ts_ns % 1000);
+			if (event.phase == 'i')
+				fprintf(fp, ",\"s\":\"t\"");
+			if (event.arg[0]) {
+				fprintf(fp, ",\"args\":{\"arg\":");
+				_trace_json_string(fp, event.arg);
+				fputc('}', fp);
+			}
+			fputc('}', fp);
+			count++;
+		}
+	}
+
+	fprintf(fp, "\n]}\n");
+	return count;
 }
 
-void iot_os_timer_count_ms(iot_os_timer timer, unsigned int timeout_ms)
+int iot_os_trace_dump_file(const char *path)
 {
-	timer_t* timer_id = (timer_t*) timer;
-	struct itimerspec it;
+	char tmppath[PATH_MAX];
+	FILE *fp;
+	int count;
+
+	if (path == NULL)
+		path = CONFIG_STDK_IOT_CORE_OS_POSIX_TRACE_FILE;
+
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	fp = fopen(tmppath, "w");
+	if (fp == NULL) {
+		IOT_ERROR("trace: cannot write %s (%d)", tmppath, errno);
+		return -1;
+	}
 
-	it.it_interval.tv_sec = 0;
-	it.it_interval.tv_nsec = 0;
-	it.it_value.tv_sec = timeout_ms / 1000;
-	it.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+	count = iot_os_trace_dump(fp);
+	if (fclose(fp) != 0 || rename(tmppath, path) != 0) {
+		IOT_ERROR("trace: cannot write %s (%d)", path, errno);
+		unlink(tmppath);
+		return -1;
+	}
 
-	int ret = timer_settime(*timer_id, 0, &it, NULL);
-	if (ret == -1) {
+	return count;
+}
+#endif /* CONFIG_STDK_IOT_CORE_OS_POSIX_TRACE */
+
+/* Memory */
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_SLAB_ALLOC)
+/*
+ * Size-class slab allocator. Small blocks come from 64KB mmap'd pages
+ * carved per class, so short-lived JSON/MQTT buffers never interleave
+ * with long-lived glibc heap objects. Freed blocks go to a per-thread
+ * cache first and spill to the class freelist in batches. Pages are kept
+ * for reuse by the same class. Anything above the largest class goes to
+ * malloc. mapped + large bytes are bounded by a hard cap.
+ */
+#ifndef CONFIG_STDK_IOT_CORE_OS_POSIX_SLAB_LIMIT
+#define CONFIG_STDK_IOT_CORE_OS_POSIX_SLAB_LIMIT (64 * 1024 * 1024)
+#endif
+
+#define SLAB_PAGE_SIZE (64 * 1024)
+#define SLAB_TCACHE_MAX 32
+#define SLAB_TCACHE_BATCH 16
+#define SLAB_LARGE 0xFFFFu
+#define SLAB_MAGIC 0x51ABu
+
+static const unsigned int slab_class_size[] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+#define SLAB_CLASSES (sizeof(slab_class_size) / sizeof(slab_class_size[0]))
+#define SLAB_MAX_SMALL 2048
+
+typedef union {
+	struct {
+		size_t size;
+		unsigned short cls;
+		unsigned short magic;
+	} h;
+	long long align_ll;
+	long double align_ld;
+	void *align_p;
+} slab_hdr_t;
+
+typedef struct slab_block {
+	struct slab_block *next;
+} slab_block_t;
+
+typedef struct {
+	pthread_mutex_t mutex;
+	slab_block_t *free_list;
+	unsigned char *cursor;
+	unsigned char *limit;
+} slab_class_t;
+
+typedef struct {
+	slab_block_t *head;
+	unsigned int count;
+} slab_tcache_t;
+
+static slab_class_t slab_classes[SLAB_CLASSES];
+static unsigned char slab_class_index[SLAB_MAX_SMALL / 16 + 1];
+static size_t slab_limit = CONFIG_STDK_IOT_CORE_OS_POSIX_SLAB_LIMIT;
+static size_t slab_reserved;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_tcache_key;
+static __thread slab_tcache_t slab_tcache[SLAB_CLASSES];
+
+/* Header size is a multiple of its alignment, not necessarily a power of two (12 on i386) */
+#define SLAB_ALIGN __alignof__(slab_hdr_t)
+#define SLAB_STRIDE(cls) ((sizeof(slab_hdr_t) + slab_class_size[cls] + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN)
+
+static void _slab_tcache_flush(void *unused);
+
+static void _slab_init(void)
+{
+	unsigned int cls = 0;
+
+	for (unsigned int i = 0; i < SLAB_CLASSES; i++)
+		pthread_mutex_init(&slab_classes[i].mutex, NULL);
+
+	for (unsigned int i = 0; i <= SLAB_MAX_SMALL / 16; i++) {
+		while (slab_class_size[cls] < i * 16)
+			cls++;
+		slab_class_index[i] = cls;
+	}
+
+	pthread_key_create(&slab_tcache_key, _slab_tcache_flush);
+}
+
+static bool _slab_reserve(size_t bytes)
+{
+	size_t cur = __atomic_load_n(&slab_reserved, __ATOMIC_RELAXED);
+
+	do {
+		if (cur + bytes > __atomic_load_n(&slab_limit, __ATOMIC_RELAXED))
+			return false;
+	} while (!__atomic_compare_exchange_n(&slab_reserved, &cur, cur + bytes, true,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return true;
+}
+
+static void _slab_unreserve(size_t bytes)
+{
+	__atomic_fetch_sub(&slab_reserved, bytes, __ATOMIC_RELAXED);
+}
+
+/* Take up to count blocks from the class, carving a new page if needed */
+static slab_block_t *_slab_refill(unsigned int cls, unsigned int count, unsigned int *got)
+{
+	slab_class_t *sc = &slab_classes[cls];
+	slab_block_t *head = NULL;
+	size_t stride = SLAB_STRIDE(cls);
+
+	*got = 0;
+	pthread_mutex_lock(&sc->mutex);
+	while (*got < count) {
+		slab_block_t *block = sc->free_list;
+
+		if (block != NULL) {
+			sc->free_list = block->next;
+		} else {
+			if (sc->cursor == NULL || sc->cursor + stride > sc->limit) {
+				void *page;
+
+				if (*got > 0 || !_slab_reserve(SLAB_PAGE_SIZE))
+					break;
+				page = mmap(NULL, SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (page == MAP_FAILED) {
+					_slab_unreserve(SLAB_PAGE_SIZE);
+					break;
+				}
+				sc->cursor = page;
+				sc->limit = (unsigned char *)page + SLAB_PAGE_SIZE;
+			}
+			slab_hdr_t *hdr = (slab_hdr_t *)sc->cursor;
+			hdr->h.cls = cls;
+			hdr->h.magic = SLAB_MAGIC;
+			block = (slab_block_t *)(hdr + 1);
+			sc->cursor += stride;
+		}
+		block->next = head;
+		head = block;
+		(*got)++;
+	}
+	pthread_mutex_unlock(&sc->mutex);
+
+	return head;
+}
+
+static void _slab_release(unsigned int cls, slab_block_t *head, slab_block_t *tail)
+{
+	slab_class_t *sc = &slab_classes[cls];
+
+	pthread_mutex_lock(&sc->mutex);
+	tail->next = sc->free_list;
+	sc->free_list = head;
+	pthread_mutex_unlock(&sc->mutex);
+}
+
+static void _slab_tcache_flush(void *unused)
+{
+	for (unsigned int cls = 0; cls < SLAB_CLASSES; cls++) {
+		slab_tcache_t *tc = &slab_tcache[cls];
+		slab_block_t *tail = tc->head;
+
+		if (tail == NULL)
+			continue;
+		while (tail->next != NULL)
+			tail = tail->next;
+		_slab_release(cls, tc->head, tail);
+		tc->head = NULL;
+		tc->count = 0;
+	}
+}
+
+static void *_slab_malloc(size_t size)
+{
+	slab_hdr_t *hdr;
+
+	pthread_once(&slab_once, _slab_init);
+
+	if (size <= SLAB_MAX_SMALL) {
+		unsigned int cls = slab_class_index[(size + 15) / 16];
+		slab_tcache_t *tc = &slab_tcache[cls];
+		slab_block_t *block;
+
+		if (tc->head == NULL) {
+			if (pthread_getspecific(slab_tcache_key) == NULL)
+				pthread_setspecific(slab_tcache_key, slab_tcache);
+			tc->head = _slab_refill(cls, SLAB_TCACHE_BATCH, &tc->count);
+			if (tc->head == NULL)
+				return NULL;
+		}
+		block = tc->head;
+		tc->head = block->next;
+		tc->count--;
+
+		hdr = (slab_hdr_t *)block - 1;
+		hdr->h.size = size;
+		return block;
+	}
+
+	if (!_slab_reserve(size + sizeof(slab_hdr_t)))
+		return NULL;
+	hdr = malloc(size + sizeof(slab_hdr_t));
+	if (hdr == NULL) {
+		_slab_unreserve(size + sizeof(slab_hdr_t));
+		return NULL;
+	}
+	hdr->h.size = size;
+	hdr->h.cls = SLAB_LARGE;
+	hdr->h.magic = SLAB_MAGIC;
+
+	return hdr + 1;
+}
+
+static void _slab_free(void *ptr)
+{
+	slab_hdr_t *hdr;
+
+	if (ptr == NULL)
+		return;
+
+	hdr = (slab_hdr_t *)ptr - 1;
+	if (hdr->h.magic != SLAB_MAGIC) {
+		IOT_ERROR("slab: bad free %p", ptr);
+		return;
+	}
+
+	if (hdr->h.cls == SLAB_LARGE) {
+		_slab_unreserve(hdr->h.size + sizeof(slab_hdr_t));
+		hdr->h.magic = 0;
+		free(hdr);
 		return;
 	}
+
+	unsigned int cls = hdr->h.cls;
+	slab_tcache_t *tc = &slab_tcache[cls];
+	slab_block_t *block = ptr;
+
+	if (tc->head == NULL && pthread_getspecific(slab_tcache_key) == NULL)
+		pthread_setspecific(slab_tcache_key, slab_tcache);
+	block->next = tc->head;
+	tc->head = block;
+	if (++tc->count > SLAB_TCACHE_MAX) {
+		/* Spill the older half back to the class freelist */
+		slab_block_t *keep_tail = tc->head;
+
+		for (unsigned int i = 1; i < SLAB_TCACHE_MAX / 2; i++)
+			keep_tail = keep_tail->next;
+		slab_block_t *spill = keep_tail->next;
+		slab_block_t *spill_tail = spill;
+		while (spill_tail->next != NULL)
+			spill_tail = spill_tail->next;
+		keep_tail->next = NULL;
+		tc->count = SLAB_TCACHE_MAX / 2;
+		_slab_release(cls, spill, spill_tail);
+	}
 }
 
-unsigned int iot_os_timer_left_ms(iot_os_timer timer)
+static size_t _slab_usable_size(void *ptr)
 {
-	timer_t* timer_id = (timer_t*) timer;
-	struct itimerspec it = {0,};
-	unsigned int left = 0;
+	slab_hdr_t *hdr = (slab_hdr_t *)ptr - 1;
 
-	int ret = timer_gettime(*timer_id, &it);
-	if (ret == -1) {
-		return 0;
+	if (hdr->h.cls == SLAB_LARGE)
+		return hdr->h.size;
+	return slab_class_size[hdr->h.cls];
+}
+
+static void *_slab_realloc(void *ptr, size_t size)
+{
+	void *new_ptr;
+	size_t old_size;
+
+	if (ptr == NULL)
+		return _slab_malloc(size);
+	if (size == 0) {
+		_slab_free(ptr);
+		return NULL;
+	}
+
+	old_size = _slab_usable_size(ptr);
+	if (old_size <= SLAB_MAX_SMALL && size <= old_size) {
+		((slab_hdr_t *)ptr - 1)->h.size = size;
+		return ptr;
 	}
 
-	return (it.it_value.tv_sec * 1000) + (it.it_value.tv_nsec / 1000000);
+	new_ptr = _slab_malloc(size);
+	if (new_ptr == NULL)
+		return NULL;
+	memcpy(new_ptr, ptr, (old_size < size) ? old_size : size);
+	_slab_free(ptr);
+
+	return new_ptr;
 }
 
-char iot_os_timer_isexpired(iot_os_timer timer)
+void iot_os_mem_set_limit(size_t limit)
+{
+	__atomic_store_n(&slab_limit, limit, __ATOMIC_RELAXED);
+}
+
+size_t iot_os_mem_get_reserved(void)
 {
-	timer_t* timer_id = (timer_t*) timer;
-	struct itimerspec it = {0,};
+	return __atomic_load_n(&slab_reserved, __ATOMIC_RELAXED);
+}
+#endif /* CONFIG_STDK_IOT_CORE_OS_POSIX_SLAB_ALLOC */
 
-	int ret = timer_gettime(*timer_id, &it);
-	if (ret == -1) {
-		return IOT_OS_TRUE;
+/* Allocator backend: slab when configured, glibc otherwise */
+static inline void *_mem_alloc(size_t size)
+{
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_SLAB_ALLOC)
+	return _slab_malloc(size);
+#else
+	return malloc(size);
+#endif
+}
+
+static inline void *_mem_realloc(void *ptr, size_t size)
+{
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_SLAB_ALLOC)
+	return _slab_realloc(ptr, size);
+#else
+	return realloc(ptr, size);
+#endif
+}
+
+static inline void _mem_free(void *ptr)
+{
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_SLAB_ALLOC)
+	_slab_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MEM_PROFILE)
+/*
+ * Allocation profiling. Each block carries a small header with its size
+ * and the address of the iot_os_* caller, so frees can be attributed.
+ * Counters are plain atomics; the caller table is a fixed open-addressed
+ * hash, with one overflow slot once it fills up. Sending
+ * CONFIG_STDK_IOT_CORE_OS_POSIX_MEM_PROFILE_SIGNAL dumps to stderr.
+ */
+#ifndef CONFIG_STDK_IOT_CORE_OS_POSIX_MEM_PROFILE_SIGNAL
+#define CONFIG_STDK_IOT_CORE_OS_POSIX_MEM_PROFILE_SIGNAL SIGUSR2
+#endif
+#define MEM_PROF_CALLERS 256
+
+typedef union {
+	struct {
+		size_t size;
+		void *caller;
+	} h;
+	long long align_ll;
+	long double align_ld;
+} mem_prof_hdr_t;
+
+typedef struct {
+	void *caller;
+	unsigned long allocs;
+	long live_bytes;
+} mem_prof_caller_t;
+
+static struct {
+	size_t live_bytes;
+	size_t peak_bytes;
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long size_hist[IOT_OS_MEM_HIST_BUCKETS];
+	mem_prof_caller_t callers[MEM_PROF_CALLERS + 1];
+	unsigned long long start_ns;
+	unsigned long long last_dump_ns;
+	unsigned long last_dump_allocs;
+} mem_prof;
+
+static pthread_once_t mem_prof_once = PTHREAD_ONCE_INIT;
+static sem_t mem_prof_sem;
+
+static void _mem_prof_signal(int sig)
+{
+	sem_post(&mem_prof_sem);
+}
+
+static void *_mem_prof_dumper(void *arg)
+{
+	for (;;) {
+		if (sem_wait(&mem_prof_sem) == 0)
+			iot_os_mem_dump_stats(stderr);
 	}
+	return NULL;
+}
 
-	if (it.it_value.tv_sec == 0 && it.it_value.tv_nsec == 0) {
-		return IOT_OS_TRUE;
-	} else {
-		return IOT_OS_FALSE;
+static void _mem_prof_init(void)
+{
+	struct sigaction sa;
+	pthread_t thread;
+
+	mem_prof.start_ns = _monotonic_ns();
+	mem_prof.last_dump_ns = mem_prof.start_ns;
+
+	sem_init(&mem_prof_sem, 0, 0);
+	if (pthread_create(&thread, NULL, _mem_prof_dumper, NULL) == 0) {
+		pthread_detach(thread);
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = _mem_prof_signal;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(CONFIG_STDK_IOT_CORE_OS_POSIX_MEM_PROFILE_SIGNAL, &sa, NULL);
 	}
 }
 
-int iot_os_timer_init(iot_os_timer *timer)
+static mem_prof_caller_t *_mem_prof_caller(void *caller)
 {
-	timer_t* timer_id = malloc(sizeof(timer_t));
-	struct sigevent sig;
+	unsigned int idx = ((uintptr_t)caller >> 2) % MEM_PROF_CALLERS;
+
+	for (unsigned int i = 0; i < MEM_PROF_CALLERS; i++) {
+		mem_prof_caller_t *entry = &mem_prof.callers[(idx + i) % MEM_PROF_CALLERS];
+		void *cur = __atomic_load_n(&entry->caller, __ATOMIC_ACQUIRE);
+
+		if (cur == caller)
+			return entry;
+		if (cur == NULL) {
+			if (__atomic_compare_exchange_n(&entry->caller, &cur, caller, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || cur == caller)
+				return entry;
+		}
+	}
 
-	if (timer_id == NULL)
-		return IOT_ERROR_MEM_ALLOC;
+	return &mem_prof.callers[MEM_PROF_CALLERS];
+}
 
-	memset(&sig, '\0', sizeof(struct sigevent));
-	sig.sigev_notify = SIGEV_NONE;
-	sig.sigev_value.sival_ptr = timer_id;
-	int ret = timer_create(CLOCK_REALTIME, &sig, timer_id);
-	if (ret == -1) {
-		free(timer_id);
-		return IOT_ERROR_BAD_REQ;
+static unsigned int _mem_prof_bucket(size_t size)
+{
+	unsigned int bucket = 0;
+
+	while (size > 1 && bucket < IOT_OS_MEM_HIST_BUCKETS - 1) {
+		size >>= 1;
+		bucket++;
 	}
+	return bucket;
+}
+
+static void _mem_prof_account(size_t size, void *caller)
+{
+	size_t live = __atomic_add_fetch(&mem_prof.live_bytes, size, __ATOMIC_RELAXED);
+	size_t peak = __atomic_load_n(&mem_prof.peak_bytes, __ATOMIC_RELAXED);
+	mem_prof_caller_t *entry = _mem_prof_caller(caller);
+
+	while (live > peak && !__atomic_compare_exchange_n(&mem_prof.peak_bytes, &peak, live,
+			true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	__atomic_fetch_add(&mem_prof.allocs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&mem_prof.size_hist[_mem_prof_bucket(size)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&entry->allocs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&entry->live_bytes, (long)size, __ATOMIC_RELAXED);
+}
 
-	*timer = timer_id;
+static void _mem_prof_unaccount(mem_prof_hdr_t *hdr)
+{
+	mem_prof_caller_t *entry = _mem_prof_caller(hdr->h.caller);
 
-	return IOT_ERROR_NONE;
+	__atomic_fetch_sub(&mem_prof.live_bytes, hdr->h.size, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&mem_prof.frees, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&entry->live_bytes, (long)hdr->h.size, __ATOMIC_RELAXED);
 }
 
-void iot_os_timer_destroy(iot_os_timer *timer)
+static void *_mem_prof_alloc(size_t size, void *caller)
+{
+	mem_prof_hdr_t *hdr;
+
+	pthread_once(&mem_prof_once, _mem_prof_init);
+
+	if (size > SIZE_MAX - sizeof(mem_prof_hdr_t))
+		return NULL;
+	hdr = _mem_alloc(size + sizeof(mem_prof_hdr_t));
+	if (hdr == NULL)
+		return NULL;
+
+	hdr->h.size = size;
+	hdr->h.caller = caller;
+	_mem_prof_account(size, caller);
+
+	return hdr + 1;
+}
+
+static void *_mem_prof_realloc(void *ptr, size_t size, void *caller)
+{
+	mem_prof_hdr_t *hdr;
+	mem_prof_hdr_t saved;
+
+	if (ptr == NULL)
+		return _mem_prof_alloc(size, caller);
+	if (size > SIZE_MAX - sizeof(mem_prof_hdr_t))
+		return NULL;
+
+	hdr = (mem_prof_hdr_t *)ptr - 1;
+	saved = *hdr;
+	hdr = _mem_realloc(hdr, size + sizeof(mem_prof_hdr_t));
+	if (hdr == NULL)
+		return NULL;
+
+	_mem_prof_unaccount(&saved);
+	hdr->h.size = size;
+	hdr->h.caller = caller;
+	_mem_prof_account(size, caller);
+
+	return hdr + 1;
+}
+
+static void _mem_prof_free(void *ptr)
+{
+	mem_prof_hdr_t *hdr;
+
+	if (ptr == NULL)
+		return;
+
+	hdr = (mem_prof_hdr_t *)ptr - 1;
+	_mem_prof_unaccount(hdr);
+	_mem_free(hdr);
+}
+
+int iot_os_mem_get_stats(iot_os_mem_stats_t *stats)
 {
-	timer_t* timer_id = (timer_t*) *timer;
+	if (stats == NULL)
+		return IOT_OS_FALSE;
+
+	pthread_once(&mem_prof_once, _mem_prof_init);
+
+	stats->live_bytes = __atomic_load_n(&mem_prof.live_bytes, __ATOMIC_RELAXED);
+	stats->peak_bytes = __atomic_load_n(&mem_prof.peak_bytes, __ATOMIC_RELAXED);
+	stats->allocs = __atomic_load_n(&mem_prof.allocs, __ATOMIC_RELAXED);
+	stats->frees = __atomic_load_n(&mem_prof.frees, __ATOMIC_RELAXED);
+	stats->uptime_ms = (unsigned long)((_monotonic_ns() - mem_prof.start_ns) / 1000000ULL);
+	for (int i = 0; i < IOT_OS_MEM_HIST_BUCKETS; i++)
+		stats->size_hist[i] = __atomic_load_n(&mem_prof.size_hist[i], __ATOMIC_RELAXED);
+
+	return IOT_OS_TRUE;
+}
 
-	timer_delete(*timer_id);
-	free(timer_id);
-	timer = NULL;
+void iot_os_mem_dump_stats(FILE *fp)
+{
+	iot_os_mem_stats_t stats;
+	unsigned long long now = _monotonic_ns();
+	unsigned long long window_ms;
+	unsigned long window_allocs;
+
+	iot_os_mem_get_stats(&stats);
+	window_ms = (now - mem_prof.last_dump_ns) / 1000000ULL;
+	window_allocs = stats.allocs - mem_prof.last_dump_allocs;
+	mem_prof.last_dump_ns = now;
+	mem_prof.last_dump_allocs = stats.allocs;
+
+	fprintf(fp, "[os] mem live=%zu peak=%zu allocs=%lu frees=%lu uptime=%lums\n",
+			stats.live_bytes, stats.peak_bytes, stats.allocs, stats.frees, stats.uptime_ms);
+	fprintf(fp, "[os] mem rate=%.1f/s total, %.1f/s since last dump\n",
+			stats.uptime_ms ? stats.allocs * 1000.0 / stats.uptime_ms : 0.0,
+			window_ms ? window_allocs * 1000.0 / window_ms : 0.0);
+	for (int i = 0; i < IOT_OS_MEM_HIST_BUCKETS; i++) {
+		if (stats.size_hist[i])
+			fprintf(fp, "[os] mem size %8lu..%-8lu %lu\n",
+					i ? 1UL << i : 0UL, (1UL << (i + 1)) - 1, stats.size_hist[i]);
+	}
+	for (int i = 0; i <= MEM_PROF_CALLERS; i++) {
+		mem_prof_caller_t *entry = &mem_prof.callers[i];
+		unsigned long allocs = __atomic_load_n(&entry->allocs, __ATOMIC_RELAXED);
+
+		if (allocs == 0)
+			continue;
+		fprintf(fp, "[os] mem caller %p allocs=%lu live=%ld\n",
+				(i == MEM_PROF_CALLERS) ? NULL : entry->caller, allocs,
+				__atomic_load_n(&entry->live_bytes, __ATOMIC_RELAXED));
+	}
+	fflush(fp);
 }
+#endif /* CONFIG_STDK_IOT_CORE_OS_POSIX_MEM_PROFILE */
 
 void *iot_os_malloc(size_t size)
 {
-    return malloc(size);
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MEM_PROFILE)
+    return _mem_prof_alloc(size, __builtin_return_address(0));
+#else
+    return _mem_alloc(size);
+#endif
 }
 
 void *iot_os_calloc(size_t nmemb, size_t size)
 {
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_SLAB_ALLOC) || defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MEM_PROFILE)
+    void *ptr;
+
+    if (size != 0 && nmemb > SIZE_MAX / size)
+        return NULL;
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MEM_PROFILE)
+    ptr = _mem_prof_alloc(nmemb * size, __builtin_return_address(0));
+#else
+    ptr = _mem_alloc(nmemb * size);
+#endif
+    if (ptr != NULL)
+        memset(ptr, 0, nmemb * size);
+    return ptr;
+#else
     return calloc(nmemb, size);
+#endif
 }
 
 char *iot_os_realloc(void *ptr, size_t size)
 {
-    return realloc(ptr, size);
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MEM_PROFILE)
+    return _mem_prof_realloc(ptr, size, __builtin_return_address(0));
+#else
+    return _mem_realloc(ptr, size);
+#endif
 }
 
 void iot_os_free(void *ptr)
 {
-    return free(ptr);
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MEM_PROFILE)
+    _mem_prof_free(ptr);
+#else
+    _mem_free(ptr);
+#endif
 }
 
 char *iot_os_strdup(const char *src)
 {
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_SLAB_ALLOC) || defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MEM_PROFILE)
+    size_t len;
+    char *dst;
+
+    if (src == NULL)
+        return NULL;
+    len = strlen(src) + 1;
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MEM_PROFILE)
+    dst = _mem_prof_alloc(len, __builtin_return_address(0));
+#else
+    dst = _mem_alloc(len);
+#endif
+    if (dst != NULL)
+        memcpy(dst, src, len);
+    return dst;
+#else
     return strdup(src);
+#endif
 }
@@ -0,0 +1,368 @@
+/* ***************************************************************************
+ *
+ * Copyright 2019-2020 Samsung Electronics All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+ * either express or implied. See the License for the specific
+ * language governing permissions and limitations under the License.
+ *
+ ****************************************************************************/
+
+#ifndef _IOT_OS_UTIL_POSIX_H_
+#define _IOT_OS_UTIL_POSIX_H_
+
+#include <stdio.h>
+#include <time.h>
+#include "iot_os_util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief	Ask a thread created by iot_os_thread_create to stop
+ *
+ * The request is cooperative; the thread sees it through
+ * iot_os_thread_should_stop(). iot_os_thread_delete() uses the same flag
+ * before falling back to cancellation, for threads that have polled it at
+ * least once; any other thread is cancelled straight away.
+ *
+ * @param[in] thread_handle	handle from iot_os_thread_create or iot_os_thread_get_current_handle
+ * @return	IOT_OS_TRUE on success
+ */
+int iot_os_thread_stop(iot_os_thread thread_handle);
+
+/**
+ * @brief	Check whether the calling thread has been asked to stop
+ *
+ * @return	non-zero if iot_os_thread_stop() was called for this thread
+ */
+int iot_os_thread_should_stop(void);
+
+/**
+ * @brief	Wait for a thread to finish and release its handle
+ *
+ * @param[in] thread_handle	handle from iot_os_thread_create or iot_os_thread_get_current_handle
+ * @param[in] wait_time_ms	maximum wait time in ms (iot_os_max_delay for forever)
+ * @return	IOT_OS_TRUE if the thread finished and the handle was released,
+ *		IOT_OS_FALSE on timeout (the handle stays valid)
+ */
+int iot_os_thread_join(iot_os_thread thread_handle, unsigned int wait_time_ms);
+
+typedef void iot_os_bufpool;
+
+/**
+ * @brief	Create a pool of fixed-size buffers for zero-copy queues
+ *
+ * @param[in] buf_count	number of buffers (at most 65534)
+ * @param[in] buf_size	usable size of each buffer
+ * @return	pool handle, or NULL on failure
+ */
+iot_os_bufpool* iot_os_bufpool_create(int buf_count, size_t buf_size);
+
+/**
+ * @brief	Delete a buffer pool; every buffer must have been returned
+ */
+void iot_os_bufpool_delete(iot_os_bufpool* pool_handle);
+
+/**
+ * @brief	Take a buffer from a pool
+ *
+ * @param[in] pool_handle	pool to take from
+ * @param[in] wait_time_ms	maximum wait time in ms when the pool is empty
+ * @return	buffer, or NULL on timeout
+ */
+void* iot_os_bufpool_get(iot_os_bufpool* pool_handle, unsigned int wait_time_ms);
+
+/**
+ * @brief	Return a buffer to the pool it came from
+ */
+void iot_os_bufpool_put(void* buf);
+
+/**
+ * @brief	Get the usable size of a pooled buffer
+ */
+size_t iot_os_bufpool_buf_size(void* buf);
+
+/**
+ * @brief	Create a queue that passes pooled buffers by pointer
+ *
+ * Send transfers ownership of the buffer to the receiver, which returns
+ * it with iot_os_bufpool_put() when done. No payload bytes are copied.
+ *
+ * @param[in] queue_length	maximum number of buffers in flight
+ * @return	queue handle usable with iot_os_queue_send_buf/receive_buf
+ */
+iot_os_queue* iot_os_queue_create_buf(int queue_length);
+
+/**
+ * @brief	Hand a pooled buffer to the receiver of a buffer queue
+ */
+int iot_os_queue_send_buf(iot_os_queue* queue_handle, void* buf, unsigned int wait_time_ms);
+
+/**
+ * @brief	Take ownership of the next pooled buffer from a buffer queue
+ */
+int iot_os_queue_receive_buf(iot_os_queue* queue_handle, void** buf, unsigned int wait_time_ms);
+
+/**
+ * @brief	Wait for bits of an event group using the full 32-bit mask
+ *
+ * @param[in] eventgroup_handle	handle of the event group
+ * @param[in] bits_to_wait_for	bits to wait for
+ * @param[in] clear_on_exit	clear the waited bits before returning if satisfied
+ * @param[in] wait_for_all	true to wait for all bits, false for any of them
+ * @param[in] wait_time_ms	maximum wait time in ms (iot_os_max_delay for forever)
+ * @return	event bits as they were when the wait ended
+ */
+unsigned int iot_os_eventgroup_wait_bits_ex(iot_os_eventgroup* eventgroup_handle,
+		const unsigned int bits_to_wait_for, const int clear_on_exit,
+		const int wait_for_all, const unsigned int wait_time_ms);
+
+/**
+ * @brief	Set bits of an event group using the full 32-bit mask
+ *
+ * Every waiter whose condition becomes true is woken.
+ */
+int iot_os_eventgroup_set_bits_ex(iot_os_eventgroup* eventgroup_handle,
+		const unsigned int bits_to_set);
+
+/**
+ * @brief	Clear bits of an event group using the full 32-bit mask
+ */
+int iot_os_eventgroup_clear_bits_ex(iot_os_eventgroup* eventgroup_handle,
+		const unsigned int bits_to_clear);
+
+/**
+ * @brief	Drift-free periodic schedule, see iot_os_periodic_wait()
+ */
+typedef struct {
+	struct timespec next;		/**< @brief next absolute release on CLOCK_MONOTONIC */
+	unsigned int period_ms;		/**< @brief period length */
+	unsigned long cycles;		/**< @brief completed waits */
+	unsigned long overruns;		/**< @brief releases skipped because the caller was late */
+	unsigned int last_slip_us;	/**< @brief wake-up latency of the last release */
+	unsigned int max_slip_us;	/**< @brief worst wake-up latency seen */
+} iot_os_periodic;
+
+/**
+ * @brief	Start a periodic schedule; the first release is one period from now
+ *
+ * @param[out] periodic	schedule to initialize
+ * @param[in] period_ms	period length in ms
+ * @return	IOT_OS_TRUE on success
+ */
+int iot_os_periodic_init(iot_os_periodic *periodic, unsigned int period_ms);
+
+/**
+ * @brief	Sleep until the next release of a periodic schedule
+ *
+ * Releases are exact multiples of the period from the start, so work time
+ * and sleep latency do not drift the cadence.
+ *
+ * @param[in] periodic	schedule started by iot_os_periodic_init
+ * @return	number of releases skipped because the caller overran (0 if on time)
+ */
+unsigned int iot_os_periodic_wait(iot_os_periodic *periodic);
+
+typedef void iot_os_reactor;
+
+/**
+ * @brief	Reactor callback
+ *
+ * @param[in] source	the event group, queue or timer that became ready
+ * @param[in] user_data	pointer given at registration
+ */
+typedef void (*iot_os_reactor_cb)(void *source, void *user_data);
+
+/**
+ * @brief	Create an epoll reactor that event groups, queues and timers can attach to
+ *
+ * A single thread running iot_os_reactor_run() then services every
+ * attached object. Callbacks must not block; they drain their source with
+ * a wait time of 0.
+ *
+ * @return	reactor handle, or NULL on failure
+ */
+iot_os_reactor* iot_os_reactor_create(void);
+
+/**
+ * @brief	Delete a reactor, detaching every source still registered
+ */
+void iot_os_reactor_delete(iot_os_reactor* reactor_handle);
+
+/**
+ * @brief	Call cb whenever any of bits is set on the event group
+ */
+int iot_os_reactor_add_eventgroup(iot_os_reactor* reactor_handle, iot_os_eventgroup* eventgroup_handle,
+		unsigned int bits, iot_os_reactor_cb cb, void *user_data);
+
+/**
+ * @brief	Call cb whenever an item is sent to the queue
+ */
+int iot_os_reactor_add_queue(iot_os_reactor* reactor_handle, iot_os_queue* queue_handle,
+		iot_os_reactor_cb cb, void *user_data);
+
+/**
+ * @brief	Call cb when the timer's current count (iot_os_timer_count_ms) expires
+ */
+int iot_os_reactor_add_timer(iot_os_reactor* reactor_handle, iot_os_timer timer,
+		iot_os_reactor_cb cb, void *user_data);
+
+/**
+ * @brief	Detach an event group, queue or timer (deleting one detaches it as well)
+ */
+int iot_os_reactor_remove(iot_os_reactor* reactor_handle, void *source);
+
+/**
+ * @brief	Wait for and dispatch ready sources once
+ *
+ * @param[in] reactor_handle	reactor to service
+ * @param[in] wait_time_ms	maximum wait time in ms (iot_os_max_delay for forever)
+ * @return	number of events dispatched, 0 on timeout, -1 on error
+ */
+int iot_os_reactor_run_once(iot_os_reactor* reactor_handle, unsigned int wait_time_ms);
+
+/**
+ * @brief	Dispatch events until iot_os_reactor_stop() is called
+ */
+int iot_os_reactor_run(iot_os_reactor* reactor_handle);
+
+/**
+ * @brief	Make iot_os_reactor_run() return; safe to call from any thread
+ */
+void iot_os_reactor_stop(iot_os_reactor* reactor_handle);
+
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MUTEX_PROFILE)
+/**
+ * @brief	Write lock/contention counters and wait/hold histograms of every mutex
+ *
+ * Histogram buckets are powers of two in microseconds.
+ *
+ * @param[in] fp	output stream
+ */
+void iot_os_mutex_dump_stats(FILE *fp);
+#endif
+
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_SLAB_ALLOC)
+/**
+ * @brief	Set the hard cap on memory held by the slab allocator
+ *
+ * Slab pages and large blocks count against the cap; allocations that
+ * would exceed it fail with NULL. The build-time default is
+ * CONFIG_STDK_IOT_CORE_OS_POSIX_SLAB_LIMIT.
+ *
+ * @param[in] limit	cap in bytes
+ */
+void iot_os_mem_set_limit(size_t limit);
+
+/**
+ * @brief	Get the bytes currently held by the slab allocator
+ */
+size_t iot_os_mem_get_reserved(void);
+#endif
+
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_MEM_PROFILE)
+#define IOT_OS_MEM_HIST_BUCKETS 24
+
+/**
+ * @brief	Allocation profile of the iot_os_malloc family
+ */
+typedef struct {
+	size_t live_bytes;		/**< @brief bytes currently allocated */
+	size_t peak_bytes;		/**< @brief highest live_bytes seen */
+	unsigned long allocs;		/**< @brief number of allocations */
+	unsigned long frees;		/**< @brief number of frees */
+	unsigned long uptime_ms;	/**< @brief time since profiling started */
+	unsigned long size_hist[IOT_OS_MEM_HIST_BUCKETS];	/**< @brief allocations by size, bucket i holds [2^i, 2^(i+1)) */
+} iot_os_mem_stats_t;
+
+/**
+ * @brief	Get a snapshot of the allocation profile
+ *
+ * @param[out] stats	filled with the current counters
+ * @return	IOT_OS_TRUE on success
+ */
+int iot_os_mem_get_stats(iot_os_mem_stats_t *stats);
+
+/**
+ * @brief	Write the allocation profile, including per-caller live bytes
+ *
+ * Also triggered by CONFIG_STDK_IOT_CORE_OS_POSIX_MEM_PROFILE_SIGNAL
+ * (SIGUSR2 by default), which dumps to stderr.
+ *
+ * @param[in] fp	output stream
+ */
+void iot_os_mem_dump_stats(FILE *fp);
+#endif
+
+/*
+ * Tracepoints. With CONFIG_STDK_IOT_CORE_OS_POSIX_TRACE unset every macro
+ * below expands to nothing and its arguments are not evaluated. Names must
+ * be string literals; args are copied (truncated) at the tracepoint.
+ */
+#if defined(CONFIG_STDK_IOT_CORE_OS_POSIX_TRACE)
+/**
+ * @brief	Record one trace event in the calling thread's ring
+ *
+ * @param[in] phase	Chrome trace phase: 'B' begin, 'E' end, 'i' instant
+ * @param[in] name	event name, must outlive the trace (string literal)
+ * @param[in] arg	optional detail string, may be NULL
+ */
+void iot_os_trace_record(char phase, const char *name, const char *arg);
+
+/**
+ * @brief	Write every thread's recorded events as Chrome trace JSON
+ *
+ * The output loads in chrome://tracing and ui.perfetto.dev. Safe to call
+ * while other threads keep tracing; events overwritten mid-copy are skipped.
+ *
+ * @param[in] fp	output stream
+ * @return	number of events written
+ */
+int iot_os_trace_dump(FILE *fp);
+
+/**
+ * @brief	Write the trace to a file, replacing it atomically
+ *
+ * @param[in] path	output file, or NULL for CONFIG_STDK_IOT_CORE_OS_POSIX_TRACE_FILE
+ * @return	number of events written, or -1 if the file could not be written
+ */
+int iot_os_trace_dump_file(const char *path);
+
+typedef const char *iot_os_trace_scope;
+
+static inline void iot_os_trace_scope_end(iot_os_trace_scope *name)
+{
+	iot_os_trace_record('E', *name, NULL);
+}
+
+#define IOT_OS_TRACE_BEGIN(name, arg)	iot_os_trace_record('B', (name), (arg))
+#define IOT_OS_TRACE_END(name)		iot_os_trace_record('E', (name), NULL)
+#define IOT_OS_TRACE_INSTANT(name, arg)	iot_os_trace_record('i', (name), (arg))
+/* Begin here and end automatically when the enclosing block is left */
+#define IOT_OS_TRACE_SCOPE(name, arg) \
+	iot_os_trace_scope _iot_os_trace_scope __attribute__((cleanup(iot_os_trace_scope_end))) = \
+		(iot_os_trace_record('B', (name), (arg)), (name))
+#define IOT_OS_TRACE_DUMP()		iot_os_trace_dump_file(NULL)
+#else
+#define IOT_OS_TRACE_BEGIN(name, arg)	do { } while (0)
+#define IOT_OS_TRACE_END(name)		do { } while (0)
+#define IOT_OS_TRACE_INSTANT(name, arg)	do { } while (0)
+#define IOT_OS_TRACE_SCOPE(name, arg)	do { } while (0)
+#define IOT_OS_TRACE_DUMP()		do { } while (0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _IOT_OS_UTIL_POSIX_H_ */